@@ -0,0 +1,155 @@
+#pragma once
+
+#include <arch/i686/multiboot.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* ----- ACPI table layouts (only the fields the kernel uses) ----- */
+struct acpi_rsdp {
+  char signature[8]; // "RSD PTR "
+  uint8_t checksum;
+  char oem_id[6];
+  uint8_t revision; // 0 = ACPI 1.0, 2 = ACPI 2.0+
+  uint32_t rsdt_address;
+  // ACPI 2.0+
+  uint32_t length;
+  uint64_t xsdt_address;
+  uint8_t extended_checksum;
+  uint8_t reserved[3];
+} __attribute__((packed));
+
+struct acpi_sdt_header {
+  char signature[4];
+  uint32_t length; // whole table including this header
+  uint8_t revision;
+  uint8_t checksum;
+  char oem_id[6];
+  char oem_table_id[8];
+  uint32_t oem_revision;
+  uint32_t creator_id;
+  uint32_t creator_revision;
+} __attribute__((packed));
+
+/* Generic Address Structure */
+struct acpi_gas {
+  uint8_t address_space; // ACPI_GAS_*
+  uint8_t bit_width;
+  uint8_t bit_offset;
+  uint8_t access_size;
+  uint64_t address;
+} __attribute__((packed));
+
+enum {
+  ACPI_GAS_MEMORY = 0,
+  ACPI_GAS_IO = 1,
+};
+
+/* FADT ("FACP"), up to the extended PM timer block */
+struct acpi_fadt {
+  struct acpi_sdt_header header;
+  uint32_t firmware_ctrl;
+  uint32_t dsdt;
+  uint8_t reserved0;
+  uint8_t preferred_pm_profile;
+  uint16_t sci_interrupt;
+  uint32_t smi_command_port;
+  uint8_t acpi_enable;
+  uint8_t acpi_disable;
+  uint8_t s4bios_req;
+  uint8_t pstate_control;
+  uint32_t pm1a_event_block;
+  uint32_t pm1b_event_block;
+  uint32_t pm1a_control_block;
+  uint32_t pm1b_control_block;
+  uint32_t pm2_control_block;
+  uint32_t pm_timer_block; // I/O port of the PM timer (0 = none)
+  uint32_t gpe0_block;
+  uint32_t gpe1_block;
+  uint8_t pm1_event_length;
+  uint8_t pm1_control_length;
+  uint8_t pm2_control_length;
+  uint8_t pm_timer_length;
+  uint8_t gpe0_length;
+  uint8_t gpe1_length;
+  uint8_t gpe1_base;
+  uint8_t cstate_control;
+  uint16_t worst_c2_latency;
+  uint16_t worst_c3_latency;
+  uint16_t flush_size;
+  uint16_t flush_stride;
+  uint8_t duty_offset;
+  uint8_t duty_width;
+  uint8_t day_alarm;
+  uint8_t month_alarm;
+  uint8_t century;
+  uint16_t boot_arch_flags;
+  uint8_t reserved1;
+  uint32_t flags; // ACPI_FADT_*
+} __attribute__((packed));
+
+#define ACPI_FADT_TMR_VAL_EXT (1u << 8) // PM timer is 32 bits, not 24
+
+/* HPET description table */
+struct acpi_hpet {
+  struct acpi_sdt_header header;
+  uint32_t event_timer_block_id;
+  struct acpi_gas base_address;
+  uint8_t hpet_number;
+  uint16_t minimum_tick;
+  uint8_t page_protection;
+} __attribute__((packed));
+
+/* MADT ("APIC"): interrupt controller description, followed by entries */
+struct acpi_madt {
+  struct acpi_sdt_header header;
+  uint32_t lapic_address;
+  uint32_t flags; // ACPI_MADT_PCAT_COMPAT
+} __attribute__((packed));
+
+#define ACPI_MADT_PCAT_COMPAT (1u << 0) // dual 8259s are present too
+
+struct acpi_madt_entry {
+  uint8_t type; // ACPI_MADT_*
+  uint8_t length;
+} __attribute__((packed));
+
+enum {
+  ACPI_MADT_LAPIC = 0,
+  ACPI_MADT_IOAPIC = 1,
+  ACPI_MADT_ISO = 2, // interrupt source override
+  ACPI_MADT_LAPIC_NMI = 4,
+  ACPI_MADT_LAPIC_OVERRIDE = 5,
+};
+
+struct acpi_madt_ioapic {
+  struct acpi_madt_entry entry;
+  uint8_t id;
+  uint8_t reserved;
+  uint32_t address;
+  uint32_t gsi_base;
+} __attribute__((packed));
+
+struct acpi_madt_iso {
+  struct acpi_madt_entry entry;
+  uint8_t bus; // 0 = ISA
+  uint8_t source;
+  uint32_t gsi;
+  uint16_t flags; // ACPI_MPS_*
+} __attribute__((packed));
+
+struct acpi_madt_lapic_override {
+  struct acpi_madt_entry entry;
+  uint16_t reserved;
+  uint64_t address;
+} __attribute__((packed));
+
+// MPS INTI flags used by overrides
+#define ACPI_MPS_POLARITY_MASK 0x3
+#define ACPI_MPS_POLARITY_LOW 0x3
+#define ACPI_MPS_TRIGGER_MASK 0xC
+#define ACPI_MPS_TRIGGER_LEVEL 0xC
+
+/* Locate the RSDP (multiboot2 copy first, then the BIOS areas) */
+bool acpi_init(const struct mb2_info_fixed *info);
+/* Find and map a table by signature ("FACP", "APIC", "HPET", ...) */
+const struct acpi_sdt_header *acpi_find_table(const char *signature);
@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stdbool.h>
+
+/* Register the ACPI power-management timer (3.579545 MHz) from the FADT */
+bool acpi_pm_init(void);
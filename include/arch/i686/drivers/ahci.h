@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* AHCI SATA host controllers. Every ATA disk on an implemented port becomes
+ * a block device ("sd0", "sd1", ...). Reads and writes go out as NCQ
+ * commands (READ/WRITE FPDMA QUEUED) when both the HBA and the disk support
+ * them, up to the disk's queue depth at once; otherwise as one DMA command
+ * at a time. */
+
+// Find AHCI controllers on PCI (after pci_init) and register their disks
+void ahci_init_pci(void);
+
+typedef struct {
+  const char *name; // block device name
+  const char *model;
+  uint8_t port;
+  uint8_t depth; // commands in flight at once
+  bool ncq;
+  bool fua;    // FUA writes supported
+  bool wcache; // volatile write cache
+  uint64_t sectors;
+} ahci_disk_info_t;
+
+typedef struct {
+  uint64_t irqs;        // controller interrupts taken
+  uint64_t completions; // commands completed
+  uint32_t max_batch;   // most commands completed in one pass
+  bool coalescing;      // hardware command completion coalescing is on
+  bool msi;             // message-signalled interrupts
+  bool polled;          // some controller never interrupted
+} ahci_stats_t;
+
+unsigned ahci_disk_count(void);
+bool ahci_disk_info(unsigned index, ahci_disk_info_t *out);
+// Summed over all controllers
+void ahci_get_stats(ahci_stats_t *out);
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <arch/i686/pic.h>
+#include <stdbool.h>
+
+#define APIC_TIMER_VECTOR 0x30 // IRQ_LOCAL_TIMER
+#define APIC_SPURIOUS_VECTOR 0xFF
+
+/* Local APIC + IOAPIC(s) described by the ACPI MADT */
+const pic_driver *apic_get_driver();
+/* Is the APIC the active interrupt controller? */
+bool apic_active(void);
+/* MSI address and data that deliver line irq (vector 0x20 + irq) to this
+ * CPU; false unless the APIC is the active controller */
+bool apic_msi_message(int irq, uint32_t *address, uint16_t *data);
+/* Calibrate the LAPIC timer against the clocksource and register it as a
+ * clockevent (after i686_init_irq picked the APIC) */
+bool lapic_timer_init(void);
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Map the HPET described by ACPI, start its main counter and register it
+ * as a clocksource */
+bool hpet_init(void);
+/* Virtual address of the register block (NULL when absent) */
+volatile uint8_t *hpet_base(void);
@@ -1,9 +1,15 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
 void ide_init(unsigned int BAR0, unsigned int BAR1, unsigned int BAR2,
               unsigned int BAR3, unsigned int BAR4);
+// Find the IDE controller on PCI (after pci_init) and ide_init it
+void ide_init_pci(void);
+// Use bus-master DMA for ATA transfers where possible (default on); returns
+// the previous setting
+bool ide_set_dma(bool enabled);
 
 unsigned char ide_read(unsigned char channel, unsigned char reg);
 void ide_write(unsigned char channel, unsigned char reg, unsigned char data);
@@ -14,28 +20,39 @@ void ide_read_buffer(unsigned char channel, unsigned char reg,
 unsigned char ide_polling(unsigned char channel, unsigned int advanced_check);
 unsigned char ide_print_error(unsigned int drive, unsigned char err);
 
-void ide_wait_irq();
-void ide_irq();
-
-unsigned char ide_ata_access(unsigned char direction, unsigned char drive,
-                             unsigned int lba, unsigned char numsects,
-                             unsigned short selector, unsigned int edi);
+// Sleep until the channel interrupts; falls back to polling (and stays
+// there) if the IRQ doesn't arrive in time. False on timeout.
+bool ide_wait_irq(unsigned char channel);
 
 unsigned char ide_atapi_read(unsigned char drive, unsigned int lba,
                              unsigned char numsects, unsigned short selector,
                              unsigned int edi);
 
-void ide_read_sectors(unsigned char drive, unsigned char numsects,
-                      unsigned int lba, unsigned short es, unsigned int edi);
-void ide_write_sectors(unsigned char drive, unsigned char numsects,
-                       unsigned int lba, unsigned short es, unsigned int edi);
-void ide_atapi_eject(unsigned char drive);
+// Synchronous wrappers: ATA disks go through their block device (see
+// ide_get_blkdev), split into as few commands as the drive and controller
+// allow. They return 0 or an ide_print_error code.
+unsigned char ide_read_sectors(unsigned char drive, unsigned int numsects,
+                               uint64_t lba, unsigned short es,
+                               unsigned int edi);
+unsigned char ide_write_sectors(unsigned char drive, unsigned int numsects,
+                                uint64_t lba, unsigned short es,
+                                unsigned int edi);
+unsigned char ide_atapi_eject(unsigned char drive);
+
+struct blkdev;
+// Block device of an ATA disk ("hd0".."hd3"), NULL for other drives
+struct blkdev *ide_get_blkdev(unsigned char drive);
 
 typedef struct {
   uint16_t base;
   uint16_t ctrl;
   uint16_t bmide;
   uint8_t nIEN;
+  uint8_t irq;                 // 14/15, or the PCI line in native mode
+  uint8_t irq_broken;          // never interrupted: poll instead
+  volatile uint8_t irq_done;   // set by the channel's IRQ handler
+  volatile uint8_t irq_status; // ATA status read by the handler
+  volatile uint8_t bm_status;  // bus-master status read by the handler
 } IDEChannelRegisters;
 
 typedef struct {
@@ -46,7 +63,14 @@ typedef struct {
   uint16_t signature;
   uint16_t capabilities;
   uint32_t command_sets;
-  uint32_t size; // sectors
+  uint64_t size;    // sectors
+  uint8_t multiple; // sectors per DRQ block (READ/WRITE MULTIPLE), 0 = off
+  uint8_t pio_mode; // negotiated PIO mode (0-4)
+  uint8_t dma_mode; // SET FEATURES value: 0x40|n UDMA n, 0x20|n MWDMA n, 0
+  uint8_t io32;     // data port moved with 32-bit accesses
+  uint8_t wcache;   // volatile write cache (on, or IDENTIFY doesn't say)
+  uint8_t fua;      // WRITE DMA/MULTIPLE FUA EXT supported
+  uint8_t error;    // ide_print_error code of the last failed request
   char model[41];
 } ide_device_t;
 
@@ -55,7 +79,6 @@ extern ide_device_t ide_devices[4];
 
 extern IDEChannelRegisters channels[2];
 
-extern unsigned char package[2];
 // Status
 #define ATA_SR_BSY 0x80  // Busy
 #define ATA_SR_DRDY 0x40 // Drive ready
@@ -85,6 +108,14 @@ extern unsigned char package[2];
 #define ATA_CMD_WRITE_PIO_EXT 0x34
 #define ATA_CMD_WRITE_DMA 0xCA
 #define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_READ_MULTIPLE 0xC4
+#define ATA_CMD_READ_MULTIPLE_EXT 0x29
+#define ATA_CMD_WRITE_MULTIPLE 0xC5
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+#define ATA_CMD_WRITE_DMA_FUA_EXT 0x3D
+#define ATA_CMD_WRITE_MULTIPLE_FUA_EXT 0xCE
+#define ATA_CMD_SET_MULTIPLE 0xC6
+#define ATA_CMD_SET_FEATURES 0xEF
 #define ATA_CMD_CACHE_FLUSH 0xE7
 #define ATA_CMD_CACHE_FLUSH_EXT 0xEA
 #define ATA_CMD_PACKET 0xA0
@@ -102,12 +133,26 @@ extern unsigned char package[2];
 #define ATA_IDENT_SECTORS 12
 #define ATA_IDENT_SERIAL 20
 #define ATA_IDENT_MODEL 54
+#define ATA_IDENT_MAX_MULTIPLE 94
+#define ATA_IDENT_OLD_PIO 102
 #define ATA_IDENT_CAPABILITIES 98
 #define ATA_IDENT_FIELDVALID 106
 #define ATA_IDENT_MAX_LBA 120
+#define ATA_IDENT_MWDMA 126
+#define ATA_IDENT_PIO_MODES 128
 #define ATA_IDENT_COMMANDSETS 164
+#define ATA_IDENT_FEATURES_EXT 168 // word 84
+#define ATA_IDENT_ENABLED 170      // word 85: features turned on
+#define ATA_IDENT_UDMA 176
+#define ATA_IDENT_HW_RESET 186
 #define ATA_IDENT_MAX_LBA_EXT 200
 
+// SET FEATURES subcommands
+#define ATA_FEAT_XFER_MODE 0x03
+#define ATA_XFER_PIO_FLOW 0x08
+#define ATA_XFER_MWDMA 0x20
+#define ATA_XFER_UDMA 0x40
+
 // interface and master slave
 #define IDE_ATA 0x00
 #define IDE_ATAPI 0x01
@@ -139,6 +184,18 @@ extern unsigned char package[2];
 #define ATA_PRIMARY 0x00
 #define ATA_SECONDARY 0x01
 
+// Bus-master IDE (offsets in a channel's 8-port BMIDE block)
+#define BMIDE_REG_COMMAND 0x00
+#define BMIDE_REG_STATUS 0x02
+#define BMIDE_REG_PRDT 0x04
+
+#define BMIDE_CMD_START 0x01
+#define BMIDE_CMD_READ 0x08 // device to memory
+
+#define BMIDE_SR_ACTIVE 0x01
+#define BMIDE_SR_ERR 0x02
+#define BMIDE_SR_IRQ 0x04
+
 // Directions:
 #define ATA_READ 0x00
 #define ATA_WRITE 0x01
\ No newline at end of file
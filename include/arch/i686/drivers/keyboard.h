@@ -1,8 +1,70 @@
 #pragma once
 
 #include <arch/i686/irq.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* ----- Keycodes: set-1 make code, E0-prefixed keys get bit 7 ----- */
+#define KEY_ESC 0x01
+#define KEY_BACKSPACE 0x0E
+#define KEY_ENTER 0x1C
+#define KEY_LCTRL 0x1D
+#define KEY_LSHIFT 0x2A
+#define KEY_RSHIFT 0x36
+#define KEY_LALT 0x38
+#define KEY_CAPSLOCK 0x3A
+#define KEY_NUMLOCK 0x45
+#define KEY_SCROLLLOCK 0x46
+#define KEY_EXTENDED 0x80
+#define KEY_RCTRL (KEY_EXTENDED | 0x1D)
+#define KEY_RALT (KEY_EXTENDED | 0x38)
+#define KEY_HOME (KEY_EXTENDED | 0x47)
+#define KEY_UP (KEY_EXTENDED | 0x48)
+#define KEY_PAGEUP (KEY_EXTENDED | 0x49)
+#define KEY_LEFT (KEY_EXTENDED | 0x4B)
+#define KEY_RIGHT (KEY_EXTENDED | 0x4D)
+#define KEY_END (KEY_EXTENDED | 0x4F)
+#define KEY_DOWN (KEY_EXTENDED | 0x50)
+#define KEY_PAGEDOWN (KEY_EXTENDED | 0x51)
+#define KEY_INSERT (KEY_EXTENDED | 0x52)
+#define KEY_DELETE (KEY_EXTENDED | 0x53)
+
+/* ----- Modifier state carried by every event ----- */
+#define KBD_MOD_LSHIFT (1u << 0)
+#define KBD_MOD_RSHIFT (1u << 1)
+#define KBD_MOD_LCTRL (1u << 2)
+#define KBD_MOD_RCTRL (1u << 3)
+#define KBD_MOD_LALT (1u << 4)
+#define KBD_MOD_RALT (1u << 5)
+#define KBD_MOD_CAPSLOCK (1u << 6)
+#define KBD_MOD_NUMLOCK (1u << 7)
+#define KBD_MOD_SCROLLLOCK (1u << 8)
+#define KBD_MOD_SHIFT (KBD_MOD_LSHIFT | KBD_MOD_RSHIFT)
+#define KBD_MOD_CTRL (KBD_MOD_LCTRL | KBD_MOD_RCTRL)
+#define KBD_MOD_ALT (KBD_MOD_LALT | KBD_MOD_RALT)
+
+#define KBD_EVT_RELEASE (1u << 0) // key went up
+#define KBD_EVT_REPEAT (1u << 1)  // typematic make for a key already down
+
+/* Raw key event, queued by the IRQ handler */
+typedef struct {
+  uint16_t scancode;  // as received: 0xE0xx for extended, bit 7 = break
+  uint8_t keycode;    // KEY_* (never has the break bit)
+  uint8_t flags;      // KBD_EVT_*
+  uint16_t modifiers; // KBD_MOD_* after this event was applied
+  uint64_t tsc;       // rdtsc when the IRQ fired
+} kbd_event_t;
+
+typedef struct {
+  uint32_t events;      // queued by the IRQ
+  uint32_t dropped;     // lost because the queue was full
+  uint32_t max_depth;   // high-water mark of the queue
+  uint64_t max_latency; // worst IRQ-to-cooked delay, in TSC cycles
+} kbd_stats_t;
 
 void keyboard_init();
 void keyboard_handler(registers *regs);
-
-int keyboard_getchar(void);
\ No newline at end of file
+/* Program the i8042 typematic rate: delay 0-3 (250-1000 ms), rate 0-31
+ * (0 = 30 chars/s ... 31 = 2 chars/s) */
+bool keyboard_set_typematic(uint8_t delay, uint8_t rate);
+void keyboard_get_stats(kbd_stats_t *out);
@@ -0,0 +1,4 @@
+#pragma once
+
+/* Take over IRQ 0 and register PIT channel 0 as a one-shot clockevent */
+void pit_init(void);
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Calibrate the TSC against PIT channel 2 and register it as a
+ * clocksource (preferred only when CPUID reports it invariant) */
+bool tsc_init(void);
+/* Calibrated TSC frequency in kHz (0 before tsc_init) */
+uint32_t tsc_khz(void);
+bool tsc_is_invariant(void);
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <arch/i686/irq.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define COM1_PORT 0x3F8
+#define COM1_IRQ 4
+
+bool uart16550_init(uint16_t base, int irq, uint32_t baud);
+bool uart16550_present(void);
+void uart16550_handler(registers *regs);
+
+/* Queue bytes for transmission; blocks (hlt) only when the TX ring is full */
+size_t uart16550_write(const void *buf, size_t n);
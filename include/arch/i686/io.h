@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -14,6 +15,21 @@ static inline uint8_t i686_inb(uint16_t port) {
   return ret;
 }
 
+/* Read a 32-bit value from an I/O port */
+static inline uint32_t i686_inl(uint16_t port) {
+  uint32_t ret;
+  __asm__ volatile("inl %1, %0" : "=a"(ret) : "Nd"(port));
+  return ret;
+}
+
+static inline void i686_outw(uint16_t port, uint16_t value) {
+  __asm__ volatile("outw %0, %1" ::"a"(value), "Nd"(port));
+}
+
+static inline void i686_outl(uint16_t port, uint32_t value) {
+  __asm__ volatile("outl %0, %1" ::"a"(value), "Nd"(port));
+}
+
 static inline void i686_interrupts_disable(void) {
   __asm__ volatile("cli" ::: "memory");
 }
@@ -22,6 +38,41 @@ static inline void i686_interrupts_enable(void) {
   __asm__ volatile("sti" ::: "memory");
 }
 
+static inline bool i686_interrupts_enabled(void) {
+  uint32_t flags;
+  __asm__ volatile("pushf; pop %0" : "=r"(flags));
+  return (flags & 0x200) != 0; // EFLAGS.IF
+}
+
+/* Disable interrupts and return the previous EFLAGS for i686_irq_restore */
+static inline uint32_t i686_irq_save(void) {
+  uint32_t flags;
+  __asm__ volatile("pushf; pop %0; cli" : "=r"(flags)::"memory");
+  return flags;
+}
+
+static inline void i686_irq_restore(uint32_t flags) {
+  __asm__ volatile("push %0; popf" ::"r"(flags) : "memory", "cc");
+}
+
+/* Read the time-stamp counter */
+static inline uint64_t i686_rdtsc(void) {
+  uint32_t lo, hi;
+  __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint64_t i686_rdmsr(uint32_t msr) {
+  uint32_t lo, hi;
+  __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void i686_wrmsr(uint32_t msr, uint64_t value) {
+  __asm__ volatile("wrmsr" ::"c"(msr), "a"((uint32_t)value),
+                   "d"((uint32_t)(value >> 32)));
+}
+
 static inline void i686_panic(void) {
   i686_interrupts_disable();
   for (;;) {
@@ -37,4 +88,27 @@ static inline void i686_insl(uint16_t port, void *dst, unsigned int dwords) {
                : "memory");
 }
 
+static inline void i686_outsl(uint16_t port, const void *src,
+                              unsigned int dwords) {
+  asm volatile("cld; rep outsl"
+               : "+S"(src), "+c"(dwords)
+               : "d"(port)
+               : "memory");
+}
+
+static inline void i686_insw(uint16_t port, void *dst, unsigned int words) {
+  asm volatile("cld; rep insw"
+               : "+D"(dst), "+c"(words)
+               : "d"(port)
+               : "memory");
+}
+
+static inline void i686_outsw(uint16_t port, const void *src,
+                              unsigned int words) {
+  asm volatile("cld; rep outsw"
+               : "+S"(src), "+c"(words)
+               : "d"(port)
+               : "memory");
+}
+
 static inline void i686_iowait(void) { i686_outb(0x80, 0); }
\ No newline at end of file
@@ -1,7 +1,28 @@
 #pragma once
 #include "isr.h"
 
+#include <stdint.h>
+
+// Line N is delivered on vector 0x20 + N. Lines 0-15 are the ISA inputs of the
+// PIC; the rest are local sources that never go through the PIC's mask.
+#define IRQ_LOCAL_TIMER 16 // LAPIC timer, vector 0x30
+#define IRQ_BENCH 17       // software-only line for i686_irq_benchmark
+#define IRQ_MSI 18         // message-signalled PCI interrupts, vector 0x32
+#define IRQ_COUNT 19
+
+// Device interrupts use a fast entry stub without a register frame, so regs is
+// always NULL; only exceptions (i686_isr_register_handler) see the full frame.
 typedef void (*irq_handler_t)(registers *regs);
 
 void i686_init_irq();
-void i686_irq_register_handler(int irq, irq_handler_t handler);
\ No newline at end of file
+void i686_irq_register_handler(int irq, irq_handler_t handler);
+void i686_irq_mask(int irq);
+void i686_irq_unmask(int irq);
+// Handlers of lower-priority lines run with interrupts enabled; this is how
+// many device interrupts are currently on the stack (0 outside handlers)
+int i686_irq_depth(void);
+
+// Average cycles for one `int` round trip through the generic ISR path and
+// through the fast IRQ stubs, both running the same empty handler
+void i686_irq_benchmark(uint32_t iterations, uint32_t *generic_cycles,
+                        uint32_t *fast_cycles);
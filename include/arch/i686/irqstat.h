@@ -0,0 +1,19 @@
+#pragma once
+#include <stdint.h>
+
+// Handler durations land in log2 buckets: bucket b counts calls that took
+// [2^b, 2^(b+1)) TSC cycles, the last bucket is open-ended.
+#define IRQSTAT_BUCKETS 24
+
+typedef struct {
+  uint32_t count;      // times the vector fired
+  uint32_t max_cycles;  // slowest handler run
+  uint64_t total_cycles;
+  uint32_t hist[IRQSTAT_BUCKETS];
+} irqstat_t;
+
+// Account one handler run on vector (called from interrupt context)
+void irqstat_record(int vector, uint64_t cycles);
+// Snapshot of one vector's counters
+void irqstat_get(int vector, irqstat_t *out);
+void irqstat_reset(void);
@@ -12,11 +12,17 @@ uint32_t *mem_get_current_page_dir();
 void mem_change_page_dir(uint32_t *pd);
 void sync_page_dirs();
 void mem_map_page(uint32_t vaddr, uint32_t paddr, uint32_t flags);
+void *mem_map_mmio(uint32_t paddr, uint32_t size, uint32_t flags);
+uint32_t mem_virt_to_phys(const void *vaddr);
 
 #define KERNEL_START 0xC0000000
 #define KERNEL_MALLOC 0xD0000000
+#define KERNEL_MMIO 0xE0000000
 #define REC_PAGEDIR ((uint32_t *)0xFFFFF000)
 #define REC_PAGETABLE(i) ((uint32_t *)(0xFFC00000 + ((i) << 12)))
 #define PAGE_FLAG_PRESENT (1 << 0)
 #define PAGE_FLAG_WRITE (1 << 1)
+#define PAGE_FLAG_WRITE_THROUGH (1 << 3)
+#define PAGE_FLAG_CACHE_DISABLE (1 << 4)
+#define PAGE_FLAG_4MB (1 << 7)
 #define PAGE_FLAG_OWNER (1 << 9)
\ No newline at end of file
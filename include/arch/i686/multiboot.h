@@ -1,5 +1,6 @@
 // multiboot2.h — minimal, practical MB2 definitions + helpers
 #pragma once
+#include <stddef.h>
 #include <stdint.h>
 
 // ---- Bootloader magic (EAX at entry) ----
@@ -33,6 +34,8 @@ enum {
   MB2_TAG_FRAMEBUFFER = 8, // struct below
   MB2_TAG_ELF_SECTIONS = 9,
   MB2_TAG_APM = 10,
+  MB2_TAG_ACPI_OLD = 14, // copy of the ACPI 1.0 RSDP
+  MB2_TAG_ACPI_NEW = 15, // copy of the ACPI 2.0+ RSDP
 };
 
 // ---- Basic memory info (type 4) ----
@@ -70,8 +73,24 @@ struct mb2_tag_framebuffer {
   uint32_t framebuffer_height;
   uint8_t framebuffer_bpp;
   uint8_t framebuffer_type; // 0=indexed, 1=RGB, 2=EGA text
-  uint8_t reserved;
-  // followed by palette or RGB field info depending on type (not needed here)
+  uint16_t reserved;
+  // followed by palette or RGB field info depending on type
+} __attribute__((packed));
+
+enum {
+  MB2_FB_TYPE_INDEXED = 0,
+  MB2_FB_TYPE_RGB = 1,
+  MB2_FB_TYPE_EGA_TEXT = 2,
+};
+
+// RGB field layout that follows the framebuffer tag when type == RGB
+struct mb2_fb_rgb_info {
+  uint8_t red_field_position;
+  uint8_t red_mask_size;
+  uint8_t green_field_position;
+  uint8_t green_mask_size;
+  uint8_t blue_field_position;
+  uint8_t blue_mask_size;
 } __attribute__((packed));
 
 // ---- Alignment helper for walking tags ----
@@ -134,6 +153,19 @@ static inline uint32_t mb2_mem_top_bytes(const struct mb2_info_fixed *info) {
   return 0x00100000u;
 }
 
+// ---- Kernel command line (type 1), or "" if the loader gave none ----
+struct mb2_tag_string {
+  uint32_t type;
+  uint32_t size;
+  char string[]; // NUL-terminated
+} __attribute__((packed));
+
+static inline const char *mb2_get_cmdline(const struct mb2_info_fixed *info) {
+  const struct mb2_tag_string *t =
+      (const struct mb2_tag_string *)mb2_find_tag(info, MB2_TAG_CMDLINE);
+  return t ? t->string : "";
+}
+
 // ---- Fetch framebuffer parameters if present; returns 1 if ok, 0 otherwise
 // ----
 static inline int mb2_get_framebuffer(const struct mb2_info_fixed *info,
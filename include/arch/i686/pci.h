@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* ----- Configuration space (type 0 header, only what the kernel uses) ----- */
+#define PCI_VENDOR_ID 0x00
+#define PCI_DEVICE_ID 0x02
+#define PCI_COMMAND 0x04
+#define PCI_STATUS 0x06
+#define PCI_REVISION 0x08
+#define PCI_PROG_IF 0x09
+#define PCI_SUBCLASS 0x0A
+#define PCI_CLASS 0x0B
+#define PCI_HEADER_TYPE 0x0E
+#define PCI_BAR0 0x10
+#define PCI_CAPABILITY_LIST 0x34
+#define PCI_INTERRUPT_LINE 0x3C
+#define PCI_INTERRUPT_PIN 0x3D
+
+#define PCI_COMMAND_IO (1u << 0)
+#define PCI_COMMAND_MEMORY (1u << 1)
+#define PCI_COMMAND_MASTER (1u << 2)
+#define PCI_COMMAND_INTX_DISABLE (1u << 10)
+#define PCI_STATUS_CAP_LIST (1u << 4)
+
+#define PCI_CAP_ID_MSI 0x05
+
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE 0x01
+#define PCI_SUBCLASS_SATA 0x06
+#define PCI_CLASS_BRIDGE 0x06
+
+#define PCI_BARS 6
+#define PCI_MAX_DEVICES 64
+
+typedef struct {
+  uint8_t bus, slot, func;
+  uint16_t vendor_id, device_id;
+  uint8_t class_code, subclass, prog_if, revision;
+  uint8_t header_type;
+  uint8_t irq_line; // as routed by the firmware (0xFF = none)
+  uint8_t irq_pin;  // 1 = INTA# ... 4 = INTD#, 0 = none
+  uint32_t bar[PCI_BARS];      // decoded base: I/O port or physical address
+  uint32_t bar_size[PCI_BARS]; // 0 = unimplemented
+  uint8_t bar_io;              // bit n: BAR n is an I/O port range
+} pci_device_t;
+
+/* Scan every bus through configuration mechanism #1 and fill the device
+ * table; returns the number of functions found */
+size_t pci_init(void);
+size_t pci_device_count(void);
+const pci_device_t *pci_device_at(size_t index);
+/* Next device after `from` (NULL = first) matching class/subclass, or
+ * vendor/device id */
+const pci_device_t *pci_find_class(uint8_t class_code, uint8_t subclass,
+                                   const pci_device_t *from);
+const pci_device_t *pci_find_id(uint16_t vendor_id, uint16_t device_id,
+                                const pci_device_t *from);
+/* Human-readable class, e.g. "IDE controller" */
+const char *pci_class_name(uint8_t class_code, uint8_t subclass);
+
+uint32_t pci_read32(const pci_device_t *dev, uint8_t offset);
+uint16_t pci_read16(const pci_device_t *dev, uint8_t offset);
+uint8_t pci_read8(const pci_device_t *dev, uint8_t offset);
+void pci_write32(const pci_device_t *dev, uint8_t offset, uint32_t value);
+void pci_write16(const pci_device_t *dev, uint8_t offset, uint16_t value);
+/* Set bits in the command register (PCI_COMMAND_*) */
+void pci_enable(const pci_device_t *dev, uint16_t command_bits);
+/* Config offset of the device's capability id (PCI_CAP_ID_*), 0 if none */
+uint8_t pci_find_capability(const pci_device_t *dev, uint8_t id);
+/* Switch the device from INTx to a single MSI message; false if it has no
+ * MSI capability */
+bool pci_enable_msi(const pci_device_t *dev, uint32_t address, uint16_t data);
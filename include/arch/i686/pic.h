@@ -12,4 +12,10 @@ typedef struct {
   void (*send_end_of_interrupt)(int irq);
   void (*mask)(int irq);
   void (*unmask)(int irq);
+  /* Hold off irq and every line of equal or lower priority; returns the
+   * previous state for restore_priority */
+  uint32_t (*raise_priority)(int irq);
+  void (*restore_priority)(uint32_t state);
+  /* Level-triggered lines keep their EOI until the handler has run */
+  bool (*is_level_triggered)(int irq);
 } pic_driver;
\ No newline at end of file
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <kernel/blk.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Block buffer cache over the block layer. Blocks are BCACHE_BLOCK_SIZE
+ * bytes, keyed by (device, block number); lookups go through a hash table,
+ * unreferenced clean buffers are recycled in LRU order. Dirty buffers are
+ * written back by a periodic timer (buffers nobody holds) and by
+ * bcache_sync(). Everything except the write-back timer runs in thread
+ * context: reads sleep until the data is there.
+ *
+ * bcache_read() tracks the access pattern of each device: while reads stay
+ * sequential it prefetches a window of blocks ahead of the reader without
+ * waiting for them, doubling the window from BCACHE_RA_MIN to
+ * BCACHE_RA_MAX blocks each time the reader gets halfway into it. A read
+ * anywhere else turns readahead off until the next sequential read. */
+
+#define BCACHE_BLOCK_SIZE 4096
+#define BCACHE_BLOCK_SECTORS (BCACHE_BLOCK_SIZE / BLK_SECTOR_SIZE)
+#define BCACHE_NR_BUFFERS 256 // 1 MiB of cached data
+#define BCACHE_RA_MIN 4        // blocks: 16 KiB first readahead window
+#define BCACHE_RA_MAX 64       // 256 KiB
+
+typedef struct buffer {
+  struct buffer *hash_next;
+  struct buffer *lru_prev; // most recently used at the head
+  struct buffer *lru_next;
+  struct buffer *wb_next; // write-back batch being submitted
+  blkdev_t *dev;          // NULL while unused
+  uint64_t block;
+  uint8_t *data;
+  uint32_t sectors;   // valid sectors (the last block may be short)
+  uint16_t refcount;  // bcache_get() holders
+  volatile bool busy; // a read or write-back is in flight
+  bool valid;         // data matches (or is newer than) the disk
+  bool dirty;         // data is newer than the disk
+  bool readahead;     // prefetched and not read by anyone yet
+  bool fetched;       // read started by bcache_read before its lookup
+  int error;          // of the last I/O
+  bio_t bio;
+} buffer_t;
+
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t writebacks; // buffers written to disk
+  uint64_t evictions;  // valid buffers recycled for another block
+  uint64_t write_errors;
+  uint64_t ra_blocks; // prefetched
+  uint64_t ra_hits;   // prefetched blocks that were read afterwards
+  uint64_t ra_wasted; // prefetched blocks evicted unread
+  uint64_t ra_resets; // readahead stopped by a non-sequential read
+  uint32_t dirty;  // right now
+  uint32_t in_use; // referenced right now
+} bcache_stats_t;
+
+void bcache_init(void);
+
+/* Reference the buffer of a block, read from the disk unless cached;
+ * returns BLK_OK or the read error. Release with bcache_put(). */
+int bcache_get(blkdev_t *dev, uint64_t block, buffer_t **out);
+/* The holder changed b->data; it goes to the disk on the next write-back */
+void bcache_mark_dirty(buffer_t *b);
+void bcache_put(buffer_t *b);
+
+/* Copy sectors through the cache (any alignment, thread context) */
+int bcache_read(blkdev_t *dev, uint64_t sector, uint32_t count, void *buf);
+int bcache_write(blkdev_t *dev, uint64_t sector, uint32_t count,
+                 const void *buf);
+
+/* Write back every dirty buffer of dev (all devices if NULL), wait, and
+ * flush the device caches; returns the first error */
+int bcache_sync(blkdev_t *dev);
+
+void bcache_get_stats(bcache_stats_t *out);
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Generic block layer. Callers describe a transfer with a bio and hand it to
+ * submit_bio(); the device queue merges bios on adjacent sectors into one
+ * request, dispatches requests in C-LOOK order (a request that has waited
+ * past its deadline goes first) and calls each bio's end_io when the driver
+ * completes the request. Requests on overlapping sectors may complete in
+ * any order: a caller that cares waits for the first one.
+ *
+ * A write completes once the device has it, which may be in a volatile
+ * write cache. A BIO_FLUSH bio is a barrier: it is issued after every
+ * request queued before it has completed, holds back the ones queued after
+ * it, and completes once all writes completed so far are on stable media.
+ * A BIO_FUA write is itself on stable media when it completes. */
+
+#define BLK_SECTOR_SIZE 512
+#define BLK_MAX_DEVICES 8
+#define BLK_NR_REQUESTS 64 // request slots per device
+
+#define BIO_READ 0
+#define BIO_WRITE 1
+#define BIO_FLUSH 2 // no data (count 0): make completed writes durable
+
+// bio_t.flags
+#define BIO_FUA 0x01 // write through to stable media
+
+// blkdev_t.features, set by the driver
+#define BLK_FEAT_WCACHE 0x01 // volatile write cache: flushes do something
+
+// blkdev_t.write_cache
+#define BLK_WC_WRITEBACK 0    // writes may linger in the device cache
+#define BLK_WC_WRITETHROUGH 1 // every write is FUA
+
+// Error codes (bio_t.error, blkdev_t.last_error)
+#define BLK_OK 0
+#define BLK_EIO 1       // device or medium error
+#define BLK_ETIMEDOUT 2 // the device stopped answering
+#define BLK_ERANGE 3    // beyond the end of the device
+#define BLK_EROFS 4     // write to read-only media
+#define BLK_EINVAL 5    // empty transfer
+#define BLK_ENOMEM 6    // no buffer to put the data in
+
+struct bio;
+struct blkdev;
+
+typedef void (*bio_end_io_t)(struct bio *bio);
+
+/* One transfer to or from one virtually contiguous buffer. Storage belongs
+ * to the submitter and must stay valid until end_io runs. */
+typedef struct bio {
+  struct bio *next; // next bio of the same request
+  struct blkdev *dev;
+  uint64_t sector;
+  uint32_t count; // sectors
+  void *buf;
+  uint8_t op;           // BIO_READ / BIO_WRITE / BIO_FLUSH
+  uint8_t flags;        // BIO_FUA
+  int error;            // set before end_io
+  bio_end_io_t end_io;  // thread or tasklet context, must not sleep
+  void *private;        // for end_io
+} bio_t;
+
+/* Bios on consecutive sectors, in sector order, issued as one unit */
+typedef struct blk_request {
+  struct blk_request *next; // sector-sorted queue, or free list
+  bio_t *bios;
+  bio_t *tail;
+  uint64_t sector;
+  uint32_t count;
+  uint16_t nbios;
+  uint8_t op;
+  uint8_t flags;     // of all its bios
+  uint32_t epoch;    // flushes queued before it
+  uint64_t deadline; // ktime ns
+} blk_request_t;
+
+typedef struct {
+  /* Start rq. Return false if the hardware is busy; the driver then calls
+   * blk_run_queue() once it can take requests again. The driver reports
+   * the result with blk_end_request(), from any context but hard IRQ.
+   * BIO_FLUSH requests only reach a driver that set BLK_FEAT_WCACHE. */
+  bool (*start)(struct blkdev *dev, blk_request_t *rq);
+} blkdev_ops_t;
+
+typedef struct {
+  uint64_t bios;
+  uint64_t requests; // dispatched
+  uint64_t merges;   // bios that joined an existing request
+  uint64_t expired;  // dispatched out of C-LOOK order by their deadline
+  uint64_t sectors[2];
+  uint64_t errors;
+  uint64_t flushes; // sent to the device
+  uint64_t fua;     // FUA write requests
+} blk_stats_t;
+
+typedef struct blkdev {
+  // Filled in by the driver before blk_register()
+  const char *name;
+  uint64_t sectors;
+  uint32_t max_sectors;  // merge limit for one request
+  uint16_t max_segments; // bios per request
+  uint8_t depth;         // requests the driver takes at once
+  uint8_t features;      // BLK_FEAT_*
+  const blkdev_ops_t *ops;
+  void *driver_data;
+
+  // Owned by the block layer
+  blk_request_t *queue;   // waiting, sorted by sector
+  blk_request_t *flushes; // waiting flushes, oldest first
+  blk_request_t *flushes_tail;
+  blk_request_t *free;
+  bio_t *backlog; // bios waiting for a free request slot
+  bio_t *backlog_tail;
+  uint8_t inflight;
+  uint64_t head;       // sector after the last dispatched request (C-LOOK)
+  uint32_t epoch;      // flushes queued so far
+  uint8_t write_cache; // BLK_WC_* policy
+  bool unflushed;      // writes completed since the last flush
+  int last_error;
+  blk_stats_t stats;
+  blk_request_t pool[BLK_NR_REQUESTS];
+} blkdev_t;
+
+void blk_register(blkdev_t *dev);
+unsigned blk_count(void);
+blkdev_t *blk_get(unsigned index);
+blkdev_t *blk_find(const char *name);
+
+/* Queue bio (thread or tasklet context); end_io reports the result */
+void submit_bio(bio_t *bio);
+/* Hand waiting requests to the driver while it accepts them */
+void blk_run_queue(blkdev_t *dev);
+/* Driver side: rq finished with error (BLK_*) */
+void blk_end_request(blkdev_t *dev, blk_request_t *rq, int error);
+
+/* Synchronous helpers (thread context): submit and sleep until done */
+int blk_read(blkdev_t *dev, uint64_t sector, uint32_t count, void *buf);
+int blk_write(blkdev_t *dev, uint64_t sector, uint32_t count,
+              const void *buf);
+/* Make every write completed so far durable */
+int blk_flush(blkdev_t *dev);
+
+void blk_set_write_cache(blkdev_t *dev, uint8_t policy);
+
+const char *blk_strerror(int error);
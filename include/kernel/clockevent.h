@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+
+/* A device that can raise an interrupt at a chosen time */
+typedef struct clockevent {
+  const char *name;
+  uint64_t min_delta_ns; // shortest programmable delay
+  uint64_t max_delta_ns; // longest programmable delay
+  int rating;            // higher wins
+  /* Fire once, delta_ns from now (clamped to min/max by the caller) */
+  void (*set_next_event)(uint64_t delta_ns);
+  /* Fire every 1/hz seconds (optional; used when there is no clocksource) */
+  void (*set_periodic)(uint32_t hz);
+  /* Stop interrupting: another device took over (optional) */
+  void (*shutdown)(void);
+} clockevent;
+
+/* Offer a clockevent device; the best-rated one drives the timers */
+void clockevent_register(const clockevent *ce);
+/* Called by the device's IRQ handler when it fires */
+void clockevent_handle_interrupt(void);
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define NSEC_PER_SEC 1000000000ull
+
+/* A free-running counter the kernel can tell time with */
+typedef struct clocksource {
+  const char *name;
+  uint64_t (*read)(void);
+  uint64_t mask;    // counter width: the value wraps at mask + 1
+  uint64_t freq_hz; // counts per second
+  int rating;       // higher wins; < 100 means "only if nothing else"
+  struct clocksource *next;
+} clocksource;
+
+/* Offer a clocksource; the best-rated one becomes the kernel time base */
+void clocksource_register(clocksource *cs);
+/* Name of the clocksource in use ("none" before one is registered) */
+const char *clocksource_current(void);
+bool clocksource_available(void);
+
+/* Nanoseconds since the first clocksource was installed (monotonic) */
+uint64_t ktime_get_ns(void);
+/* Fold elapsed cycles into the base; must run more often than the counter
+ * wraps (called from the periodic tick) */
+void timekeeping_tick(void);
+
+/* mult/shift so that ns = (cycles * mult) >> shift holds for up to maxsec
+ * seconds of cycles without overflowing 64 bits */
+void clocks_calc_mult_shift(uint32_t *mult, uint32_t *shift, uint64_t from,
+                            uint64_t to, uint32_t maxsec);
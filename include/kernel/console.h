@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Display backend behind the tty. Cells are VGA-style (char | attr << 8). */
+typedef struct {
+  const char *name;
+  /* Paint one text row */
+  void (*draw_row)(size_t row, const uint16_t *cells, size_t cols);
+  /* Move the whole text area up by N rows (optional, NULL = repaint rows) */
+  void (*scroll)(size_t rows);
+  /* Place the cursor, or hide it */
+  void (*set_cursor)(size_t x, size_t y, bool visible);
+  /* Push everything drawn since the last call to the display (optional) */
+  void (*present)(void);
+} console_driver;
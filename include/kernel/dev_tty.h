@@ -1,4 +1,18 @@
 #pragma once
 #include "kernel/fd.h"
 
+#include <stdbool.h>
+
 int dev_tty_install_std(void); // creates fds 0,1,2
+/* ttyS0 on the 16550; primary = rebind fds 0,1,2 to it (headless console) */
+int dev_tty_install_serial(bool primary);
+
+/* Feed one received character (keyboard, serial) into tty input; IRQ-safe */
+void tty_input_char(char c);
+
+/* Line discipline modes */
+#define TTY_ICANON (1u << 0) // read() returns whole lines, erase/kill edit them
+#define TTY_ECHO (1u << 1)   // echo input back to the device's output
+
+void tty_set_mode(unsigned int mode);
+unsigned int tty_get_mode(void);
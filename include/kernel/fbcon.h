@@ -0,0 +1,9 @@
+#pragma once
+
+#include <arch/i686/multiboot.h>
+#include <kernel/console.h>
+#include <stdbool.h>
+
+/* Map the Multiboot2 linear framebuffer; false if absent or unsupported */
+bool fbcon_init(const struct mb2_info_fixed *info);
+const console_driver *fbcon_get_driver(void);
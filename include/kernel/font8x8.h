@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+#define FONT8X8_WIDTH 8
+#define FONT8X8_HEIGHT 8
+
+extern const uint8_t font8x8_basic[128][8];
@@ -2,5 +2,5 @@
 
 #include <stdint.h>
 
+/* Block for at least ms milliseconds (halts the CPU meanwhile) */
 void sleep(uint32_t ms);
-void init_sleep();
\ No newline at end of file
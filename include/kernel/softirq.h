@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+
+/* Deferred IRQ work ("bottom halves"). An IRQ handler schedules a tasklet;
+ * it runs once after the EOI, with interrupts enabled, before the interrupt
+ * returns. A tasklet scheduled again before it runs still runs only once. */
+typedef struct tasklet {
+  struct tasklet *next;
+  void (*func)(void *data);
+  void *data;
+  volatile bool scheduled;
+} tasklet_t;
+
+#define TASKLET_INIT(fn, arg)                                                  \
+  {.next = NULL, .func = (fn), .data = (arg), .scheduled = false}
+
+/* Queue t (IRQ-safe, no-op when already queued) */
+void tasklet_schedule(tasklet_t *t);
+/* Run queued tasklets; called on IRQ exit. Does nothing when nested. */
+void softirq_run(void);
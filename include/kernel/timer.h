@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef void (*timer_cb_t)(void *data);
+
+/* One-shot kernel timer. Storage belongs to the caller; callbacks run in
+ * tasklet context (interrupts enabled, must not sleep). */
+typedef struct ktimer {
+  struct ktimer *next;
+  struct ktimer *prev;
+  uint64_t expires; // wheel tick
+  timer_cb_t cb;
+  void *data;
+  uint8_t level; // wheel position while pending
+  uint8_t slot;
+  volatile bool pending;
+} ktimer_t;
+
+/* Start the timer engine on the registered clockevent/clocksource */
+void timer_init(void);
+/* Arm t to call cb(data) once ktime_get_ns() >= deadline_ns (re-arms a
+ * pending timer) */
+void timer_add(ktimer_t *t, uint64_t deadline_ns, timer_cb_t cb, void *data);
+/* Cancel t; returns true if it was pending */
+bool timer_del(ktimer_t *t);
+/* Is t armed and not yet run? */
+static inline bool timer_pending(const ktimer_t *t) { return t->pending; }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <kernel/console.h>
 #include <kernel/vga.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -30,6 +31,8 @@ uint16_t getcell(size_t x, size_t y);
 void terminal_set_color(enum vga_color fg, enum vga_color bg);
 /* Clear terminal screen and reset scrollback view to bottom */
 void terminal_clear_screen(void);
+/* Switch display backend (NULL = VGA text); repaints from scrollback */
+void terminal_set_console(const console_driver *drv);
 
 /* ----- Output ----- */
 
@@ -37,6 +40,8 @@ void terminal_clear_screen(void);
 void _putc(const char c);
 /* Print null-terminated string */
 void _puts(const char *s);
+/* Repaint dirty rows and the cursor (output is otherwise deferred) */
+void terminal_flush(void);
 
 /* ----- Scrollback controls (user navigation) ----- */
 /* Scroll by N lines: +N = up, -N = down */
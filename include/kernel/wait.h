@@ -0,0 +1,33 @@
+#pragma once
+
+#include <arch/i686/io.h>
+#include <stdint.h>
+
+/* Wait queue for the single kernel thread: sleeping means halting the CPU
+ * until an interrupt handler calls wake_up(). */
+typedef struct {
+  volatile uint32_t waiters; // callers currently sleeping in wait_event()
+  volatile uint32_t wakeups; // wake_up() calls so far (statistics)
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT {.waiters = 0, .wakeups = 0}
+
+// TSC cycles spent halted in wait_event(), for CPU-usage figures
+extern volatile uint64_t wait_idle_cycles;
+
+void wake_up(wait_queue_t *wq);
+
+/* Sleep until cond holds. cond is tested with interrupts off and the CPU
+ * halts with "sti; hlt", so a wake_up() between test and halt is not lost. */
+#define wait_event(wq, cond)                                                   \
+  do {                                                                         \
+    uint32_t __wait_flags = i686_irq_save();                                   \
+    (wq)->waiters++;                                                           \
+    while (!(cond)) {                                                          \
+      uint64_t __wait_start = i686_rdtsc();                                    \
+      __asm__ volatile("sti; hlt; cli" ::: "memory");                          \
+      wait_idle_cycles += i686_rdtsc() - __wait_start;                         \
+    }                                                                          \
+    (wq)->waiters--;                                                           \
+    i686_irq_restore(__wait_flags);                                            \
+  } while (0)
@@ -15,4 +15,5 @@ size_t strlen(const char *s);
 int strcmp(const char *s1, const char *s2);
 char *strcat(char *dest, const char *src);
 char *strtok(char *str, const char *delim);
-char *strchr(const char *str, int ch);
\ No newline at end of file
+char *strchr(const char *str, int ch);
+char *strstr(const char *haystack, const char *needle);
\ No newline at end of file
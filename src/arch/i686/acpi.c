@@ -0,0 +1,107 @@
+#include "arch/i686/acpi.h"
+
+#include <arch/i686/memory.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define PHYS_TO_VIRT(p) ((void *)((uintptr_t)(p) + KERNEL_START))
+
+static const struct acpi_rsdp *rsdp = NULL;
+static const struct acpi_sdt_header *root = NULL; // RSDT or XSDT
+static bool root_is_xsdt = false;
+
+static bool acpi_checksum_ok(const void *p, uint32_t len) {
+  uint8_t sum = 0;
+  for (uint32_t i = 0; i < len; i++)
+    sum += ((const uint8_t *)p)[i];
+  return sum == 0;
+}
+
+static const struct acpi_rsdp *rsdp_scan(uint32_t phys, uint32_t len) {
+  // the RSDP sits on a 16-byte boundary
+  for (uint32_t off = 0; off + 20 <= len; off += 16) {
+    const struct acpi_rsdp *r = PHYS_TO_VIRT(phys + off);
+    if (memcmp(r->signature, "RSD PTR ", 8) == 0 && acpi_checksum_ok(r, 20))
+      return r;
+  }
+  return NULL;
+}
+
+/* Map a whole table: map the header to learn its length, then the rest */
+static const struct acpi_sdt_header *map_table(uint32_t phys) {
+  const struct acpi_sdt_header *h =
+      mem_map_mmio(phys, sizeof(struct acpi_sdt_header), 0);
+  if (!h)
+    return NULL;
+  uint32_t len = h->length;
+  if (len < sizeof(struct acpi_sdt_header))
+    return NULL;
+  h = mem_map_mmio(phys, len, 0);
+  if (!h || !acpi_checksum_ok(h, len))
+    return NULL;
+  return h;
+}
+
+bool acpi_init(const struct mb2_info_fixed *info) {
+  // Prefer the copy GRUB hands us; the tag payload is the RSDP itself
+  const struct mb2_tag *t = NULL;
+  if (info) {
+    t = mb2_find_tag(info, MB2_TAG_ACPI_NEW);
+    if (!t)
+      t = mb2_find_tag(info, MB2_TAG_ACPI_OLD);
+  }
+  if (t) {
+    rsdp = (const struct acpi_rsdp *)((const uint8_t *)t + 8);
+  } else {
+    // EBDA (segment at 0x40E), then the BIOS ROM area
+    uint32_t ebda = (uint32_t)(*(const uint16_t *)PHYS_TO_VIRT(0x40E)) << 4;
+    if (ebda >= 0x80000 && ebda < 0xA0000)
+      rsdp = rsdp_scan(ebda, 1024);
+    if (!rsdp)
+      rsdp = rsdp_scan(0xE0000, 0x20000);
+  }
+  if (!rsdp)
+    return false;
+
+  if (rsdp->revision >= 2 && rsdp->xsdt_address &&
+      rsdp->xsdt_address < 0x100000000ull) {
+    root = map_table((uint32_t)rsdp->xsdt_address);
+    root_is_xsdt = root != NULL;
+  }
+  if (!root)
+    root = map_table(rsdp->rsdt_address);
+  if (!root)
+    return false;
+
+  printf("ACPI: %s rev %u, OEM %c%c%c%c%c%c\n", root_is_xsdt ? "XSDT" : "RSDT",
+         rsdp->revision, rsdp->oem_id[0], rsdp->oem_id[1], rsdp->oem_id[2],
+         rsdp->oem_id[3], rsdp->oem_id[4], rsdp->oem_id[5]);
+  return true;
+}
+
+const struct acpi_sdt_header *acpi_find_table(const char *signature) {
+  if (!root)
+    return NULL;
+
+  uint32_t entry_size = root_is_xsdt ? 8 : 4;
+  uint32_t count = (root->length - sizeof(*root)) / entry_size;
+  const uint8_t *entries = (const uint8_t *)(root + 1);
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint64_t phys;
+    if (root_is_xsdt)
+      memcpy(&phys, entries + i * 8, 8); // entries are not 8-byte aligned
+    else
+      phys = *(const uint32_t *)(entries + i * 4);
+    if (phys >= 0x100000000ull)
+      continue; // not reachable without PAE
+
+    const struct acpi_sdt_header *h =
+        mem_map_mmio((uint32_t)phys, sizeof(struct acpi_sdt_header), 0);
+    if (h && memcmp(h->signature, signature, 4) == 0)
+      return map_table((uint32_t)phys);
+  }
+  return NULL;
+}
@@ -0,0 +1,40 @@
+#include "arch/i686/drivers/acpi_pm.h"
+
+#include <arch/i686/acpi.h>
+#include <arch/i686/io.h>
+#include <kernel/clocksource.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define ACPI_PM_HZ 3579545u
+
+static uint16_t pm_port = 0;
+
+// Bits above the timer width may be junk; the timekeeper masks deltas
+static uint64_t acpi_pm_read(void) { return i686_inl(pm_port); }
+
+static clocksource acpi_pm_clocksource = {
+    .name = "acpi_pm",
+    .read = &acpi_pm_read,
+    .mask = 0xFFFFFFull,
+    .freq_hz = ACPI_PM_HZ,
+    .rating = 200,
+    .next = NULL,
+};
+
+bool acpi_pm_init(void) {
+  const struct acpi_fadt *fadt =
+      (const struct acpi_fadt *)acpi_find_table("FACP");
+  if (!fadt || fadt->header.length < sizeof(*fadt) || !fadt->pm_timer_block ||
+      fadt->pm_timer_length < 4)
+    return false;
+
+  pm_port = (uint16_t)fadt->pm_timer_block;
+  if (fadt->flags & ACPI_FADT_TMR_VAL_EXT)
+    acpi_pm_clocksource.mask = 0xFFFFFFFFull;
+  printf("ACPI PM timer: port 0x%X, %u-bit\n", pm_port,
+         (fadt->flags & ACPI_FADT_TMR_VAL_EXT) ? 32 : 24);
+  clocksource_register(&acpi_pm_clocksource);
+  return true;
+}
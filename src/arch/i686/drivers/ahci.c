@@ -0,0 +1,918 @@
+#include "arch/i686/drivers/ahci.h"
+
+#include <arch/i686/drivers/apic.h>
+#include <arch/i686/io.h>
+#include <arch/i686/irq.h>
+#include <arch/i686/memory.h>
+#include <arch/i686/pci.h>
+#include <kernel/blk.h>
+#include <kernel/clocksource.h>
+#include <kernel/softirq.h>
+#include <kernel/timer.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#define AHCI_MAX_HBAS 2
+#define AHCI_MAX_DISKS 8
+#define AHCI_MAX_SLOTS 32
+// A command table is 2 KiB: the 128-byte header plus this many PRD entries
+#define AHCI_PRDT_ENTRIES 120
+// Worst case a bio adds two partial pages to the pages its sectors fill, so
+// these limits always fit one request into one command table
+#define AHCI_MAX_SEGMENTS 16
+#define AHCI_MAX_SECTORS ((AHCI_PRDT_ENTRIES - 2 * AHCI_MAX_SEGMENTS) * 8)
+#define AHCI_MAX_SECTORS_LBA28 256 // 8-bit count, 0 meaning 256
+#define AHCI_PRD_MAX_BYTES 0x400000 // 4 MiB per entry
+
+#define AHCI_CMD_TIMEOUT_NS (5 * NSEC_PER_SEC)
+#define AHCI_CHECK_NS NSEC_PER_SEC          // timeout scan while busy
+#define AHCI_POLL_NS (NSEC_PER_SEC / 1000)  // completion polling without IRQ
+#define AHCI_SPIN_NS (NSEC_PER_SEC / 2)     // engine start/stop
+#define AHCI_LINK_NS NSEC_PER_SEC           // link up again after COMRESET
+// Hardware coalescing: interrupt after this many completions, or once the
+// oldest unreported one is this many ms old
+#define AHCI_CCC_COMPLETIONS 8
+#define AHCI_CCC_TIMEOUT_MS 1
+
+// ---------- Registers (AHCI 1.3) ----------
+#define AHCI_CAP_NCS(cap) ((((cap) >> 8) & 0x1F) + 1) // command slots
+#define AHCI_CAP_CCCS (1u << 7)
+#define AHCI_CAP_SNCQ (1u << 30)
+#define AHCI_CAP2_BOH (1u << 0)
+
+#define AHCI_GHC_HR (1u << 0)
+#define AHCI_GHC_IE (1u << 1)
+#define AHCI_GHC_AE (1u << 31)
+
+#define AHCI_BOHC_BOS (1u << 0)
+#define AHCI_BOHC_OOS (1u << 1)
+#define AHCI_BOHC_BB (1u << 4)
+
+#define AHCI_CCC_EN (1u << 0)
+#define AHCI_CCC_INT(ctl) (((ctl) >> 3) & 0x1F)
+
+#define AHCI_PxCMD_ST (1u << 0)
+#define AHCI_PxCMD_SUD (1u << 1)
+#define AHCI_PxCMD_POD (1u << 2)
+#define AHCI_PxCMD_FRE (1u << 4)
+#define AHCI_PxCMD_FR (1u << 14)
+#define AHCI_PxCMD_CR (1u << 15)
+
+#define AHCI_PxIS_DHRS (1u << 0)  // D2H register FIS
+#define AHCI_PxIS_PSS (1u << 1)   // PIO setup FIS
+#define AHCI_PxIS_DSS (1u << 2)   // DMA setup FIS
+#define AHCI_PxIS_SDBS (1u << 3)  // set device bits FIS (NCQ completions)
+#define AHCI_PxIS_DPS (1u << 5)   // a PRD with the I bit finished
+#define AHCI_PxIS_IFS (1u << 27)  // interface fatal error
+#define AHCI_PxIS_HBDS (1u << 28) // host bus data error
+#define AHCI_PxIS_HBFS (1u << 29) // host bus fatal error
+#define AHCI_PxIS_TFES (1u << 30) // task file error
+#define AHCI_PxIS_ERRORS                                                       \
+  (AHCI_PxIS_IFS | AHCI_PxIS_HBDS | AHCI_PxIS_HBFS | AHCI_PxIS_TFES)
+#define AHCI_PxIS_COMPLETIONS                                                  \
+  (AHCI_PxIS_DHRS | AHCI_PxIS_PSS | AHCI_PxIS_DSS | AHCI_PxIS_SDBS)
+#define AHCI_PxIE_DEFAULT (AHCI_PxIS_COMPLETIONS | AHCI_PxIS_ERRORS)
+
+#define AHCI_PxTFD_ERR (1u << 0)
+#define AHCI_PxTFD_DRQ (1u << 3)
+#define AHCI_PxTFD_BSY (1u << 7)
+
+#define AHCI_SSTS_DET(s) ((s) & 0x0F) // 3: device present, phy up
+#define AHCI_SSTS_IPM(s) (((s) >> 8) & 0x0F) // 1: active
+#define AHCI_SIG_ATA 0x00000101
+
+typedef volatile struct {
+  uint32_t clb, clbu; // command list, 1 KiB aligned
+  uint32_t fb, fbu;   // received FIS area, 256 byte aligned
+  uint32_t is, ie, cmd, reserved0;
+  uint32_t tfd, sig, ssts, sctl, serr, sact, ci, sntf, fbs;
+  uint32_t reserved1[11];
+  uint32_t vendor[4];
+} ahci_port_regs_t;
+
+typedef volatile struct {
+  uint32_t cap, ghc, is, pi, vs;
+  uint32_t ccc_ctl, ccc_ports;
+  uint32_t em_loc, em_ctl;
+  uint32_t cap2, bohc;
+  uint8_t reserved[0x100 - 0x2C];
+  ahci_port_regs_t ports[32];
+} ahci_hba_regs_t;
+
+// ---------- Command structures ----------
+#define AHCI_CMD_CFL_H2D 5 // command FIS length in dwords
+#define AHCI_CMD_WRITE (1u << 6)
+#define AHCI_CMD_CLEAR_BUSY (1u << 10)
+
+typedef struct {
+  uint16_t flags; // CFL, A, W, P, R, B, C, PMP
+  uint16_t prdtl; // PRD entries
+  volatile uint32_t prdbc; // bytes transferred
+  uint32_t ctba, ctbau;
+  uint32_t reserved[4];
+} ahci_cmd_header_t;
+
+typedef struct {
+  uint32_t dba, dbau;
+  uint32_t reserved;
+  uint32_t dbc; // byte count - 1, bit 31: interrupt on completion
+} ahci_prd_t;
+
+typedef struct {
+  uint8_t cfis[64];
+  uint8_t acmd[16];
+  uint8_t reserved[48];
+  ahci_prd_t prdt[AHCI_PRDT_ENTRIES];
+} ahci_cmd_table_t;
+
+#define FIS_TYPE_REG_H2D 0x27
+
+#define ATA_CMD_READ_DMA 0xC8
+#define ATA_CMD_READ_DMA_EXT 0x25
+#define ATA_CMD_WRITE_DMA 0xCA
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_WRITE_DMA_FUA_EXT 0x3D
+#define ATA_CMD_READ_FPDMA_QUEUED 0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+#define ATA_CMD_CACHE_FLUSH 0xE7
+#define ATA_CMD_CACHE_FLUSH_EXT 0xEA
+#define ATA_CMD_IDENTIFY 0xEC
+#define ATA_DEV_LBA 0x40
+#define ATA_DEV_FUA 0x80 // FPDMA QUEUED writes
+
+// IDENTIFY DEVICE words
+#define ATA_ID_MODEL 27
+#define ATA_ID_LBA28 60
+#define ATA_ID_QUEUE_DEPTH 75
+#define ATA_ID_SATA_CAP 76
+#define ATA_ID_COMMAND_SET_1 82
+#define ATA_ID_COMMAND_SET_2 83
+#define ATA_ID_CFSSE 84
+#define ATA_ID_CFS_ENABLE_1 85
+#define ATA_ID_LBA48 100
+
+// ---------- State ----------
+struct ahci_hba;
+
+// Error recovery, one step per timer tick so other tasklets keep running
+enum {
+  AHCI_RECOVER_NONE,
+  AHCI_RECOVER_STOP,  // ST cleared, waiting for the engine to stop
+  AHCI_RECOVER_FIS,   // FRE cleared, waiting for FIS receive to stop
+  AHCI_RECOVER_RESET, // COMRESET asserted
+  AHCI_RECOVER_LINK,  // waiting for the link to come back
+  AHCI_RECOVER_READY, // waiting for the drive to drop BSY/DRQ
+};
+
+typedef struct {
+  struct ahci_hba *hba;
+  ahci_port_regs_t *regs;
+  uint8_t index; // port number
+  uint8_t depth; // slots used
+  bool ncq;
+  bool lba48;
+  bool fua;
+  bool wcache;
+  ahci_cmd_header_t *cmd_list;
+  ahci_cmd_table_t *tables[AHCI_MAX_SLOTS];
+  uint32_t issued;              // slots in flight
+  uint32_t reserved;            // slots whose command is being built
+  uint32_t untagged;            // of those, the ones not queued (NCQ ports)
+  uint32_t unreaped;            // done but not reaped at the last timer tick
+  bool post_flush; // the write in flight needs a FLUSH CACHE to be FUA
+  volatile uint32_t irq_status; // PxIS bits collected by the IRQ handler
+  uint8_t recover;              // AHCI_RECOVER_*
+  int recover_error;            // for the commands it fails
+  uint64_t recover_deadline;    // of the current step
+  blk_request_t *rq[AHCI_MAX_SLOTS];
+  uint64_t started[AHCI_MAX_SLOTS]; // ktime of issue
+  ktimer_t timer;
+  char name[4];
+  char model[41];
+  blkdev_t blk;
+} ahci_port_t;
+
+typedef struct ahci_hba {
+  ahci_hba_regs_t *regs;
+  uint32_t cap;
+  uint8_t irq; // IRQ_MSI, an ISA line, or 0xFF: none
+  bool irq_broken;
+  bool ccc;
+  uint8_t ccc_int; // IS bit of the coalesced interrupt
+  ahci_port_t *ports[32];
+  tasklet_t tasklet;
+  ahci_stats_t stats;
+} ahci_hba_t;
+
+static ahci_hba_t hbas[AHCI_MAX_HBAS];
+static unsigned hba_count = 0;
+static ahci_port_t disks[AHCI_MAX_DISKS];
+static unsigned disk_count = 0;
+// IDENTIFY data; the kernel image is physically contiguous
+static uint16_t identify_buf[256];
+
+static bool ahci_blk_start(blkdev_t *dev, blk_request_t *rq);
+static void ahci_port_timer(void *data);
+static const blkdev_ops_t ahci_blk_ops = {.start = ahci_blk_start};
+
+/* Spin until (*reg & mask) == value; false after timeout_ns */
+static bool ahci_spin(volatile uint32_t *reg, uint32_t mask, uint32_t value,
+                      uint64_t timeout_ns) {
+  uint64_t deadline = ktime_get_ns() + timeout_ns;
+  while ((*reg & mask) != value)
+    if (ktime_get_ns() > deadline)
+      return false;
+  return true;
+}
+
+/* A zeroed page for controller structures; virt and phys */
+static void *ahci_alloc_page(uint32_t *phys) {
+  *phys = pmm_alloc_page_frame();
+  if (!*phys)
+    return NULL;
+  void *page = mem_map_mmio(*phys, 0x1000, PAGE_FLAG_WRITE);
+  if (page)
+    memset(page, 0, 0x1000);
+  return page;
+}
+
+// ---------- Port engine ----------
+
+static bool ahci_port_stop(ahci_port_regs_t *r) {
+  r->cmd &= ~AHCI_PxCMD_ST;
+  if (!ahci_spin(&r->cmd, AHCI_PxCMD_CR, 0, AHCI_SPIN_NS))
+    return false;
+  r->cmd &= ~AHCI_PxCMD_FRE;
+  return ahci_spin(&r->cmd, AHCI_PxCMD_FR, 0, AHCI_SPIN_NS);
+}
+
+/* COMRESET: bring the link down and up again, for a drive stuck busy */
+static bool ahci_port_reset(ahci_port_regs_t *r) {
+  r->sctl = (r->sctl & ~0x0Fu) | 1;
+  uint64_t t = ktime_get_ns() + NSEC_PER_SEC / 1000; // hold it >= 1 ms
+  while (ktime_get_ns() < t)
+    ;
+  r->sctl &= ~0x0Fu;
+  if (!ahci_spin(&r->ssts, 0x0F, 3, NSEC_PER_SEC))
+    return false;
+  r->serr = 0xFFFFFFFF;
+  return true;
+}
+
+static bool ahci_port_start(ahci_port_regs_t *r) {
+  r->serr = 0xFFFFFFFF; // write-1-to-clear
+  r->is = 0xFFFFFFFF;
+  if (!ahci_spin(&r->tfd, AHCI_PxTFD_BSY | AHCI_PxTFD_DRQ, 0,
+                 AHCI_CMD_TIMEOUT_NS) &&
+      !ahci_port_reset(r))
+    return false;
+  r->cmd |= AHCI_PxCMD_FRE;
+  r->cmd |= AHCI_PxCMD_ST;
+  return true;
+}
+
+// ---------- Commands ----------
+
+/* Describe the bios from `bio` on, `sectors` in all, in the slot's PRD
+ * table: one entry per physically contiguous run. Returns the number of
+ * entries, 0 if a buffer can't be used for DMA. */
+static uint16_t ahci_build_prdt(ahci_cmd_table_t *t, const bio_t *bio,
+                                uint32_t sectors) {
+  uint32_t left = sectors * 512;
+  uint16_t n = 0;
+  uint32_t len = 0; // bytes in prdt[n - 1]
+  for (; bio && left; bio = bio->next) {
+    uint32_t vaddr = (uint32_t)bio->buf;
+    uint32_t bytes = bio->count * 512;
+    if (bytes > left)
+      bytes = left;
+    left -= bytes;
+    while (bytes) {
+      uint32_t phys = mem_virt_to_phys((const void *)vaddr);
+      if (!phys || (phys & 1))
+        return 0;
+      uint32_t chunk = 0x1000 - (vaddr & 0xFFF);
+      if (chunk > bytes)
+        chunk = bytes;
+      if (n && t->prdt[n - 1].dba + len == phys &&
+          len + chunk <= AHCI_PRD_MAX_BYTES) {
+        len += chunk;
+      } else {
+        if (n == AHCI_PRDT_ENTRIES)
+          return 0;
+        if (n)
+          t->prdt[n - 1].dbc = len - 1;
+        t->prdt[n] = (ahci_prd_t){.dba = phys};
+        len = chunk;
+        n++;
+      }
+      vaddr += chunk;
+      bytes -= chunk;
+    }
+  }
+  if (n)
+    t->prdt[n - 1].dbc = len - 1;
+  return n;
+}
+
+/* Fill the register FIS. NCQ commands carry the count in the features
+ * field and the tag in the count field. */
+static void ahci_fill_fis(uint8_t *fis, uint8_t command, uint64_t lba,
+                          uint32_t count, uint8_t device, int tag) {
+  memset(fis, 0, 20);
+  fis[0] = FIS_TYPE_REG_H2D;
+  fis[1] = 0x80; // a command, not a control update
+  fis[2] = command;
+  fis[4] = (uint8_t)lba;
+  fis[5] = (uint8_t)(lba >> 8);
+  fis[6] = (uint8_t)(lba >> 16);
+  fis[7] = device;
+  fis[8] = (uint8_t)(lba >> 24);
+  fis[9] = (uint8_t)(lba >> 32);
+  fis[10] = (uint8_t)(lba >> 40);
+  if (tag >= 0) {
+    fis[3] = (uint8_t)count;
+    fis[11] = (uint8_t)(count >> 8);
+    fis[12] = (uint8_t)(tag << 3);
+  } else {
+    fis[12] = (uint8_t)count;
+    fis[13] = (uint8_t)(count >> 8);
+  }
+}
+
+/* Does rq go out as an NCQ command? */
+static bool ahci_queued(const ahci_port_t *p, const blk_request_t *rq) {
+  return p->ncq && rq->op != BIO_FLUSH;
+}
+
+/* Build the command for rq in slot; false if its buffers can't be used
+ * for DMA */
+static bool ahci_prepare(ahci_port_t *p, int slot, blk_request_t *rq) {
+  ahci_cmd_table_t *t = p->tables[slot];
+  ahci_cmd_header_t *h = &p->cmd_list[slot];
+  bool fua = rq->flags & BIO_FUA;
+  uint16_t prds = 0;
+  uint8_t command;
+  uint8_t device = ATA_DEV_LBA;
+  int tag = -1;
+
+  p->post_flush = false;
+  if (rq->op == BIO_FLUSH) {
+    command = p->lba48 ? ATA_CMD_CACHE_FLUSH_EXT : ATA_CMD_CACHE_FLUSH;
+    device = 0;
+  } else {
+    prds = ahci_build_prdt(t, rq->bios, rq->count);
+    if (!prds)
+      return false;
+    if (ahci_queued(p, rq)) {
+      tag = slot;
+      command = rq->op == BIO_READ ? ATA_CMD_READ_FPDMA_QUEUED
+                                   : ATA_CMD_WRITE_FPDMA_QUEUED;
+      if (fua)
+        device |= ATA_DEV_FUA; // part of every NCQ write
+    } else if (p->lba48) {
+      command = rq->op == BIO_READ ? ATA_CMD_READ_DMA_EXT
+                : fua && p->fua    ? ATA_CMD_WRITE_DMA_FUA_EXT
+                                   : ATA_CMD_WRITE_DMA_EXT;
+    } else {
+      command = rq->op == BIO_READ ? ATA_CMD_READ_DMA : ATA_CMD_WRITE_DMA;
+      device |= (uint8_t)((rq->sector >> 24) & 0x0F);
+    }
+    // without NCQ there is only one slot in flight: flush right after it
+    p->post_flush = fua && !p->ncq && !p->fua;
+  }
+  ahci_fill_fis(t->cfis, command, rq->sector, rq->count, device, tag);
+  h->flags = AHCI_CMD_CFL_H2D | (rq->op == BIO_WRITE ? AHCI_CMD_WRITE : 0);
+  h->prdtl = prds;
+  h->prdbc = 0;
+  return true;
+}
+
+// ---------- Completion ----------
+
+/* Fail everything in flight; the engine has stopped, so no DMA touches
+ * their buffers any more */
+static void ahci_fail_all(ahci_port_t *p, int error) {
+  uint32_t flags = i686_irq_save();
+  uint32_t failed = p->issued;
+  p->issued = 0;
+  p->unreaped = 0;
+  p->irq_status = 0;
+  p->post_flush = false;
+  i686_irq_restore(flags);
+  for (int slot = 0; slot < AHCI_MAX_SLOTS; slot++)
+    if (failed & (1u << slot))
+      blk_end_request(&p->blk, p->rq[slot], error);
+}
+
+static void ahci_recover_next(ahci_port_t *p, uint8_t step,
+                              uint64_t timeout_ns) {
+  p->recover = step;
+  p->recover_deadline = ktime_get_ns() + timeout_ns;
+}
+
+/* Start over with the commands that come next */
+static void ahci_recover_done(ahci_port_t *p) {
+  ahci_port_regs_t *r = p->regs;
+  r->serr = 0xFFFFFFFF; // write-1-to-clear
+  r->is = 0xFFFFFFFF;
+  r->cmd |= AHCI_PxCMD_FRE;
+  r->cmd |= AHCI_PxCMD_ST;
+  p->recover = AHCI_RECOVER_NONE;
+  blk_run_queue(&p->blk);
+}
+
+/* One step of the recovery; the port timer calls it every AHCI_POLL_NS.
+ * A step that times out goes on to the next one anyway. */
+static void ahci_recover_step(ahci_port_t *p) {
+  ahci_port_regs_t *r = p->regs;
+  bool expired = ktime_get_ns() > p->recover_deadline;
+  bool busy = r->tfd & (AHCI_PxTFD_BSY | AHCI_PxTFD_DRQ);
+  switch (p->recover) {
+  case AHCI_RECOVER_STOP:
+    if ((r->cmd & AHCI_PxCMD_CR) && !expired)
+      return;
+    ahci_fail_all(p, p->recover_error);
+    r->cmd &= ~AHCI_PxCMD_FRE;
+    ahci_recover_next(p, AHCI_RECOVER_FIS, AHCI_SPIN_NS);
+    return;
+  case AHCI_RECOVER_FIS:
+    if ((r->cmd & AHCI_PxCMD_FR) && !expired)
+      return;
+    if (!busy) {
+      ahci_recover_done(p);
+      return;
+    }
+    r->sctl = (r->sctl & ~0x0Fu) | 1; // COMRESET, held for >= 1 ms
+    ahci_recover_next(p, AHCI_RECOVER_RESET, AHCI_POLL_NS);
+    return;
+  case AHCI_RECOVER_RESET:
+    if (!expired)
+      return;
+    r->sctl &= ~0x0Fu;
+    ahci_recover_next(p, AHCI_RECOVER_LINK, AHCI_LINK_NS);
+    return;
+  case AHCI_RECOVER_LINK:
+    if (AHCI_SSTS_DET(r->ssts) != 3 && !expired)
+      return;
+    r->serr = 0xFFFFFFFF;
+    ahci_recover_next(p, AHCI_RECOVER_READY, AHCI_CMD_TIMEOUT_NS);
+    return;
+  case AHCI_RECOVER_READY:
+    if (busy && !expired)
+      return;
+    ahci_recover_done(p);
+    return;
+  }
+}
+
+/* Stop the port after an error or timeout. The port timer takes it from
+ * there: it fails the commands in flight once the engine has stopped,
+ * resets the link if the drive stays busy and restarts the port. */
+static void ahci_port_recover(ahci_port_t *p, int error) {
+  if (p->recover)
+    return;
+  ahci_port_regs_t *r = p->regs;
+  printf("AHCI: %s: %s (TFD 0x%X, SERR 0x%X), resetting port %u\n",
+         p->name, error == BLK_ETIMEDOUT ? "command timeout" : "error",
+         r->tfd, r->serr, p->index);
+  r->cmd &= ~AHCI_PxCMD_ST;
+  p->recover_error = error;
+  ahci_recover_next(p, AHCI_RECOVER_STOP, AHCI_SPIN_NS);
+  timer_add(&p->timer, ktime_get_ns() + AHCI_POLL_NS, ahci_port_timer, p);
+}
+
+/* Turn slot into a FLUSH CACHE for the write that just completed in it */
+static void ahci_reissue_flush(ahci_port_t *p, int slot) {
+  ahci_fill_fis(p->tables[slot]->cfis,
+                p->lba48 ? ATA_CMD_CACHE_FLUSH_EXT : ATA_CMD_CACHE_FLUSH, 0, 0,
+                0, -1);
+  p->cmd_list[slot].flags = AHCI_CMD_CFL_H2D;
+  p->cmd_list[slot].prdtl = 0;
+  p->post_flush = false;
+  uint32_t flags = i686_irq_save();
+  p->issued |= 1u << slot;
+  p->started[slot] = ktime_get_ns();
+  p->regs->ci = 1u << slot;
+  i686_irq_restore(flags);
+}
+
+/* Finish the commands the port no longer has in CI/SACT */
+static void ahci_port_complete(ahci_port_t *p) {
+  uint32_t flags = i686_irq_save();
+  uint32_t status = p->irq_status;
+  p->irq_status = 0;
+  i686_irq_restore(flags);
+  if (p->recover)
+    return; // stopping the engine cleared CI: nothing is done
+  if (status & AHCI_PxIS_ERRORS) {
+    // with NCQ the failed tag would need the error log: fail them all
+    ahci_port_recover(p, BLK_EIO);
+    return;
+  }
+
+  flags = i686_irq_save();
+  uint32_t done = p->issued & ~(p->regs->ci | p->regs->sact);
+  p->issued &= ~done;
+  i686_irq_restore(flags);
+  if (!done)
+    return;
+
+  ahci_hba_t *h = p->hba;
+  uint32_t batch = 0;
+  for (int slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+    if (!(done & (1u << slot)))
+      continue;
+    if (p->post_flush) {
+      ahci_reissue_flush(p, slot);
+      continue;
+    }
+    batch++;
+    blk_end_request(&p->blk, p->rq[slot], BLK_OK);
+  }
+  h->stats.completions += batch;
+  if (batch > h->stats.max_batch)
+    h->stats.max_batch = batch;
+}
+
+/* Tasklet: reap every port of the controller */
+static void ahci_hba_tasklet(void *data) {
+  ahci_hba_t *h = data;
+  for (int i = 0; i < 32; i++)
+    if (h->ports[i])
+      ahci_port_complete(h->ports[i]);
+}
+
+/* Hard IRQ: acknowledge the ports, then the controller, and leave the rest
+ * to the tasklet. One handler serves every controller. */
+static void ahci_irq(registers *regs) {
+  (void)regs;
+  for (unsigned i = 0; i < hba_count; i++) {
+    ahci_hba_t *h = &hbas[i];
+    uint32_t is = h->regs->is;
+    if (!is)
+      continue;
+    // the coalesced interrupt stands for every port it covers
+    uint32_t ports = is;
+    if (h->ccc && (is & (1u << h->ccc_int)))
+      ports |= h->regs->ccc_ports;
+    for (int port = 0; port < 32; port++) {
+      if (!(ports & (1u << port)) || !h->ports[port])
+        continue;
+      ahci_port_t *p = h->ports[port];
+      uint32_t pis = p->regs->is;
+      p->regs->is = pis; // write-1-to-clear
+      p->irq_status |= pis;
+    }
+    h->regs->is = is;
+    h->stats.irqs++;
+    tasklet_schedule(&h->tasklet);
+  }
+}
+
+/* Per-port timer while commands are in flight: fail the port when one
+ * overstays, and poll for completions on a controller that never
+ * interrupts */
+static void ahci_port_timer(void *data) {
+  ahci_port_t *p = data;
+  ahci_hba_t *h = p->hba;
+  if (p->recover) {
+    ahci_recover_step(p);
+    if (p->recover)
+      timer_add(&p->timer, ktime_get_ns() + AHCI_POLL_NS, ahci_port_timer, p);
+    return;
+  }
+  if (!p->issued)
+    return;
+
+  // done a whole tick ago and still nobody reaped it
+  uint32_t done = p->issued & ~(p->regs->ci | p->regs->sact);
+  if ((done & p->unreaped) && !h->irq_broken && !h->tasklet.scheduled) {
+    h->irq_broken = true;
+    h->stats.polled = true;
+    printf("AHCI: no interrupt from the controller, polling from now on\n");
+  }
+  if (h->irq_broken) {
+    uint32_t flags = i686_irq_save();
+    uint32_t pis = p->regs->is;
+    p->regs->is = pis;
+    p->irq_status |= pis;
+    i686_irq_restore(flags);
+    ahci_port_complete(p);
+  }
+  p->unreaped = p->issued & ~(p->regs->ci | p->regs->sact);
+
+  uint64_t now = ktime_get_ns();
+  for (int slot = 0; slot < AHCI_MAX_SLOTS; slot++)
+    if ((p->issued & (1u << slot)) &&
+        now - p->started[slot] > AHCI_CMD_TIMEOUT_NS) {
+      ahci_port_recover(p, BLK_ETIMEDOUT);
+      return;
+    }
+  if (p->issued && !p->recover)
+    timer_add(&p->timer, now + (h->irq_broken ? AHCI_POLL_NS : AHCI_CHECK_NS),
+              ahci_port_timer, p);
+}
+
+// ---------- Block device ----------
+
+/* blkdev start: put rq in a free command slot and issue it */
+static bool ahci_blk_start(blkdev_t *dev, blk_request_t *rq) {
+  ahci_port_t *p = dev->driver_data;
+  bool queued = ahci_queued(p, rq);
+  uint32_t flags = i686_irq_save();
+  uint32_t busy = p->issued | p->reserved;
+  uint32_t mask = p->depth == 32 ? 0xFFFFFFFF : (1u << p->depth) - 1;
+  uint32_t free = ~busy & mask;
+  // queued and non-queued commands must not be outstanding together
+  if (p->recover || !free ||
+      (p->ncq && busy && (!queued || (busy & p->untagged)))) {
+    i686_irq_restore(flags);
+    return false;
+  }
+  int slot = __builtin_ctz(free);
+  p->reserved |= 1u << slot; // the completion path leaves it alone
+  if (queued)
+    p->untagged &= ~(1u << slot);
+  else
+    p->untagged |= 1u << slot;
+  i686_irq_restore(flags);
+
+  if (!ahci_prepare(p, slot, rq)) {
+    flags = i686_irq_save();
+    p->reserved &= ~(1u << slot);
+    i686_irq_restore(flags);
+    blk_end_request(dev, rq, BLK_EINVAL); // odd or unmapped buffer
+    return true;
+  }
+
+  flags = i686_irq_save();
+  p->reserved &= ~(1u << slot);
+  if (p->recover) {
+    i686_irq_restore(flags); // began meanwhile: it restarts the queue
+    return false;
+  }
+  p->rq[slot] = rq;
+  p->started[slot] = ktime_get_ns();
+  p->issued |= 1u << slot;
+  if (queued)
+    p->regs->sact = 1u << slot; // before CI, as NCQ requires
+  p->regs->ci = 1u << slot;
+  if (!timer_pending(&p->timer))
+    timer_add(&p->timer,
+              p->started[slot] +
+                  (p->hba->irq_broken ? AHCI_POLL_NS : AHCI_CHECK_NS),
+              ahci_port_timer, p);
+  i686_irq_restore(flags);
+  return true;
+}
+
+// ---------- Probe ----------
+
+/* Run IDENTIFY DEVICE in slot 0, polled; the port is started, the
+ * controller's interrupts are still off */
+static bool ahci_identify(ahci_port_t *p) {
+  ahci_port_regs_t *r = p->regs;
+  bio_t bio = {.buf = identify_buf, .count = 1};
+  ahci_cmd_table_t *t = p->tables[0];
+  uint16_t prds = ahci_build_prdt(t, &bio, 1);
+  if (!prds)
+    return false;
+  ahci_fill_fis(t->cfis, ATA_CMD_IDENTIFY, 0, 0, 0, -1);
+  p->cmd_list[0].flags = AHCI_CMD_CFL_H2D;
+  p->cmd_list[0].prdtl = prds;
+  p->cmd_list[0].prdbc = 0;
+
+  r->is = 0xFFFFFFFF;
+  r->ci = 1;
+  uint64_t deadline = ktime_get_ns() + AHCI_CMD_TIMEOUT_NS;
+  while (r->ci & 1)
+    if ((r->is & AHCI_PxIS_TFES) || ktime_get_ns() > deadline)
+      return false;
+  r->is = 0xFFFFFFFF;
+  return !(r->tfd & AHCI_PxTFD_ERR);
+}
+
+/* Take the IDENTIFY data apart */
+static void ahci_parse_identify(ahci_port_t *p, uint32_t cap) {
+  const uint16_t *id = identify_buf;
+  for (int k = 0; k < 20; k++) {
+    p->model[2 * k] = (char)(id[ATA_ID_MODEL + k] >> 8);
+    p->model[2 * k + 1] = (char)id[ATA_ID_MODEL + k];
+  }
+  p->model[40] = 0;
+  for (int k = 39; k >= 0 && p->model[k] == ' '; k--)
+    p->model[k] = 0;
+
+  p->lba48 = id[ATA_ID_COMMAND_SET_2] & (1 << 10);
+  if (p->lba48)
+    p->blk.sectors = *(const uint64_t *)&id[ATA_ID_LBA48] & 0xFFFFFFFFFFFFull;
+  else
+    p->blk.sectors = *(const uint32_t *)&id[ATA_ID_LBA28];
+
+  // NCQ needs LBA48 and support on both ends (word 76 bit 8, CAP.SNCQ)
+  p->ncq = p->lba48 && (id[ATA_ID_SATA_CAP] & (1 << 8)) &&
+           (cap & AHCI_CAP_SNCQ);
+  p->depth = 1;
+  if (p->ncq) {
+    uint8_t depth = (uint8_t)((id[ATA_ID_QUEUE_DEPTH] & 0x1F) + 1);
+    p->depth = depth < AHCI_CAP_NCS(cap) ? depth : AHCI_CAP_NCS(cap);
+  }
+
+  // words 82/85 bit 5: write cache supported/enabled; word 84 bit 6: FUA
+  p->wcache = !(id[ATA_ID_COMMAND_SET_1] & (1 << 5)) ||
+              (id[ATA_ID_CFS_ENABLE_1] & (1 << 5));
+  p->fua = p->lba48 && (id[ATA_ID_CFSSE] & 0xC000) == 0x4000 &&
+           (id[ATA_ID_CFSSE] & (1 << 6));
+}
+
+/* Give the port its command list, FIS area and command tables, start it
+ * and identify the disk */
+static bool ahci_port_init(ahci_hba_t *h, ahci_port_t *p, uint8_t index) {
+  ahci_port_regs_t *r = &h->regs->ports[index];
+  p->hba = h;
+  p->regs = r;
+  p->index = index;
+  if (!ahci_port_stop(r))
+    return false;
+
+  // one page: the 1 KiB command list, then the 256-byte received FIS area
+  uint32_t phys;
+  uint8_t *page = ahci_alloc_page(&phys);
+  if (!page)
+    return false;
+  p->cmd_list = (ahci_cmd_header_t *)page;
+  r->clb = phys;
+  r->clbu = 0;
+  r->fb = phys + 0x400;
+  r->fbu = 0;
+
+  // two 2 KiB command tables per page
+  uint32_t slots = AHCI_CAP_NCS(h->cap);
+  for (uint32_t s = 0; s < slots; s += 2) {
+    uint8_t *tables = ahci_alloc_page(&phys);
+    if (!tables)
+      return false;
+    for (uint32_t k = 0; k < 2 && s + k < slots; k++) {
+      p->tables[s + k] = (ahci_cmd_table_t *)(tables + k * 0x800);
+      p->cmd_list[s + k].ctba = phys + k * 0x800;
+      p->cmd_list[s + k].ctbau = 0;
+    }
+  }
+
+  r->cmd |= AHCI_PxCMD_SUD | AHCI_PxCMD_POD; // spun up, powered
+  if (!ahci_port_start(r) || !ahci_identify(p)) {
+    ahci_port_stop(r);
+    return false;
+  }
+  ahci_parse_identify(p, h->cap);
+  r->ie = AHCI_PxIE_DEFAULT;
+  return true;
+}
+
+/* Take the controller from the firmware if it offers a handoff */
+static void ahci_bios_handoff(ahci_hba_regs_t *regs) {
+  if (!(regs->cap2 & AHCI_CAP2_BOH))
+    return;
+  regs->bohc |= AHCI_BOHC_OOS;
+  if (!ahci_spin(&regs->bohc, AHCI_BOHC_BOS, 0, NSEC_PER_SEC / 40))
+    return;
+  if (regs->bohc & AHCI_BOHC_BB) // the firmware finishes what it started
+    ahci_spin(&regs->bohc, AHCI_BOHC_BB, 0, 2 * NSEC_PER_SEC);
+}
+
+static void ahci_init_hba(const pci_device_t *dev) {
+  if (hba_count == AHCI_MAX_HBAS || !dev->bar_size[5] ||
+      (dev->bar_io & (1u << 5)))
+    return;
+  ahci_hba_t *h = &hbas[hba_count];
+  h->regs = mem_map_mmio(dev->bar[5], dev->bar_size[5],
+                         PAGE_FLAG_WRITE | PAGE_FLAG_CACHE_DISABLE);
+  if (!h->regs)
+    return;
+  pci_enable(dev, PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER);
+  h->irq = dev->irq_pin && dev->irq_line < 16 ? dev->irq_line : 0xFF;
+  h->tasklet = (tasklet_t)TASKLET_INIT(ahci_hba_tasklet, h);
+
+  ahci_hba_regs_t *regs = h->regs;
+  ahci_bios_handoff(regs);
+  regs->ghc |= AHCI_GHC_AE;
+  h->cap = regs->cap;
+  printf("AHCI: PCI %X:%X, %u ports, %u slots%s\n", dev->vendor_id,
+         dev->device_id, (h->cap & 0x1F) + 1, AHCI_CAP_NCS(h->cap),
+         (h->cap & AHCI_CAP_SNCQ) ? ", NCQ" : "");
+
+  uint32_t pi = regs->pi, active = 0;
+  for (uint8_t i = 0; i < 32 && disk_count < AHCI_MAX_DISKS; i++) {
+    if (!(pi & (1u << i)))
+      continue;
+    ahci_port_regs_t *r = &regs->ports[i];
+    if (AHCI_SSTS_DET(r->ssts) != 3 || AHCI_SSTS_IPM(r->ssts) != 1 ||
+        r->sig != AHCI_SIG_ATA)
+      continue; // empty, asleep, or not a disk (ATAPI, port multiplier)
+
+    ahci_port_t *p = &disks[disk_count];
+    if (!ahci_port_init(h, p, i)) {
+      printf("AHCI: port %u: disk does not respond\n", i);
+      continue;
+    }
+    p->name[0] = 's';
+    p->name[1] = 'd';
+    p->name[2] = (char)('0' + disk_count);
+    p->blk.name = p->name;
+    p->blk.max_sectors = p->lba48 ? AHCI_MAX_SECTORS : AHCI_MAX_SECTORS_LBA28;
+    p->blk.max_segments = AHCI_MAX_SEGMENTS;
+    p->blk.depth = p->depth;
+    p->blk.features = p->wcache ? BLK_FEAT_WCACHE : 0;
+    p->blk.ops = &ahci_blk_ops;
+    p->blk.driver_data = p;
+    h->ports[i] = p;
+    active |= 1u << i;
+    disk_count++;
+  }
+
+  // Completion coalescing, where the controller has it: one interrupt per
+  // AHCI_CCC_COMPLETIONS commands (or AHCI_CCC_TIMEOUT_MS) on all ports
+  if ((h->cap & AHCI_CAP_CCCS) && active) {
+    regs->ccc_ctl &= ~AHCI_CCC_EN;
+    regs->ccc_ports = active;
+    regs->ccc_ctl = (uint32_t)AHCI_CCC_TIMEOUT_MS << 16 |
+                    (uint32_t)AHCI_CCC_COMPLETIONS << 8 | AHCI_CCC_EN;
+    h->ccc = true;
+    h->stats.coalescing = true;
+    h->ccc_int = (uint8_t)AHCI_CCC_INT(regs->ccc_ctl);
+    // completions raise the CCC interrupt only; errors still come at once
+    for (int i = 0; i < 32; i++)
+      if (active & (1u << i))
+        regs->ports[i].ie = AHCI_PxIS_ERRORS;
+  }
+
+  hba_count++;
+  regs->is = 0xFFFFFFFF;
+  // MSI goes straight to the LAPIC. Under the IOAPIC the INTx line would
+  // land on a pin programmed for ISA (edge, active high) and never fire.
+  uint32_t msi_address;
+  uint16_t msi_data;
+  if (apic_msi_message(IRQ_MSI, &msi_address, &msi_data) &&
+      pci_find_capability(dev, PCI_CAP_ID_MSI)) {
+    i686_irq_register_handler(IRQ_MSI, ahci_irq);
+    pci_enable_msi(dev, msi_address, msi_data);
+    h->irq = IRQ_MSI;
+    h->stats.msi = true;
+  } else if (h->irq != 0xFF) {
+    i686_irq_register_handler(h->irq, ahci_irq);
+    i686_irq_unmask(h->irq);
+  } else {
+    h->irq_broken = true; // no line routed: poll
+    h->stats.polled = true;
+  }
+  regs->ghc |= AHCI_GHC_IE;
+
+  for (int i = 0; i < 32; i++) {
+    ahci_port_t *p = h->ports[i];
+    if (!p)
+      continue;
+    blk_register(&p->blk);
+    printf(" %s: port %u, %llu KiB, %s, queue depth %u - %s\n", p->name, i,
+           p->blk.sectors / 2, p->ncq ? "NCQ" : "DMA", p->depth, p->model);
+  }
+}
+
+void ahci_init_pci(void) {
+  const pci_device_t *dev = NULL;
+  while ((dev = pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_SATA, dev)))
+    if (dev->prog_if == 0x01) // AHCI 1.0 programming interface
+      ahci_init_hba(dev);
+}
+
+unsigned ahci_disk_count(void) { return disk_count; }
+
+bool ahci_disk_info(unsigned index, ahci_disk_info_t *out) {
+  if (index >= disk_count)
+    return false;
+  const ahci_port_t *p = &disks[index];
+  *out = (ahci_disk_info_t){.name = p->name,
+                            .model = p->model,
+                            .port = p->index,
+                            .depth = p->depth,
+                            .ncq = p->ncq,
+                            .fua = p->ncq || p->fua,
+                            .wcache = p->wcache,
+                            .sectors = p->blk.sectors};
+  return true;
+}
+
+void ahci_get_stats(ahci_stats_t *out) {
+  memset(out, 0, sizeof *out);
+  for (unsigned i = 0; i < hba_count; i++) {
+    const ahci_stats_t *st = &hbas[i].stats;
+    out->irqs += st->irqs;
+    out->completions += st->completions;
+    if (st->max_batch > out->max_batch)
+      out->max_batch = st->max_batch;
+    out->coalescing |= st->coalescing;
+    out->msi |= st->msi;
+    out->polled |= st->polled;
+  }
+}
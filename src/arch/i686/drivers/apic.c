@@ -0,0 +1,383 @@
+#include "arch/i686/drivers/apic.h"
+
+#include <arch/i686/acpi.h>
+#include <arch/i686/drivers/i8259.h>
+#include <arch/i686/io.h>
+#include <arch/i686/irq.h>
+#include <arch/i686/isr.h>
+#include <arch/i686/memory.h>
+#include <cpuid.h>
+#include <kernel/clockevent.h>
+#include <kernel/clocksource.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* ---------- Local APIC registers (byte offsets) ---------- */
+#define LAPIC_ID 0x020
+#define LAPIC_TPR 0x080
+#define LAPIC_EOI 0x0B0
+#define LAPIC_SVR 0x0F0
+#define LAPIC_ESR 0x280
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_LVT_LINT0 0x350
+#define LAPIC_LVT_LINT1 0x360
+#define LAPIC_LVT_ERROR 0x370
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3E0
+
+#define LAPIC_SVR_ENABLE (1u << 8)
+#define LAPIC_LVT_MASKED (1u << 16)
+#define LAPIC_LVT_NMI (4u << 8)
+#define LAPIC_TIMER_DIV16 0x3
+
+#define IA32_APIC_BASE_MSR 0x1B
+#define IA32_APIC_BASE_ENABLE (1u << 11)
+
+/* ---------- IOAPIC ---------- */
+#define IOAPIC_REGSEL 0x00
+#define IOAPIC_WINDOW 0x10
+#define IOAPIC_REG_VERSION 0x01
+#define IOAPIC_REG_REDIR(n) (0x10 + 2 * (n))
+
+#define IOAPIC_REDIR_MASKED (1u << 16)
+#define IOAPIC_REDIR_LEVEL (1u << 15)
+#define IOAPIC_REDIR_ACTIVE_LOW (1u << 13)
+
+#define MAX_IOAPICS 4
+#define ISA_IRQS 16
+
+static volatile uint32_t *lapic = NULL;
+static uint32_t lapic_phys = 0;
+static uint8_t bsp_apic_id = 0;
+static bool active = false;
+
+static struct {
+  volatile uint32_t *regs;
+  uint32_t phys;
+  uint32_t gsi_base;
+  uint32_t pins;
+} ioapics[MAX_IOAPICS];
+static int ioapic_count = 0;
+
+// ISA IRQ -> GSI and MPS flags, identity unless the MADT overrides it
+static struct {
+  uint32_t gsi;
+  uint16_t flags;
+} isa_route[ISA_IRQS];
+
+static uint8_t vector_base = 0x20;
+
+static inline uint32_t lapic_read(uint32_t reg) { return lapic[reg / 4]; }
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+  lapic[reg / 4] = value;
+}
+
+static uint32_t ioapic_read(int idx, uint32_t reg) {
+  ioapics[idx].regs[IOAPIC_REGSEL / 4] = reg;
+  return ioapics[idx].regs[IOAPIC_WINDOW / 4];
+}
+
+static void ioapic_write(int idx, uint32_t reg, uint32_t value) {
+  ioapics[idx].regs[IOAPIC_REGSEL / 4] = reg;
+  ioapics[idx].regs[IOAPIC_WINDOW / 4] = value;
+}
+
+/* IOAPIC index and pin serving a GSI, or -1 */
+static int ioapic_for_gsi(uint32_t gsi, uint32_t *pin) {
+  for (int i = 0; i < ioapic_count; i++) {
+    if (gsi >= ioapics[i].gsi_base &&
+        gsi < ioapics[i].gsi_base + ioapics[i].pins) {
+      *pin = gsi - ioapics[i].gsi_base;
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Program the redirection entry for an ISA IRQ (left masked) */
+static void apic_route_isa(int irq) {
+  uint32_t pin;
+  int idx = ioapic_for_gsi(isa_route[irq].gsi, &pin);
+  if (idx < 0)
+    return;
+
+  uint32_t low = (uint32_t)(vector_base + irq) | IOAPIC_REDIR_MASKED;
+  // ISA defaults are edge/active-high; "conforms" (0) keeps them
+  uint16_t flags = isa_route[irq].flags;
+  if ((flags & ACPI_MPS_POLARITY_MASK) == ACPI_MPS_POLARITY_LOW)
+    low |= IOAPIC_REDIR_ACTIVE_LOW;
+  if ((flags & ACPI_MPS_TRIGGER_MASK) == ACPI_MPS_TRIGGER_LEVEL)
+    low |= IOAPIC_REDIR_LEVEL;
+
+  // fixed delivery, physical destination: the boot CPU
+  ioapic_write(idx, IOAPIC_REG_REDIR(pin) + 1, (uint32_t)bsp_apic_id << 24);
+  ioapic_write(idx, IOAPIC_REG_REDIR(pin), low);
+}
+
+static void apic_set_masked(int irq, bool masked) {
+  if (irq < 0 || irq >= ISA_IRQS)
+    return;
+  uint32_t pin;
+  int idx = ioapic_for_gsi(isa_route[irq].gsi, &pin);
+  if (idx < 0)
+    return;
+  uint32_t low = ioapic_read(idx, IOAPIC_REG_REDIR(pin));
+  if (masked)
+    low |= IOAPIC_REDIR_MASKED;
+  else
+    low &= ~IOAPIC_REDIR_MASKED;
+  ioapic_write(idx, IOAPIC_REG_REDIR(pin), low);
+}
+
+/* ---------- MADT ---------- */
+static bool apic_parse_madt(const struct acpi_madt *madt) {
+  lapic_phys = madt->lapic_address;
+  for (int i = 0; i < ISA_IRQS; i++) {
+    isa_route[i].gsi = (uint32_t)i;
+    isa_route[i].flags = 0;
+  }
+
+  const uint8_t *p = (const uint8_t *)(madt + 1);
+  const uint8_t *end = (const uint8_t *)madt + madt->header.length;
+  while (p + sizeof(struct acpi_madt_entry) <= end) {
+    const struct acpi_madt_entry *e = (const struct acpi_madt_entry *)p;
+    if (e->length < sizeof(*e) || p + e->length > end)
+      break;
+
+    switch (e->type) {
+    case ACPI_MADT_IOAPIC: {
+      const struct acpi_madt_ioapic *io = (const struct acpi_madt_ioapic *)e;
+      if (ioapic_count < MAX_IOAPICS) {
+        ioapics[ioapic_count].phys = io->address;
+        ioapics[ioapic_count].gsi_base = io->gsi_base;
+        ioapic_count++;
+      }
+      break;
+    }
+    case ACPI_MADT_ISO: {
+      const struct acpi_madt_iso *iso = (const struct acpi_madt_iso *)e;
+      if (iso->bus == 0 && iso->source < ISA_IRQS) {
+        isa_route[iso->source].gsi = iso->gsi;
+        isa_route[iso->source].flags = iso->flags;
+      }
+      break;
+    }
+    case ACPI_MADT_LAPIC_OVERRIDE: {
+      const struct acpi_madt_lapic_override *o =
+          (const struct acpi_madt_lapic_override *)e;
+      if (o->address < 0x100000000ull)
+        lapic_phys = (uint32_t)o->address;
+      break;
+    }
+    default:
+      break;
+    }
+    p += e->length;
+  }
+  return ioapic_count > 0 && lapic_phys != 0;
+}
+
+/* ---------- pic_driver ---------- */
+static bool apic_probe() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(edx & (1u << 9)))
+    return false; // no on-chip APIC
+
+  const struct acpi_madt *madt =
+      (const struct acpi_madt *)acpi_find_table("APIC");
+  if (!madt || !apic_parse_madt(madt))
+    return false;
+
+  lapic = mem_map_mmio(lapic_phys, 0x1000,
+                       PAGE_FLAG_WRITE | PAGE_FLAG_CACHE_DISABLE);
+  if (!lapic)
+    return false;
+  for (int i = 0; i < ioapic_count; i++) {
+    ioapics[i].regs = mem_map_mmio(ioapics[i].phys, 0x20,
+                                   PAGE_FLAG_WRITE | PAGE_FLAG_CACHE_DISABLE);
+    if (!ioapics[i].regs)
+      return false;
+    ioapics[i].pins = ((ioapic_read(i, IOAPIC_REG_VERSION) >> 16) & 0xFF) + 1;
+  }
+  return true;
+}
+
+static void apic_spurious(registers *regs) {
+  (void)regs; // no EOI for spurious interrupts
+}
+
+static void apic_initialize(uint8_t offset_pic1, uint8_t offset_pic2,
+                            bool auto_eoi, void *userdata) {
+  (void)auto_eoi;
+  // Park the 8259s out of the exception range and mask them for good; the
+  // call also programs the PIT as before.
+  const pic_driver *legacy = i8259_get_driver();
+  legacy->initialize(offset_pic1, offset_pic2, false, userdata);
+  legacy->disable();
+  // IMCR: route INTR/NMI to the APIC on boards with PIC mode (harmless
+  // elsewhere)
+  i686_outb(0x22, 0x70);
+  i686_outb(0x23, 0x01);
+
+  vector_base = offset_pic1;
+
+  i686_wrmsr(IA32_APIC_BASE_MSR, (i686_rdmsr(IA32_APIC_BASE_MSR) & 0xFFFu) |
+                                     lapic_phys | IA32_APIC_BASE_ENABLE);
+  bsp_apic_id = (uint8_t)(lapic_read(LAPIC_ID) >> 24);
+
+  i686_isr_register_handler(APIC_SPURIOUS_VECTOR, apic_spurious);
+  lapic_write(LAPIC_TPR, 0); // accept every priority
+  lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+  lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_NMI);
+  lapic_write(LAPIC_LVT_ERROR, LAPIC_LVT_MASKED);
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | APIC_TIMER_VECTOR);
+  lapic_write(LAPIC_ESR, 0);
+  lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+  lapic_write(LAPIC_EOI, 0); // drop anything latched before
+
+  for (int irq = 0; irq < ISA_IRQS; irq++)
+    apic_route_isa(irq);
+
+  active = true;
+  printf("APIC: LAPIC id %u at 0x%X, %d IOAPIC(s), %u pins\n", bsp_apic_id,
+         lapic_phys, ioapic_count, ioapics[0].pins);
+}
+
+static void apic_disable() {
+  for (int irq = 0; irq < ISA_IRQS; irq++)
+    apic_set_masked(irq, true);
+}
+
+static void apic_send_end_of_interrupt(int irq) {
+  (void)irq;
+  lapic_write(LAPIC_EOI, 0); // one MMIO store; also EOIs level IOAPIC pins
+}
+
+static void apic_mask(int irq) { apic_set_masked(irq, true); }
+
+static void apic_unmask(int irq) { apic_set_masked(irq, false); }
+
+// The TPR holds off every vector whose priority class (vector >> 4) is at or
+// below its own: all ISA lines share class 2, the LAPIC timer sits in class 3
+static uint32_t apic_raise_priority(int irq) {
+  uint32_t old = lapic_read(LAPIC_TPR);
+  uint32_t class = (uint32_t)(vector_base + irq) & 0xF0;
+  if (class > old)
+    lapic_write(LAPIC_TPR, class);
+  return old;
+}
+
+static void apic_restore_priority(uint32_t state) {
+  lapic_write(LAPIC_TPR, state);
+}
+
+static bool apic_is_level_triggered(int irq) {
+  if (irq < 0 || irq >= ISA_IRQS)
+    return false;
+  return (isa_route[irq].flags & ACPI_MPS_TRIGGER_MASK) ==
+         ACPI_MPS_TRIGGER_LEVEL;
+}
+
+static const pic_driver driver = {
+    .name = "APIC",
+    .probe = &apic_probe,
+    .initialize = &apic_initialize,
+    .disable = &apic_disable,
+    .send_end_of_interrupt = &apic_send_end_of_interrupt,
+    .mask = &apic_mask,
+    .unmask = &apic_unmask,
+    .raise_priority = &apic_raise_priority,
+    .restore_priority = &apic_restore_priority,
+    .is_level_triggered = &apic_is_level_triggered,
+};
+
+const pic_driver *apic_get_driver() { return &driver; }
+
+bool apic_active(void) { return active; }
+
+#define MSI_ADDRESS_BASE 0xFEE00000u
+
+bool apic_msi_message(int irq, uint32_t *address, uint16_t *data) {
+  if (!active)
+    return false;
+  // fixed delivery, edge-triggered, physical destination: the boot CPU
+  *address = MSI_ADDRESS_BASE | (uint32_t)bsp_apic_id << 12;
+  *data = (uint16_t)(vector_base + irq);
+  return true;
+}
+
+/* ---------- LAPIC timer clockevent ---------- */
+#define LAPIC_CALIBRATE_NS 10000000ull
+#define LAPIC_MAX_DELTA_SEC 10
+
+static uint32_t timer_mult, timer_shift;
+
+static void lapic_timer_set_next_event(uint64_t delta_ns) {
+  uint64_t count = (delta_ns * timer_mult) >> timer_shift;
+  if (count == 0)
+    count = 1;
+  if (count > 0xFFFFFFFFull)
+    count = 0xFFFFFFFFull;
+  lapic_write(LAPIC_LVT_TIMER, APIC_TIMER_VECTOR); // one-shot, unmasked
+  lapic_write(LAPIC_TIMER_INITIAL, (uint32_t)count);
+}
+
+static void lapic_timer_shutdown(void) {
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | APIC_TIMER_VECTOR);
+  lapic_write(LAPIC_TIMER_INITIAL, 0);
+}
+
+static clockevent lapic_clockevent = {
+    .name = "lapic",
+    .min_delta_ns = 1000,
+    .max_delta_ns = 0,
+    // Deep C-states stop the timer on CPUs without ARAT, but the kernel
+    // only idles in hlt (C1), where it keeps counting
+    .rating = 150,
+    .set_next_event = &lapic_timer_set_next_event,
+    .set_periodic = NULL,
+    .shutdown = &lapic_timer_shutdown,
+};
+
+static void lapic_timer_handler(registers *regs) {
+  (void)regs;
+  clockevent_handle_interrupt();
+}
+
+bool lapic_timer_init(void) {
+  if (!active || !clocksource_available())
+    return false;
+
+  // Count down from the top for a while, timed by the clocksource
+  uint32_t flags = i686_irq_save();
+  lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIV16);
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | APIC_TIMER_VECTOR);
+  uint64_t start = ktime_get_ns();
+  lapic_write(LAPIC_TIMER_INITIAL, 0xFFFFFFFFu);
+  uint64_t elapsed;
+  do {
+    elapsed = ktime_get_ns() - start;
+  } while (elapsed < LAPIC_CALIBRATE_NS);
+  uint32_t counted = 0xFFFFFFFFu - lapic_read(LAPIC_TIMER_CURRENT);
+  lapic_write(LAPIC_TIMER_INITIAL, 0);
+  i686_irq_restore(flags);
+
+  uint64_t hz = (uint64_t)counted * NSEC_PER_SEC / elapsed;
+  if (hz == 0)
+    return false;
+
+  uint64_t max_ns = 0xFFFFFFFFull * NSEC_PER_SEC / hz;
+  if (max_ns > LAPIC_MAX_DELTA_SEC * NSEC_PER_SEC)
+    max_ns = LAPIC_MAX_DELTA_SEC * NSEC_PER_SEC;
+  clocks_calc_mult_shift(&timer_mult, &timer_shift, NSEC_PER_SEC, hz,
+                         LAPIC_MAX_DELTA_SEC);
+  lapic_clockevent.max_delta_ns = max_ns;
+
+  i686_irq_register_handler(IRQ_LOCAL_TIMER, lapic_timer_handler);
+  printf("LAPIC timer: %u kHz\n", (uint32_t)(hz / 1000));
+  clockevent_register(&lapic_clockevent);
+  return true;
+}
@@ -0,0 +1,87 @@
+#include "arch/i686/drivers/hpet.h"
+
+#include <arch/i686/acpi.h>
+#include <arch/i686/memory.h>
+#include <kernel/clocksource.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Register offsets
+#define HPET_CAPABILITIES 0x000 // low: rev/flags, high: period in fs
+#define HPET_CONFIG 0x010
+#define HPET_COUNTER 0x0F0
+#define HPET_REG_SIZE 0x400
+
+#define HPET_CAP_COUNT_64 (1u << 13)
+#define HPET_CONFIG_ENABLE (1u << 0)
+
+#define FEMTO_PER_SEC 1000000000000000ull
+
+static volatile uint8_t *regs = NULL;
+
+static inline uint32_t hpet_read32(uint32_t reg) {
+  return *(volatile uint32_t *)(regs + reg);
+}
+
+static inline void hpet_write32(uint32_t reg, uint32_t value) {
+  *(volatile uint32_t *)(regs + reg) = value;
+}
+
+static uint64_t hpet_read_counter64(void) {
+  // two 32-bit reads: retry if the high half moved in between
+  uint32_t hi, lo;
+  do {
+    hi = hpet_read32(HPET_COUNTER + 4);
+    lo = hpet_read32(HPET_COUNTER);
+  } while (hi != hpet_read32(HPET_COUNTER + 4));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+static uint64_t hpet_read_counter32(void) { return hpet_read32(HPET_COUNTER); }
+
+static clocksource hpet_clocksource = {
+    .name = "hpet",
+    .read = NULL,
+    .mask = 0,
+    .freq_hz = 0,
+    .rating = 250,
+    .next = NULL,
+};
+
+bool hpet_init(void) {
+  const struct acpi_hpet *t = (const struct acpi_hpet *)acpi_find_table("HPET");
+  if (!t || t->base_address.address_space != ACPI_GAS_MEMORY ||
+      t->base_address.address >= 0x100000000ull)
+    return false;
+
+  regs = mem_map_mmio((uint32_t)t->base_address.address, HPET_REG_SIZE,
+                      PAGE_FLAG_WRITE | PAGE_FLAG_CACHE_DISABLE);
+  if (!regs)
+    return false;
+
+  uint32_t cap = hpet_read32(HPET_CAPABILITIES);
+  uint32_t period_fs = hpet_read32(HPET_CAPABILITIES + 4);
+  if (period_fs == 0 || period_fs > 100000000u) { // spec: <= 100 ns
+    regs = NULL;
+    return false;
+  }
+
+  // start the main counter, leave legacy replacement routing off
+  hpet_write32(HPET_CONFIG, hpet_read32(HPET_CONFIG) | HPET_CONFIG_ENABLE);
+
+  if (cap & HPET_CAP_COUNT_64) {
+    hpet_clocksource.read = &hpet_read_counter64;
+    hpet_clocksource.mask = ~0ull;
+  } else {
+    hpet_clocksource.read = &hpet_read_counter32;
+    hpet_clocksource.mask = 0xFFFFFFFFull;
+  }
+  hpet_clocksource.freq_hz = FEMTO_PER_SEC / period_fs;
+  printf("HPET: %u kHz, %u-bit counter\n",
+         (uint32_t)(hpet_clocksource.freq_hz / 1000),
+         (cap & HPET_CAP_COUNT_64) ? 64 : 32);
+  clocksource_register(&hpet_clocksource);
+  return true;
+}
+
+volatile uint8_t *hpet_base(void) { return regs; }
@@ -34,17 +34,27 @@ enum {
 } PIC_CMD;
 
 static uint16_t pic_mask = 0xffff;
+// Lines held off by raise_priority, on top of pic_mask
+static uint16_t prio_mask = 0;
+// Fully nested mode ranks IRQ 0 highest, then 1, the slave's 8-15 (on
+// cascade 2), then 3-7. block_mask[n] covers n and everything below it.
+static uint16_t block_mask[16];
 
 #define PIT_BASE 1193182u
 
-void i8259_set_mask(uint16_t new_mask) {
-  pic_mask = new_mask;
-  i686_outb(PIC1_DATA_PORT, pic_mask & 0xFF);
+static void i8259_write_mask(void) {
+  uint16_t mask = pic_mask | prio_mask;
+  i686_outb(PIC1_DATA_PORT, mask & 0xFF);
   i686_iowait();
-  i686_outb(PIC2_DATA_PORT, pic_mask >> 8);
+  i686_outb(PIC2_DATA_PORT, mask >> 8);
   i686_iowait();
 }
 
+void i8259_set_mask(uint16_t new_mask) {
+  pic_mask = new_mask;
+  i8259_write_mask();
+}
+
 uint16_t i8259_get_mask() {
   return i686_inb(PIC1_DATA_PORT) | (i686_inb(PIC2_DATA_PORT) << 8);
 }
@@ -100,6 +110,16 @@ void i8259_configure(uint8_t offset_pic1, uint8_t offset_pic2, bool auto_eoi,
 
   // mask all interrupts until they are enabled by the device driver
   i8259_set_mask(0xFFFF);
+
+  static const uint8_t rank[16] = {0,  1,  2,  10, 11, 12, 13, 14,
+                                   2,  3,  4,  5,  6,  7,  8,  9};
+  for (int irq = 0; irq < 16; irq++) {
+    block_mask[irq] = 0;
+    for (int i = 0; i < 16; i++)
+      if (rank[i] >= rank[irq])
+        block_mask[irq] |= (uint16_t)(1u << i);
+    block_mask[irq] &= (uint16_t)~(1u << 2); // keep the cascade open
+  }
 }
 
 void i8259_send_end_of_interrupt(int irq) {
@@ -128,6 +148,28 @@ uint16_t i8259_read_in_service_register() {
          (((uint16_t)i686_inb(PIC2_COMMAND_PORT)) << 8);
 }
 
+uint32_t i8259_raise_priority(int irq) {
+  uint16_t old = prio_mask;
+  prio_mask |= block_mask[irq];
+  if (prio_mask != old)
+    i8259_write_mask();
+  return old;
+}
+
+void i8259_restore_priority(uint32_t state) {
+  if (prio_mask != (uint16_t)state) {
+    prio_mask = (uint16_t)state;
+    i8259_write_mask();
+  }
+}
+
+// The IMR keeps a line quiet while its handler runs, so even a level-triggered
+// (ELCR) line can take the early EOI
+bool i8259_is_level_triggered(int irq) {
+  (void)irq;
+  return false;
+}
+
 bool i8259_probe() {
   i8259_disable();
   i8259_set_mask(0x1337);
@@ -142,6 +184,9 @@ static const pic_driver driver = {
     .send_end_of_interrupt = &i8259_send_end_of_interrupt,
     .mask = &i8259_mask,
     .unmask = &i8259_unmask,
+    .raise_priority = &i8259_raise_priority,
+    .restore_priority = &i8259_restore_priority,
+    .is_level_triggered = &i8259_is_level_triggered,
 };
 
 const pic_driver *i8259_get_driver() { return &driver; }
\ No newline at end of file
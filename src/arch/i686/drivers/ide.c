@@ -1,18 +1,84 @@
 #include "arch/i686/drivers/ide.h"
 
 #include <arch/i686/io.h>
+#include <arch/i686/irq.h>
+#include <arch/i686/memory.h>
+#include <arch/i686/pci.h>
+#include <kernel/blk.h>
+#include <kernel/clocksource.h>
 #include <kernel/sleep.h>
+#include <kernel/softirq.h>
+#include <kernel/timer.h>
+#include <kernel/wait.h>
 #include <stdio.h>
+#include <string.h>
 
 // ---------- Globals ----------
-unsigned char ide_buf[2048] = {0};
-static volatile unsigned char ide_irq_invoked = 0;
-static unsigned char atapi_packet[12] = {0xA8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-unsigned char package[2] = {0};
+// IDENTIFY data during the probe, which runs before any other command
+static unsigned char ide_buf[1024];
 
 IDEChannelRegisters channels[2];
 ide_device_t ide_devices[4];
 
+// ---------- Bus-master DMA ----------
+#define IDE_PRD_ENTRIES 512
+// Sectors one DMA command may move: enough pages for the PRD table even when
+// every page of the buffer is physically discontiguous (plus a partial page)
+#define IDE_DMA_MAX_SECTORS ((IDE_PRD_ENTRIES - 1) * (0x1000 / 512))
+#define IDE_PRD_EOT 0x8000
+#define IDE_CMD_TIMEOUT_NS (5 * NSEC_PER_SEC)
+#define IDE_POLL_NS (NSEC_PER_SEC / 1000) // phase polling without an IRQ
+
+typedef struct {
+  uint32_t addr;  // physical, word aligned
+  uint16_t bytes; // 0 = 64 KiB
+  uint16_t flags; // IDE_PRD_EOT on the last entry
+} __attribute__((packed)) ide_prd_t;
+
+// One table per channel; aligned to its size so it never crosses the 64 KiB
+// boundary the controller can't cross. Lives in the kernel image, which is
+// physically contiguous.
+static ide_prd_t prd_tables[2][IDE_PRD_ENTRIES]
+    __attribute__((aligned(sizeof(ide_prd_t) * IDE_PRD_ENTRIES)));
+static bool dma_enabled = true;
+static bool ide_on_pci; // 32-bit data port access is only tried on PCI parts
+static wait_queue_t ide_wait = WAIT_QUEUE_INIT;
+
+// ---------- Block device backend ----------
+/* The ATA request a channel is executing. The channels are independent
+ * hardware: each has its own request, tasklet, timer and claim, so drives
+ * on the primary and the secondary transfer at the same time. Only the
+ * channel's tasklet (and its timer, also tasklet context) advances it. */
+typedef struct {
+  blk_request_t *rq; // NULL when idle
+  unsigned char drive;
+  unsigned char channel;
+  bool busy;           // a command owns the channel: rq, or an ATAPI caller
+  bool issue;          // the tasklet starts the next command
+  bool dma;            // current command runs on the bus master
+  bool fua;            // current command is a FUA write
+  bool need_flush;     // a FUA request had commands without FUA
+  bool flushing;       // a cache flush is running
+  uint32_t done;       // sectors of rq finished by earlier commands
+  uint32_t count;      // sectors in the current command
+  uint32_t moved;      // sectors of the current command transferred
+  bio_t *bio;          // data cursor: the next sector is at
+  uint32_t offset;     // bio->buf + offset * 512
+  uint64_t deadline;   // for the current phase
+  ktimer_t timer;
+  tasklet_t tasklet;
+} ide_xfer_t;
+
+static void ide_xfer_phase(void *data);
+static ide_xfer_t ide_xfers[2] = {
+    {.channel = ATA_PRIMARY,
+     .tasklet = TASKLET_INIT(ide_xfer_phase, &ide_xfers[ATA_PRIMARY])},
+    {.channel = ATA_SECONDARY,
+     .tasklet = TASKLET_INIT(ide_xfer_phase, &ide_xfers[ATA_SECONDARY])}};
+static bool ide_blk_start(blkdev_t *dev, blk_request_t *rq);
+static const blkdev_ops_t ide_blk_ops = {.start = ide_blk_start};
+static blkdev_t ide_blk[4];
+
 void ide_write(unsigned char channel, unsigned char reg, unsigned char data) {
   if (reg > 0x07 && reg < 0x0C)
     ide_write(channel, ATA_REG_CONTROL, 0x80 | channels[channel].nIEN);
@@ -68,14 +134,22 @@ void ide_read_buffer(unsigned char channel, unsigned char reg,
     ide_write(channel, ATA_REG_CONTROL, channels[channel].nIEN);
 }
 
-unsigned char ide_polling(unsigned char channel, unsigned int advanced_check) {
-
+/* Spin while BSY is set (after the 400ns settle time); false on timeout */
+static bool ide_wait_not_busy(unsigned char channel) {
   for (int i = 0; i < 4; i++)
     ide_read(channel, ATA_REG_ALTSTATUS); // Reading the Alternate Status port
                                           // wastes 100ns; loop four times.
 
-  while (ide_read(channel, ATA_REG_STATUS) & ATA_SR_BSY)
-    ; // Wait for BSY to be zero.
+  uint64_t deadline = ktime_get_ns() + IDE_CMD_TIMEOUT_NS;
+  while (ide_read(channel, ATA_REG_ALTSTATUS) & ATA_SR_BSY)
+    if (ktime_get_ns() > deadline)
+      return false;
+  return true;
+}
+
+unsigned char ide_polling(unsigned char channel, unsigned int advanced_check) {
+  if (!ide_wait_not_busy(channel))
+    return 5; // Timeout.
 
   if (advanced_check) {
     unsigned char state =
@@ -143,6 +217,9 @@ unsigned char ide_print_error(unsigned int drive, unsigned char err) {
   } else if (err == 4) {
     printf("- Write Protected\n     ");
     err = 8;
+  } else if (err == 5) {
+    printf("- Command Timeout\n     ");
+    err = 24;
   }
   printf(
       "- [%s %s] %s\n",
@@ -158,24 +235,328 @@ unsigned char ide_print_error(unsigned int drive, unsigned char err) {
   return err;
 }
 
-void ide_wait_irq() {
-  while (!ide_irq_invoked)
-    ;
-  ide_irq_invoked = 0;
+static void ide_channel_irq(unsigned char channel) {
+  IDEChannelRegisters *ch = &channels[channel];
+  if (ch->bmide) {
+    uint8_t bm = i686_inb(ch->bmide + BMIDE_REG_STATUS);
+    ch->bm_status = bm;
+    // write-1-to-clear the interrupt and error bits
+    i686_outb(ch->bmide + BMIDE_REG_STATUS, bm | BMIDE_SR_IRQ | BMIDE_SR_ERR);
+  }
+  ch->irq_status = ide_read(channel, ATA_REG_STATUS); // deasserts INTRQ
+  ch->irq_done = 1;
+  wake_up(&ide_wait);
+  if (ide_xfers[channel].rq)
+    tasklet_schedule(&ide_xfers[channel].tasklet);
+}
+
+static void ide_primary_irq(registers *regs) {
+  (void)regs;
+  ide_channel_irq(ATA_PRIMARY);
+}
+
+static void ide_secondary_irq(registers *regs) {
+  (void)regs;
+  ide_channel_irq(ATA_SECONDARY);
+}
+
+/* Both channels in native mode share the function's PCI line; the
+ * bus-master status says which one raised it */
+static void ide_shared_irq(registers *regs) {
+  (void)regs;
+  for (unsigned char c = 0; c < 2; c++)
+    if (!channels[c].bmide ||
+        (i686_inb(channels[c].bmide + BMIDE_REG_STATUS) & BMIDE_SR_IRQ))
+      ide_channel_irq(c);
+}
+
+static void ide_timeout(void *data) { *(volatile bool *)data = true; }
+
+bool ide_wait_irq(unsigned char channel) {
+  IDEChannelRegisters *ch = &channels[channel];
+  if (!ch->irq_broken) {
+    volatile bool timed_out = false;
+    ktimer_t timer = {0};
+    timer_add(&timer, ktime_get_ns() + IDE_CMD_TIMEOUT_NS, ide_timeout,
+              (void *)&timed_out);
+    wait_event(&ide_wait, ch->irq_done || timed_out);
+    timer_del(&timer);
+    if (ch->irq_done)
+      return true;
+    ch->irq_broken = 1;
+    printf("IDE: no IRQ %u from channel %u, polling from now on\n", ch->irq,
+           channel);
+  }
+
+  // Fallback: once BSY drops, do what the handler would have done
+  if (!ide_wait_not_busy(channel))
+    return false;
+  uint32_t flags = i686_irq_save();
+  if (!ch->irq_done)
+    ide_channel_irq(channel);
+  i686_irq_restore(flags);
+  return true;
+}
+
+/* Error code for the status a drive reported at the end of a phase */
+static unsigned char ide_phase_error(uint8_t status, bool need_drq) {
+  if (status & ATA_SR_ERR)
+    return 2; // Error.
+  if (status & ATA_SR_DF)
+    return 1; // Device Fault.
+  if (need_drq && !(status & ATA_SR_DRQ))
+    return 3; // DRQ should be set
+  return 0;
+}
+
+/* Wait for the end of a command phase and check the status the drive
+ * reported; returns 0 or an ide_polling error code. The next phase's IRQ
+ * is armed before returning, i.e. before the caller moves the data. */
+static unsigned char ide_wait_phase(unsigned char channel, bool need_drq) {
+  if (!ide_wait_irq(channel))
+    return 5; // Timeout.
+  uint8_t status = channels[channel].irq_status;
+  channels[channel].irq_done = 0;
+  return ide_phase_error(status, need_drq);
+}
+
+/* Own a channel for one command */
+static bool ide_try_claim(unsigned char channel) {
+  uint32_t flags = i686_irq_save();
+  bool claimed = !ide_xfers[channel].busy;
+  ide_xfers[channel].busy = true;
+  i686_irq_restore(flags);
+  return claimed;
+}
+
+static void ide_claim(unsigned char channel) {
+  wait_event(&ide_wait, ide_try_claim(channel));
+}
+
+/* Give the channel back and let the queues of its drives run */
+static void ide_release(unsigned char channel) {
+  ide_xfers[channel].busy = false;
+  wake_up(&ide_wait);
+  for (int i = 0; i < 4; i++)
+    if (ide_blk[i].ops && ide_devices[i].channel == channel)
+      blk_run_queue(&ide_blk[i]);
+}
+
+/* Describe up to `sectors` sectors from the transfer cursor in the channel's
+ * PRD table, one entry per physically contiguous run that stays inside a
+ * 64 KiB region. Returns how many sectors fit (the table can fill up first),
+ * 0 if a buffer can't be used for DMA. */
+static uint32_t ide_build_prdt(const ide_xfer_t *x, uint32_t sectors) {
+  ide_prd_t *prd = prd_tables[x->channel];
+  const bio_t *bio = x->bio;
+  uint32_t vaddr = (uint32_t)bio->buf + x->offset * 512;
+  uint32_t left = (bio->count - x->offset) * 512; // rest of this bio
+  uint32_t bytes = sectors * 512, total = 0;
+  uint32_t len = 0; // bytes in prd[n - 1]
+  int n = 0;
+
+  while (total < bytes) {
+    if (vaddr & 1)
+      return 0;
+    uint32_t phys = mem_virt_to_phys((const void *)vaddr);
+    if (!phys)
+      return 0;
+    uint32_t chunk = 0x1000 - (vaddr & 0xFFF); // rest of the page
+    if (chunk > left)
+      chunk = left;
+    if (chunk > bytes - total)
+      chunk = bytes - total;
+
+    if (n && prd[n - 1].addr + len == phys && (phys & 0xFFFF) != 0) {
+      len += chunk; // contiguous and still inside the same 64 KiB
+    } else {
+      if (n == IDE_PRD_ENTRIES)
+        break;
+      if (n)
+        prd[n - 1].bytes = (uint16_t)len;
+      prd[n].addr = phys;
+      prd[n].flags = 0;
+      len = chunk;
+      n++;
+    }
+    vaddr += chunk;
+    left -= chunk;
+    total += chunk;
+    if (!left && total < bytes) {
+      bio = bio->next;
+      vaddr = (uint32_t)bio->buf;
+      left = bio->count * 512;
+    }
+  }
+
+  // A full table can end inside a sector: leave that sector to the next
+  // command
+  uint32_t excess = total % 512;
+  total -= excess;
+  while (excess && excess >= len) {
+    excess -= len;
+    if (--n == 0)
+      return 0;
+    len = prd[n - 1].bytes ? prd[n - 1].bytes : 0x10000;
+  }
+  len -= excess;
+  prd[n - 1].bytes = (uint16_t)len; // 0x10000 wraps to 0 = 64 KiB
+  prd[n - 1].flags = IDE_PRD_EOT;
+  return total / 512;
+}
+
+/* Load the PRD table and direction; the engine starts after the command */
+static void ide_dma_prepare(unsigned char channel, unsigned char direction) {
+  uint16_t bm = channels[channel].bmide;
+  i686_outb(bm + BMIDE_REG_COMMAND, 0);
+  i686_outl(bm + BMIDE_REG_PRDT, mem_virt_to_phys(prd_tables[channel]));
+  i686_outb(bm + BMIDE_REG_COMMAND,
+            direction == ATA_READ ? BMIDE_CMD_READ : 0);
+  i686_outb(bm + BMIDE_REG_STATUS, i686_inb(bm + BMIDE_REG_STATUS) |
+                                       BMIDE_SR_IRQ | BMIDE_SR_ERR);
 }
 
-void ide_irq() { ide_irq_invoked = 1; }
+static void ide_dma_start(unsigned char channel) {
+  uint16_t bm = channels[channel].bmide;
+  i686_outb(bm + BMIDE_REG_COMMAND,
+            i686_inb(bm + BMIDE_REG_COMMAND) | BMIDE_CMD_START);
+}
+
+static void ide_dma_stop(unsigned char channel) {
+  uint16_t bm = channels[channel].bmide;
+  i686_outb(bm + BMIDE_REG_COMMAND,
+            i686_inb(bm + BMIDE_REG_COMMAND) & ~BMIDE_CMD_START);
+}
+
+/* Stop the engine once the drive interrupted and check both statuses */
+static unsigned char ide_dma_finish(unsigned char channel) {
+  ide_dma_stop(channel);
+  uint8_t bm_status = channels[channel].bm_status;
+  uint8_t status = channels[channel].irq_status;
+  if (status & ATA_SR_ERR)
+    return 2; // Error.
+  if (status & ATA_SR_DF)
+    return 1; // Device Fault.
+  if (bm_status & BMIDE_SR_ERR)
+    return 2;
+  return 0;
+}
+
+bool ide_set_dma(bool enabled) {
+  bool old = dma_enabled;
+  dma_enabled = enabled;
+  return old;
+}
+
+/* Issue a non-data command during the probe and poll for its completion */
+static bool ide_probe_command(unsigned char channel, unsigned char drive,
+                              uint8_t command, uint8_t features,
+                              uint8_t count) {
+  ide_write(channel, ATA_REG_HDDEVSEL, 0xA0 | (drive << 4));
+  ide_write(channel, ATA_REG_FEATURES, features);
+  ide_write(channel, ATA_REG_SECCOUNT0, count);
+  ide_write(channel, ATA_REG_COMMAND, command);
+  return ide_wait_not_busy(channel) &&
+         !(ide_read(channel, ATA_REG_STATUS) & (ATA_SR_ERR | ATA_SR_DF));
+}
+
+/* Program the largest READ/WRITE MULTIPLE block the drive supports (IDENTIFY
+ * word 47, in ide_buf); polled, like the rest of the probe */
+static uint8_t ide_set_multiple(unsigned char channel, unsigned char drive) {
+  uint8_t max = ide_buf[ATA_IDENT_MAX_MULTIPLE]; // low byte of word 47
+  if (max < 2)
+    return 0;
+  uint8_t count = 1;
+  while ((uint8_t)(count << 1) != 0 && (count << 1) <= max)
+    count <<= 1; // the block size must be a power of two
+
+  if (!ide_probe_command(channel, drive, ATA_CMD_SET_MULTIPLE, 0, count))
+    return 0;
+  return count;
+}
+
+/* Highest set bit of a mode mask, -1 if none */
+static int ide_best_mode(uint8_t modes) {
+  int mode = -1;
+  for (; modes; modes >>= 1)
+    mode++;
+  return mode;
+}
+
+/* Switch the drive to the fastest PIO and DMA modes its IDENTIFY data (in
+ * ide_buf) advertises. Only the drive side is negotiated: the controller
+ * timing registers stay as the firmware left them. */
+static void ide_set_xfer_modes(unsigned char channel, ide_device_t *dev) {
+  uint16_t valid = *((uint16_t *)(ide_buf + ATA_IDENT_FIELDVALID)); // word 53
+  int pio = ide_buf[ATA_IDENT_OLD_PIO + 1]; // word 51: legacy PIO 0-2
+  if (pio > 2)
+    pio = 2;
+  dev->pio_mode = (uint8_t)pio;
+  if (valid & 0x02) { // word 64 valid: bit 0 = PIO 3, bit 1 = PIO 4
+    int fast = ide_best_mode(ide_buf[ATA_IDENT_PIO_MODES] & 0x03);
+    if (fast >= 0 &&
+        ide_probe_command(channel, dev->drive, ATA_CMD_SET_FEATURES,
+                          ATA_FEAT_XFER_MODE,
+                          (uint8_t)(ATA_XFER_PIO_FLOW | (fast + 3))))
+      dev->pio_mode = (uint8_t)(fast + 3);
+  }
+
+  dev->dma_mode = 0;
+  if (!(dev->capabilities & 0x100) || !channels[channel].bmide)
+    return; // no DMA on the drive or no bus master on the controller
+
+  uint8_t mode = 0;
+  int udma = -1;
+  if (valid & 0x04) { // word 88 valid
+    uint8_t modes = ide_buf[ATA_IDENT_UDMA] & 0x7F;
+    // above UDMA 2 needs an 80-conductor cable (word 93 bit 13)
+    if (!(*((uint16_t *)(ide_buf + ATA_IDENT_HW_RESET)) & (1 << 13)))
+      modes &= 0x07;
+    udma = ide_best_mode(modes);
+  }
+  if (udma >= 0) {
+    mode = (uint8_t)(ATA_XFER_UDMA | udma);
+  } else {
+    int mwdma = ide_best_mode(ide_buf[ATA_IDENT_MWDMA] & 0x07); // word 63
+    if (mwdma >= 0)
+      mode = (uint8_t)(ATA_XFER_MWDMA | mwdma);
+  }
+  if (mode && ide_probe_command(channel, dev->drive, ATA_CMD_SET_FEATURES,
+                                ATA_FEAT_XFER_MODE, mode))
+    dev->dma_mode = mode;
+}
+
+/* IDENTIFY again and read it with 32-bit accesses: if the data matches the
+ * 16-bit copy in ide_buf, the controller splits dword accesses correctly */
+static bool ide_check_io32(unsigned char channel, unsigned char drive) {
+  unsigned char *copy = ide_buf + 512;
+
+  ide_write(channel, ATA_REG_HDDEVSEL, 0xA0 | (drive << 4));
+  ide_write(channel, ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+  if (!ide_wait_not_busy(channel))
+    return false;
+  unsigned char status = ide_read(channel, ATA_REG_STATUS);
+  if ((status & (ATA_SR_ERR | ATA_SR_DF)) || !(status & ATA_SR_DRQ))
+    return false;
+  i686_insl((uint16_t)channels[channel].base, copy, 128);
+  return memcmp(copy, ide_buf, 512) == 0;
+}
 
 void ide_init(unsigned int BAR0, unsigned int BAR1, unsigned int BAR2,
               unsigned int BAR3, unsigned int BAR4) {
   int j, k, i, count = 0;
 
   channels[ATA_PRIMARY].base = (BAR0 & 0xFFFFFFFC) + 0x1F0 * (!BAR0);
-  channels[ATA_PRIMARY].ctrl = (BAR1 & 0xFFFFFFFC) + 0x3F6 * (!BAR1);
+  // the control register is the 3rd port of the BAR1/BAR3 block
+  channels[ATA_PRIMARY].ctrl = BAR1 ? (BAR1 & 0xFFFFFFFC) + 2 : 0x3F6;
   channels[ATA_SECONDARY].base = (BAR2 & 0xFFFFFFFC) + 0x170 * (!BAR2);
-  channels[ATA_SECONDARY].ctrl = (BAR3 & 0xFFFFFFFC) + 0x376 * (!BAR3);
-  channels[ATA_PRIMARY].bmide = (BAR4 & 0xFFFFFFFC) + 0;   // Bus Master IDE
-  channels[ATA_SECONDARY].bmide = (BAR4 & 0xFFFFFFFC) + 8; // Bus Master IDE
+  channels[ATA_SECONDARY].ctrl = BAR3 ? (BAR3 & 0xFFFFFFFC) + 2 : 0x376;
+  channels[ATA_PRIMARY].bmide = BAR4 ? (BAR4 & 0xFFFFFFFC) + 0 : 0;
+  channels[ATA_SECONDARY].bmide = BAR4 ? (BAR4 & 0xFFFFFFFC) + 8 : 0;
+  if (!channels[ATA_PRIMARY].irq) // ide_init_pci sets native-mode lines
+    channels[ATA_PRIMARY].irq = 14;
+  if (!channels[ATA_SECONDARY].irq)
+    channels[ATA_SECONDARY].irq = 15;
 
   // Disable IRQ
   ide_write(ATA_PRIMARY, ATA_REG_CONTROL, 2);
@@ -221,7 +602,8 @@ void ide_init(unsigned int BAR0, unsigned int BAR1, unsigned int BAR2,
         sleep(1);
       }
 
-      ide_read_buffer(i, ATA_REG_DATA, (unsigned int)ide_buf, 128);
+      // 16-bit reads work on every controller; see ide_check_io32
+      i686_insw((uint16_t)channels[i].base, ide_buf, 256);
 
       ide_devices[count].reserved = 1;
       ide_devices[count].type = type;
@@ -235,9 +617,10 @@ void ide_init(unsigned int BAR0, unsigned int BAR1, unsigned int BAR2,
           *((unsigned int *)(ide_buf + ATA_IDENT_COMMANDSETS));
 
       if (ide_devices[count].command_sets & (1 << 26))
-        // Device uses 48-Bit Addressing:
+        // Device uses 48-Bit Addressing (words 100-103):
         ide_devices[count].size =
-            *((unsigned int *)(ide_buf + ATA_IDENT_MAX_LBA_EXT));
+            *((uint64_t *)(ide_buf + ATA_IDENT_MAX_LBA_EXT)) &
+            0xFFFFFFFFFFFFull;
       else
         // Device uses CHS or 28-bit Addressing:
         ide_devices[count].size =
@@ -249,18 +632,99 @@ void ide_init(unsigned int BAR0, unsigned int BAR1, unsigned int BAR2,
       }
       ide_devices[count].model[40] = 0; // Terminate String.
 
+      ide_devices[count].multiple = 0;
+      ide_devices[count].pio_mode = 0;
+      ide_devices[count].dma_mode = 0;
+      ide_devices[count].io32 = 0;
+      ide_devices[count].wcache = 0;
+      ide_devices[count].fua = 0;
+      if (type == IDE_ATA) {
+        // words 82/85 bit 5: write cache supported/enabled; word 84 bit 6:
+        // FUA commands (LBA48 only)
+        uint16_t enabled = *((uint16_t *)(ide_buf + ATA_IDENT_ENABLED));
+        uint16_t ext = *((uint16_t *)(ide_buf + ATA_IDENT_FEATURES_EXT));
+        ide_devices[count].wcache =
+            !(ide_devices[count].command_sets & (1 << 5)) ||
+            (enabled & (1 << 5));
+        ide_devices[count].fua =
+            (ide_devices[count].command_sets & (1 << 26)) &&
+            (ext & 0xC000) == 0x4000 && (ext & (1 << 6));
+        ide_devices[count].multiple = ide_set_multiple(i, j);
+        ide_set_xfer_modes(i, &ide_devices[count]);
+        ide_devices[count].io32 = ide_on_pci && ide_check_io32(i, j);
+      }
+
       count++;
     }
 
+  // Command completions (see ide_wait_phase)
+  if (channels[ATA_PRIMARY].irq == channels[ATA_SECONDARY].irq) {
+    i686_irq_register_handler(channels[ATA_PRIMARY].irq, ide_shared_irq);
+  } else {
+    i686_irq_register_handler(channels[ATA_PRIMARY].irq, ide_primary_irq);
+    i686_irq_register_handler(channels[ATA_SECONDARY].irq, ide_secondary_irq);
+  }
+  i686_irq_unmask(channels[ATA_PRIMARY].irq);
+  i686_irq_unmask(channels[ATA_SECONDARY].irq);
+
+  // ATA disks go to the block layer
+  for (i = 0; i < 4; i++)
+    if (ide_devices[i].reserved == 1 && ide_devices[i].type == IDE_ATA) {
+      ide_blk[i].name = (const char *[]){"hd0", "hd1", "hd2", "hd3"}[i];
+      ide_blk[i].sectors = ide_devices[i].size;
+      ide_blk[i].max_sectors = IDE_DMA_MAX_SECTORS;
+      ide_blk[i].max_segments = 128;
+      ide_blk[i].depth = 1;
+      ide_blk[i].features = ide_devices[i].wcache ? BLK_FEAT_WCACHE : 0;
+      ide_blk[i].ops = &ide_blk_ops;
+      blk_register(&ide_blk[i]);
+    }
+
   for (i = 0; i < 4; i++)
     if (ide_devices[i].reserved == 1) {
-      printf(" Found %s Drive %d Kib - %s\n",
+      printf(" Found %s Drive %llu Kib - %s\n",
              (const char *[]){"ATA", "ATAPI"}[ide_devices[i].type], /* Type */
              ide_devices[i].size / 2,                               /* Size */
              ide_devices[i].model);
     }
 }
 
+void ide_init_pci(void) {
+  const pci_device_t *dev =
+      pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, NULL);
+  if (!dev) {
+    ide_init(0x1F0, 0x3F6, 0x170, 0x376, 0x000); // no PCI IDE: legacy ports
+    return;
+  }
+
+  // prog-if bit 0/2: primary/secondary channel in native mode (ports in
+  // BAR0-3); in compatibility mode they sit at the legacy addresses and
+  // BAR0-3 are meaningless. BAR4 is the bus-master block either way.
+  unsigned int bar[5] = {0};
+  if (dev->prog_if & 0x01) {
+    bar[0] = dev->bar[0];
+    bar[1] = dev->bar[1];
+  }
+  if (dev->prog_if & 0x04) {
+    bar[2] = dev->bar[2];
+    bar[3] = dev->bar[3];
+  }
+  if ((dev->bar_io & (1u << 4)) && dev->bar_size[4])
+    bar[4] = dev->bar[4];
+  // native channels interrupt on the function's PCI line, not on 14/15
+  uint8_t line = dev->irq_pin && dev->irq_line < 16 ? dev->irq_line : 0;
+  if (dev->prog_if & 0x01)
+    channels[ATA_PRIMARY].irq = line;
+  if (dev->prog_if & 0x04)
+    channels[ATA_SECONDARY].irq = line;
+
+  pci_enable(dev, PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+  ide_on_pci = true;
+  printf("IDE: PCI %X:%X (prog-if 0x%X, bus master 0x%X)\n", dev->vendor_id,
+         dev->device_id, dev->prog_if, bar[4]);
+  ide_init(bar[0], bar[1], bar[2], bar[3], bar[4]);
+}
+
 static inline void ata_400ns_delay(unsigned char channel) {
   (void)ide_read(channel, ATA_REG_ALTSTATUS);
   (void)ide_read(channel, ATA_REG_ALTSTATUS);
@@ -268,34 +732,51 @@ static inline void ata_400ns_delay(unsigned char channel) {
   (void)ide_read(channel, ATA_REG_ALTSTATUS);
 }
 
-unsigned char ide_ata_access(unsigned char direction, unsigned char drive,
-                             unsigned int lba, unsigned char numsects,
-                             unsigned short selector, unsigned int edi) {
-  unsigned char lba_mode, dma, cmd;
+/* Move a PIO data block; dword accesses when the probe verified them */
+static void ide_pio_in(unsigned char drive, void *buf, unsigned int words) {
+  uint16_t port = (uint16_t)channels[ide_devices[drive].channel].base;
+  if (ide_devices[drive].io32)
+    i686_insl(port, buf, words / 2);
+  else
+    i686_insw(port, buf, words);
+}
+
+static void ide_pio_out(unsigned char drive, const void *buf,
+                        unsigned int words) {
+  uint16_t port = (uint16_t)channels[ide_devices[drive].channel].base;
+  if (ide_devices[drive].io32)
+    i686_outsl(port, buf, words / 2);
+  else
+    i686_outsw(port, buf, words);
+}
+
+/* Program the taskfile for one ATA command and issue it; 0 or 5 if the
+ * drive never became ready. Every phase completes through the channel IRQ.
+ * fua (writes with DMA or multiple mode, on a drive with ide_device_t.fua)
+ * picks the FUA EXT command. */
+static unsigned char ide_ata_command(unsigned char direction,
+                                     unsigned char drive, uint64_t lba,
+                                     unsigned int numsects, bool dma,
+                                     bool fua) {
+  unsigned char lba_mode, cmd = 0;
   unsigned char lba_io[6];
   unsigned int channel = ide_devices[drive].channel;
   unsigned int slavebit = ide_devices[drive].drive;
-  unsigned int bus = channels[channel].base;
-  unsigned int words = 256;
-  unsigned short cyl, i;
-  unsigned char head, sect, err;
+  unsigned short cyl;
+  unsigned char head, sect;
 
   if (numsects == 0)
     numsects = 1; // be explicit
 
-  // disable IRQ
-  ide_write(channel, ATA_REG_CONTROL,
-            channels[channel].nIEN = (ide_irq_invoked = 0x0) + 0x02);
-
-  if (lba >= 0x10000000) {
-    // LBA48
+  if (lba + numsects > 0x10000000 || numsects > 256 || fua) {
+    // LBA48: 48-bit address, up to 65536 sectors (a count of 0 means 65536)
     lba_mode = 2;
-    lba_io[0] = (lba & 0x000000FF) >> 0;
-    lba_io[1] = (lba & 0x0000FF00) >> 8;
-    lba_io[2] = (lba & 0x00FF0000) >> 16;
-    lba_io[3] = (lba & 0xFF000000) >> 24;
-    lba_io[4] = 0;
-    lba_io[5] = 0;
+    lba_io[0] = (uint8_t)(lba >> 0);
+    lba_io[1] = (uint8_t)(lba >> 8);
+    lba_io[2] = (uint8_t)(lba >> 16);
+    lba_io[3] = (uint8_t)(lba >> 24);
+    lba_io[4] = (uint8_t)(lba >> 32);
+    lba_io[5] = (uint8_t)(lba >> 40);
     head = 0;
   } else if (ide_devices[drive].capabilities & 0x200) {
     // LBA28  (FIXED MASKS)
@@ -321,11 +802,15 @@ unsigned char ide_ata_access(unsigned char direction, unsigned char drive,
     head = (unsigned char)(((lba + 1 - sect) / 63) % 16);
   }
 
-  dma = 0; // PIO
+  // PIO moves a whole block of sectors per DRQ/IRQ when multiple mode is set
+  unsigned char multiple = dma ? 0 : ide_devices[drive].multiple;
+
+  // Every phase of the command completes through the channel IRQ
+  ide_write(channel, ATA_REG_CONTROL, channels[channel].nIEN = 0);
 
   // Wait for BSY clear
-  while (ide_read(channel, ATA_REG_STATUS) & ATA_SR_BSY) {
-  }
+  if (!ide_wait_not_busy(channel))
+    return 5; // Timeout.
 
   if (lba_mode == 0)
     ide_write(channel, ATA_REG_HDDEVSEL, 0xA0 | (slavebit << 4) | head);
@@ -334,20 +819,23 @@ unsigned char ide_ata_access(unsigned char direction, unsigned char drive,
 
   ata_400ns_delay(channel); // <<< REQUIRED
 
+  uint64_t deadline = ktime_get_ns() + IDE_CMD_TIMEOUT_NS;
   for (;;) {
-    unsigned char s = ide_read(channel, ATA_REG_STATUS);
+    unsigned char s = ide_read(channel, ATA_REG_ALTSTATUS);
     if (!(s & ATA_SR_BSY) && (s & ATA_SR_DRDY))
       break;
+    if (ktime_get_ns() > deadline)
+      return 5; // Timeout.
   }
 
-  // Program taskfile
+  // Program taskfile: the high-order bytes of an LBA48 command go first
   if (lba_mode == 2) {
-    ide_write(channel, ATA_REG_SECCOUNT1, 0);
+    ide_write(channel, ATA_REG_SECCOUNT1, (uint8_t)(numsects >> 8));
     ide_write(channel, ATA_REG_LBA3, lba_io[3]);
     ide_write(channel, ATA_REG_LBA4, lba_io[4]);
     ide_write(channel, ATA_REG_LBA5, lba_io[5]);
   }
-  ide_write(channel, ATA_REG_SECCOUNT0, numsects);
+  ide_write(channel, ATA_REG_SECCOUNT0, (uint8_t)numsects);
   ide_write(channel, ATA_REG_LBA0, lba_io[0]);
   ide_write(channel, ATA_REG_LBA1, lba_io[1]);
   ide_write(channel, ATA_REG_LBA2, lba_io[2]);
@@ -358,45 +846,277 @@ unsigned char ide_ata_access(unsigned char direction, unsigned char drive,
     cmd = ATA_CMD_READ_PIO;
   if (lba_mode == 2 && dma == 0 && direction == 0)
     cmd = ATA_CMD_READ_PIO_EXT;
+  if (lba_mode != 2 && multiple && direction == 0)
+    cmd = ATA_CMD_READ_MULTIPLE;
+  if (lba_mode == 2 && multiple && direction == 0)
+    cmd = ATA_CMD_READ_MULTIPLE_EXT;
+  if (lba_mode == 0 && dma == 1 && direction == 0)
+    cmd = ATA_CMD_READ_DMA;
+  if (lba_mode == 1 && dma == 1 && direction == 0)
+    cmd = ATA_CMD_READ_DMA;
+  if (lba_mode == 2 && dma == 1 && direction == 0)
+    cmd = ATA_CMD_READ_DMA_EXT;
   if (lba_mode == 0 && dma == 0 && direction == 1)
     cmd = ATA_CMD_WRITE_PIO;
   if (lba_mode == 1 && dma == 0 && direction == 1)
     cmd = ATA_CMD_WRITE_PIO;
   if (lba_mode == 2 && dma == 0 && direction == 1)
     cmd = ATA_CMD_WRITE_PIO_EXT;
-
+  if (lba_mode != 2 && multiple && direction == 1)
+    cmd = ATA_CMD_WRITE_MULTIPLE;
+  if (lba_mode == 2 && multiple && direction == 1)
+    cmd = ATA_CMD_WRITE_MULTIPLE_EXT;
+  if (lba_mode == 0 && dma == 1 && direction == 1)
+    cmd = ATA_CMD_WRITE_DMA;
+  if (lba_mode == 1 && dma == 1 && direction == 1)
+    cmd = ATA_CMD_WRITE_DMA;
+  if (lba_mode == 2 && dma == 1 && direction == 1)
+    cmd = ATA_CMD_WRITE_DMA_EXT;
+  if (fua && multiple && direction == 1)
+    cmd = ATA_CMD_WRITE_MULTIPLE_FUA_EXT;
+  if (fua && dma == 1 && direction == 1)
+    cmd = ATA_CMD_WRITE_DMA_FUA_EXT;
+
+  if (dma)
+    ide_dma_prepare(channel, direction);
+  channels[channel].irq_done = 0;
   ide_write(channel, ATA_REG_COMMAND, cmd);
+  return 0;
+}
+
+/* Step the data cursor over sectors that have been transferred */
+static void ide_xfer_advance(ide_xfer_t *x, uint32_t sectors) {
+  x->offset += sectors;
+  while (x->bio && x->offset >= x->bio->count) {
+    x->offset -= x->bio->count;
+    x->bio = x->bio->next;
+  }
+}
+
+/* Move the next DRQ block of the current PIO command */
+static void ide_xfer_pio_block(ide_xfer_t *x) {
+  uint32_t n = ide_devices[x->drive].multiple ? ide_devices[x->drive].multiple
+                                              : 1;
+  if (n > x->count - x->moved)
+    n = x->count - x->moved;
+  for (uint32_t i = 0; i < n; i++) {
+    void *sector = (uint8_t *)x->bio->buf + x->offset * 512;
+    if (x->rq->op == BIO_READ)
+      ide_pio_in(x->drive, sector, 256);
+    else
+      ide_pio_out(x->drive, sector, 256);
+    ide_xfer_advance(x, 1);
+  }
+  x->moved += n;
+}
+
+static void ide_xfer_timer(void *data);
+
+/* Expect the next IRQ within the command timeout; on a channel whose IRQ
+ * is broken, poll for the end of the phase instead */
+static void ide_xfer_arm(ide_xfer_t *x) {
+  uint64_t now = ktime_get_ns();
+  x->deadline = now + IDE_CMD_TIMEOUT_NS;
+  timer_add(&x->timer,
+            channels[x->channel].irq_broken ? now + IDE_POLL_NS : x->deadline,
+            ide_xfer_timer, x);
+}
+
+static void ide_xfer_finish(ide_xfer_t *x, unsigned char err) {
+  blk_request_t *rq = x->rq;
+  unsigned char drive = x->drive;
+  int error = BLK_OK;
+
+  timer_del(&x->timer);
+  if (err) {
+    if (x->dma)
+      ide_dma_stop(x->channel);
+    ide_devices[drive].error = ide_print_error(drive, err);
+    error = err == 5 ? BLK_ETIMEDOUT : BLK_EIO;
+  }
+  x->rq = NULL;
+  ide_release(x->channel);
+  blk_end_request(&ide_blk[drive], rq, error);
+}
+
+/* Issue FLUSH CACHE (EXT) to the drive of x; completes on the IRQ */
+static unsigned char ide_flush_command(ide_xfer_t *x) {
+  unsigned char channel = x->channel;
+  ide_write(channel, ATA_REG_CONTROL, channels[channel].nIEN = 0);
+  ide_write(channel, ATA_REG_HDDEVSEL,
+            0xA0 | (ide_devices[x->drive].drive << 4));
+  if (!ide_wait_not_busy(channel))
+    return 5; // Timeout.
+  x->flushing = true;
+  channels[channel].irq_done = 0;
+  ide_write(channel, ATA_REG_COMMAND,
+            (ide_devices[x->drive].command_sets & (1 << 26))
+                ? ATA_CMD_CACHE_FLUSH_EXT
+                : ATA_CMD_CACHE_FLUSH);
+  return 0;
+}
+
+/* Start the next command of the request: as many sectors as one command
+ * (and, for DMA, the PRD table) can take */
+static void ide_xfer_issue(ide_xfer_t *x) {
+  unsigned char drive = x->drive;
+  uint32_t n = x->rq->count - x->done;
+  uint32_t max = (ide_devices[drive].command_sets & (1 << 26)) ? 65536 : 256;
+  unsigned char err;
+
+  if (x->rq->op == BIO_FLUSH) {
+    if ((err = ide_flush_command(x)))
+      ide_xfer_finish(x, err);
+    else
+      ide_xfer_arm(x);
+    return;
+  }
+  if (n > max)
+    n = max;
+  x->dma = false;
+  if (dma_enabled && ide_devices[drive].dma_mode) {
+    uint32_t fit = ide_build_prdt(x, n);
+    if (fit) {
+      x->dma = true;
+      n = fit;
+    }
+  }
+  x->count = n;
+  x->moved = 0;
+  // no FUA command for single-sector PIO: flush once the request is done
+  x->fua = (x->rq->flags & BIO_FUA) && ide_devices[drive].fua &&
+           (x->dma || ide_devices[drive].multiple);
+  if ((x->rq->flags & BIO_FUA) && !x->fua)
+    x->need_flush = true;
+
+  err = ide_ata_command(x->rq->op == BIO_READ ? ATA_READ : ATA_WRITE, drive,
+                        x->rq->sector + x->done, n, x->dma, x->fua);
+  if (!err && x->dma) {
+    ide_dma_start(x->channel);
+  } else if (!err && x->rq->op == BIO_WRITE) {
+    // the first block goes on DRQ; each later one is asked for by an IRQ
+    if (!(err = ide_polling(x->channel, 1)))
+      ide_xfer_pio_block(x);
+  }
+  if (err)
+    ide_xfer_finish(x, err);
+  else
+    ide_xfer_arm(x);
+}
+
+/* Tasklet: start a command, or run the phase the drive just finished */
+static void ide_xfer_phase(void *data) {
+  ide_xfer_t *x = data;
+  if (!x->rq)
+    return;
+  if (x->issue) {
+    x->issue = false;
+    ide_xfer_issue(x);
+    return;
+  }
+
+  IDEChannelRegisters *ch = &channels[x->channel];
+  uint32_t flags = i686_irq_save();
+  bool irq = ch->irq_done;
+  ch->irq_done = 0;
+  i686_irq_restore(flags);
+  if (!irq)
+    return; // already handled by the timer
+  unsigned char err = 0;
 
-  if (dma) {
-    // (not used)
-  } else if (direction == 0) {
-    // READ PIO
-    for (i = 0; i < numsects; i++) {
-      if ((err = ide_polling(channel, 1)))
-        return err; // will return 3 if DRQ never set
-      // safer asm: ensure DF=0 and tell the compiler EDI/ECX are modified
-      asm volatile("cld; rep insw"
-                   : "+D"(edi)
-                   : "c"(words), "d"(bus)
-                   : "memory");
+  if (x->flushing) {
+    ide_xfer_finish(x, ide_phase_error(ch->irq_status, false));
+    return;
+  }
+  if (x->dma) {
+    err = ide_dma_finish(x->channel);
+    ide_xfer_advance(x, x->count);
+    x->moved = x->count;
+  } else if (x->rq->op == BIO_READ) {
+    // one IRQ per block, before its data
+    if (!(err = ide_phase_error(ch->irq_status, true)))
+      ide_xfer_pio_block(x);
+  } else if (x->moved < x->count) {
+    // the drive took a block and asks for the next one
+    if (!(err = ide_phase_error(ch->irq_status, true))) {
+      ide_xfer_pio_block(x);
+      ide_xfer_arm(x);
+      return;
     }
   } else {
-    // WRITE PIO
-    for (i = 0; i < numsects; i++) {
-      ide_polling(channel, 0);
-      asm volatile("cld; rep outsw"
-                   :
-                   : "S"(edi), "c"(words), "d"(bus)
-                   : "memory");
-      edi += words * 2;
+    err = ide_phase_error(ch->irq_status, false); // the write completed
+  }
+  if (err) {
+    ide_xfer_finish(x, err);
+    return;
+  }
+
+  if (x->moved < x->count) {
+    ide_xfer_arm(x);
+  } else if ((x->done += x->count) < x->rq->count) {
+    ide_xfer_issue(x);
+  } else if (x->need_flush) {
+    if ((err = ide_flush_command(x)))
+      ide_xfer_finish(x, err);
+    else
+      ide_xfer_arm(x);
+  } else {
+    ide_xfer_finish(x, 0);
+  }
+}
+
+/* Timer: the phase overran. If the drive is in fact done, its IRQ never
+ * arrived: poll this channel from now on. */
+static void ide_xfer_timer(void *data) {
+  ide_xfer_t *x = data;
+  if (!x->rq)
+    return;
+  IDEChannelRegisters *ch = &channels[x->channel];
+  if (!ch->irq_done) {
+    if (ide_read(x->channel, ATA_REG_ALTSTATUS) & ATA_SR_BSY) {
+      if (ktime_get_ns() >= x->deadline)
+        ide_xfer_finish(x, 5); // Timeout.
+      else
+        timer_add(&x->timer, ktime_get_ns() + IDE_POLL_NS, ide_xfer_timer,
+                  x);
+      return;
     }
-    ide_write(channel, ATA_REG_COMMAND,
-              (char[]){ATA_CMD_CACHE_FLUSH, ATA_CMD_CACHE_FLUSH,
-                       ATA_CMD_CACHE_FLUSH_EXT}[lba_mode]);
-    ide_polling(channel, 0);
+    if (!ch->irq_broken) {
+      ch->irq_broken = 1;
+      printf("IDE: no IRQ %u from channel %u, polling from now on\n",
+             ch->irq, x->channel);
+    }
+    uint32_t flags = i686_irq_save();
+    if (!ch->irq_done)
+      ide_channel_irq(x->channel);
+    i686_irq_restore(flags);
   }
+  ide_xfer_phase(x);
+}
 
-  return 0;
+/* blkdev start: take the drive's channel and let its tasklet issue rq */
+static bool ide_blk_start(blkdev_t *dev, blk_request_t *rq) {
+  unsigned char drive = (unsigned char)(dev - ide_blk);
+  ide_xfer_t *x = &ide_xfers[ide_devices[drive].channel];
+  if (!ide_try_claim(x->channel))
+    return false;
+  x->drive = drive;
+  x->flushing = false;
+  x->need_flush = false;
+  x->done = 0;
+  x->bio = rq->bios;
+  x->offset = 0;
+  x->issue = true;
+  x->rq = rq;
+  tasklet_schedule(&x->tasklet);
+  softirq_run(); // runs it now unless we are already in tasklet context
+  return true;
+}
+
+blkdev_t *ide_get_blkdev(unsigned char drive) {
+  if (drive > 3 || !ide_blk[drive].ops)
+    return NULL;
+  return &ide_blk[drive];
 }
 
 unsigned char ide_atapi_read(unsigned char drive, unsigned int lba,
@@ -411,20 +1131,20 @@ unsigned char ide_atapi_read(unsigned char drive, unsigned int lba,
   int i;
 
   ide_write(channel, ATA_REG_CONTROL,
-            channels[channel].nIEN = ide_irq_invoked = 0x0); // enable irq
-
-  atapi_packet[0] = ATAPI_CMD_READ;
-  atapi_packet[1] = 0x0;
-  atapi_packet[2] = (lba >> 24) & 0xFF;
-  atapi_packet[3] = (lba >> 16) & 0xFF;
-  atapi_packet[4] = (lba >> 8) & 0xFF;
-  atapi_packet[5] = (lba >> 0) & 0xFF;
-  atapi_packet[6] = 0x0;
-  atapi_packet[7] = 0x0;
-  atapi_packet[8] = 0x0;
-  atapi_packet[9] = numsects;
-  atapi_packet[10] = 0x0;
-  atapi_packet[11] = 0x0;
+            channels[channel].nIEN = 0x0); // enable irq
+
+  unsigned char atapi_packet[12] = {ATAPI_CMD_READ,
+                                    0x0,
+                                    (lba >> 24) & 0xFF,
+                                    (lba >> 16) & 0xFF,
+                                    (lba >> 8) & 0xFF,
+                                    (lba >> 0) & 0xFF,
+                                    0x0,
+                                    0x0,
+                                    0x0,
+                                    numsects,
+                                    0x0,
+                                    0x0};
 
   ide_write(channel, ATA_REG_HDDEVSEL, slavebit << 4);
 
@@ -440,9 +1160,10 @@ unsigned char ide_atapi_read(unsigned char drive, unsigned int lba,
   ide_write(channel, ATA_REG_LBA2,
             (words * 2) >> 8); // Upper Byte of Sector Size.
 
+  channels[channel].irq_done = 0;
   ide_write(channel, ATA_REG_COMMAND, ATA_CMD_PACKET); // Send the Command.
 
-  if (err = ide_polling(channel, 1))
+  if ((err = ide_polling(channel, 1)))
     return err; // Polling and return if error.
 
   asm("rep   outsw"
@@ -450,9 +1171,8 @@ unsigned char ide_atapi_read(unsigned char drive, unsigned int lba,
       : "c"(6), "d"(bus), "S"(atapi_packet)); // Send Packet Data
 
   for (i = 0; i < numsects; i++) {
-    ide_wait_irq(); // Wait for an IRQ.
-    if (err = ide_polling(channel, 1))
-      return err; // Polling and return if error.
+    if ((err = ide_wait_phase(channel, true)))
+      return err; // Wait for an IRQ and return if error.
     asm("pushw %es");
     asm("mov %%ax, %%es" ::"a"(selector));
     asm("rep insw" ::"c"(words), "d"(bus), "D"(edi)); // Receive Data.
@@ -460,85 +1180,103 @@ unsigned char ide_atapi_read(unsigned char drive, unsigned int lba,
     edi += (words * 2);
   }
 
-  ide_wait_irq();
+  if ((err = ide_wait_phase(channel, false)))
+    return err;
 
-  while (ide_read(channel, ATA_REG_STATUS) & (ATA_SR_BSY | ATA_SR_DRQ))
-    ;
+  uint64_t deadline = ktime_get_ns() + IDE_CMD_TIMEOUT_NS;
+  while (ide_read(channel, ATA_REG_ALTSTATUS) & (ATA_SR_BSY | ATA_SR_DRQ))
+    if (ktime_get_ns() > deadline)
+      return 5; // Timeout.
 
   return 0;
 }
 
-void ide_read_sectors(unsigned char drive, unsigned char numsects,
-                      unsigned int lba, unsigned short es, unsigned int edi) {
+/* ide_print_error code for a blk_read/blk_write result. Only a failed
+ * command has set ide_devices[].error; the block layer rejects bad
+ * arguments before any command goes out. */
+static unsigned char ide_blk_status(unsigned char drive, int error) {
+  switch (error) {
+  case BLK_OK:
+    return 0;
+  case BLK_EIO:
+    return ide_devices[drive].error ? ide_devices[drive].error : 19;
+  case BLK_ETIMEDOUT:
+    return 24; // Command Timeout
+  case BLK_ERANGE:
+  case BLK_EINVAL:
+    return 0x2; // Seeking to invalid position
+  case BLK_EROFS:
+    return 8; // Write Protected
+  default:
+    return 20; // Command Aborted
+  }
+}
 
-  int i;
+unsigned char ide_read_sectors(unsigned char drive, unsigned int numsects,
+                               uint64_t lba, unsigned short es,
+                               unsigned int edi) {
+
+  unsigned int i;
   if (drive > 3 || ide_devices[drive].reserved == 0)
-    package[0] = 0x1; // Drive Not Found!
+    return 0x1; // Drive Not Found!
 
   else if (((lba + numsects) > ide_devices[drive].size) &&
            (ide_devices[drive].type == IDE_ATA))
-    package[0] = 0x2; // Seeking to invalid position.
+    return 0x2; // Seeking to invalid position.
+
+  else if (ide_devices[drive].type == IDE_ATA)
+    return ide_blk_status(
+        drive, blk_read(&ide_blk[drive], lba, numsects, (void *)edi));
 
   else {
-    unsigned char err;
-    if (ide_devices[drive].type == IDE_ATA)
-      err = ide_ata_access(ATA_READ, drive, lba, numsects, es, edi);
-    else if (ide_devices[drive].type == IDE_ATAPI)
-      for (i = 0; i < numsects; i++)
-        err = ide_atapi_read(drive, lba + i, 1, es, edi + (i * 2048));
-    package[0] = ide_print_error(drive, err);
+    unsigned char err = 0;
+    unsigned char channel = ide_devices[drive].channel;
+    ide_claim(channel);
+    for (i = 0; i < numsects && !err; i++)
+      err = ide_atapi_read(drive, (unsigned int)lba + i, 1, es,
+                           edi + (i * 2048));
+    ide_release(channel);
+    return ide_print_error(drive, err);
   }
 }
 
-void ide_write_sectors(unsigned char drive, unsigned char numsects,
-                       unsigned int lba, unsigned short es, unsigned int edi) {
+unsigned char ide_write_sectors(unsigned char drive, unsigned int numsects,
+                                uint64_t lba, unsigned short es,
+                                unsigned int edi) {
 
   if (drive > 3 || ide_devices[drive].reserved == 0)
-    package[0] = 0x1; // Drive Not Found!
+    return 0x1; // Drive Not Found!
 
   else if (((lba + numsects) > ide_devices[drive].size) &&
            (ide_devices[drive].type == IDE_ATA))
-    package[0] = 0x2; // Seeking to invalid position.
+    return 0x2; // Seeking to invalid position.
 
-  else {
-    unsigned char err;
-    if (ide_devices[drive].type == IDE_ATA)
-      err = ide_ata_access(ATA_WRITE, drive, lba, numsects, es, edi);
-    else if (ide_devices[drive].type == IDE_ATAPI)
-      err = 4; // Write-Protected.
-    package[0] = ide_print_error(drive, err);
-  }
+  else if (ide_devices[drive].type == IDE_ATA)
+    return ide_blk_status(
+        drive, blk_write(&ide_blk[drive], lba, numsects, (void *)edi));
+
+  else
+    return ide_print_error(drive, 4); // Write-Protected.
 }
 
-void ide_atapi_eject(unsigned char drive) {
+unsigned char ide_atapi_eject(unsigned char drive) {
   unsigned int channel = ide_devices[drive].channel;
   unsigned int slavebit = ide_devices[drive].drive;
   unsigned int bus = channels[channel].base;
-  unsigned int words = 2048 / 2; // Sector Size in Words.
   unsigned char err = 0;
-  ide_irq_invoked = 0;
 
   if (drive > 3 || ide_devices[drive].reserved == 0)
-    package[0] = 0x1; // Drive Not Found!
+    return 0x1; // Drive Not Found!
   else if (ide_devices[drive].type == IDE_ATA)
-    package[0] = 20; // Command Aborted.
+    return 20; // Command Aborted.
   else {
+    ide_claim(channel);
     // Enable IRQs:
-    ide_write(channel, ATA_REG_CONTROL,
-              channels[channel].nIEN = ide_irq_invoked = 0x0);
-
-    atapi_packet[0] = ATAPI_CMD_EJECT;
-    atapi_packet[1] = 0x00;
-    atapi_packet[2] = 0x00;
-    atapi_packet[3] = 0x00;
-    atapi_packet[4] = 0x02;
-    atapi_packet[5] = 0x00;
-    atapi_packet[6] = 0x00;
-    atapi_packet[7] = 0x00;
-    atapi_packet[8] = 0x00;
-    atapi_packet[9] = 0x00;
-    atapi_packet[10] = 0x00;
-    atapi_packet[11] = 0x00;
+    ide_write(channel, ATA_REG_CONTROL, channels[channel].nIEN = 0x0);
+
+    unsigned char atapi_packet[12] = {ATAPI_CMD_EJECT, 0x00, 0x00, 0x00,
+                                      0x02,            0x00, 0x00, 0x00,
+                                      0x00,            0x00, 0x00, 0x00};
 
     ide_write(channel, ATA_REG_HDDEVSEL, slavebit << 4);
 
@@ -547,15 +1285,16 @@ void ide_atapi_eject(unsigned char drive) {
           channel,
           ATA_REG_ALTSTATUS); // Reading Alternate Status Port wastes 100ns.
 
+    channels[channel].irq_done = 0;
     ide_write(channel, ATA_REG_COMMAND, ATA_CMD_PACKET); // Send the Command.
 
     err = ide_polling(channel, 1); // Polling and stop if error.
     asm("rep   outsw" ::"c"(6), "d"(bus),
-        "S"(atapi_packet));        // Send Packet Data
-    ide_wait_irq();                // Wait for an IRQ.
-    err = ide_polling(channel, 1); // Polling and get error code.
+        "S"(atapi_packet));             // Send Packet Data
+    err = ide_wait_phase(channel, true); // Wait for an IRQ, get error code.
     if (err == 3)
       err = 0; // DRQ is not needed here.
+    ide_release(channel);
   }
-  package[0] = ide_print_error(drive, err); // Return;
+  return ide_print_error(drive, err);
 }
\ No newline at end of file
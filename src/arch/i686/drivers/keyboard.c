@@ -2,15 +2,19 @@
 
 #include <arch/i686/io.h>
 #include <arch/i686/irq.h>
-#include <kernel/tty.h> // terminal_scroll_*(), terminal_clear_screen
+#include <kernel/dev_tty.h> // tty_input_char
+#include <kernel/softirq.h> // tasklet_schedule
+#include <kernel/tty.h>     // terminal_scroll_*()
 #include <stdint.h>
 #include <stdio.h>
 
-/* Public API */
-void keyboard_init(void);
-int keyboard_getchar(void); // returns -1 if no char, else unsigned char in int
-
-void keyboard_init() { i686_irq_register_handler(1, keyboard_handler); }
+#define KBD_DATA 0x60
+#define KBD_STATUS 0x64
+#define KBD_STATUS_OUT_FULL 0x01
+#define KBD_STATUS_IN_FULL 0x02
+#define KBD_CMD_TYPEMATIC 0xF3
+#define KBD_ACK 0xFA
+#define KBD_RESEND 0xFE
 
 /* ===== US layout (set 1) ===== */
 unsigned char kbdus[128] = {
@@ -33,84 +37,179 @@ unsigned char kbdus_shifted[128] = {
     '+',  0,    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
     0,    0,    0,   0,   0,   0,   0,   0,   0};
 
-/* ===== Modifiers ===== */
-static int shift_pressed = 0;
-static int capslock_enabled = 0;
+/* ===== Event queue =====
+ * Single producer (IRQ handler), single consumer (cooked-layer tasklet).
+ * Indices run freely; each side only writes its own. */
+#define KBD_QUEUE_SIZE 64
+static kbd_event_t queue[KBD_QUEUE_SIZE];
+static volatile uint32_t queue_head = 0; // next slot to fill (producer)
+static volatile uint32_t queue_tail = 0; // next slot to read (consumer)
+static kbd_stats_t stats;
+
+static void kbd_push(const kbd_event_t *ev) {
+  uint32_t head = queue_head;
+  uint32_t depth = head - queue_tail;
+  if (depth >= KBD_QUEUE_SIZE) {
+    stats.dropped++;
+    return;
+  }
+  queue[head & (KBD_QUEUE_SIZE - 1)] = *ev;
+  __asm__ volatile("" ::: "memory"); // slot is written before it is published
+  queue_head = head + 1;
+  stats.events++;
+  if (depth + 1 > stats.max_depth)
+    stats.max_depth = depth + 1;
+}
 
-/* Track 0xE0 extended scancode prefix */
-static int ext_prefix = 0;
+static bool kbd_pop(kbd_event_t *ev) {
+  uint32_t tail = queue_tail;
+  if (tail == queue_head)
+    return false;
+  *ev = queue[tail & (KBD_QUEUE_SIZE - 1)];
+  __asm__ volatile("" ::: "memory"); // slot is read before it is released
+  queue_tail = tail + 1;
+  return true;
+}
 
-/* ===== Ring buffer ===== */
-#define KBD_BUFFER_SIZE 256
-static volatile unsigned char kbd_buf[KBD_BUFFER_SIZE];
-static volatile unsigned int kbd_head = 0;
-static volatile unsigned int kbd_tail = 0;
+/* ===== Scancode decoding (IRQ side) ===== */
+static uint16_t modifiers = 0;
+static uint32_t key_down[256 / 32]; // bitmap indexed by keycode
+static int ext_prefix = 0;          // saw 0xE0
+static int pause_skip = 0;          // bytes left of an E1 (Pause) sequence
 
-static inline int kbd_empty(void) { return kbd_head == kbd_tail; }
-static inline int kbd_full(void) {
-  return ((kbd_head + 1) & (KBD_BUFFER_SIZE - 1)) == kbd_tail;
+static uint16_t modifier_bit(uint8_t keycode) {
+  switch (keycode) {
+  case KEY_LSHIFT:
+    return KBD_MOD_LSHIFT;
+  case KEY_RSHIFT:
+    return KBD_MOD_RSHIFT;
+  case KEY_LCTRL:
+    return KBD_MOD_LCTRL;
+  case KEY_RCTRL:
+    return KBD_MOD_RCTRL;
+  case KEY_LALT:
+    return KBD_MOD_LALT;
+  case KEY_RALT:
+    return KBD_MOD_RALT;
+  default:
+    return 0;
+  }
 }
-static inline void kbd_put(unsigned char c) {
-  if (!kbd_full()) {
-    kbd_buf[kbd_head] = c;
-    kbd_head = (kbd_head + 1) & (KBD_BUFFER_SIZE - 1);
+
+static uint16_t lock_bit(uint8_t keycode) {
+  switch (keycode) {
+  case KEY_CAPSLOCK:
+    return KBD_MOD_CAPSLOCK;
+  case KEY_NUMLOCK:
+    return KBD_MOD_NUMLOCK;
+  case KEY_SCROLLLOCK:
+    return KBD_MOD_SCROLLLOCK;
+  default:
+    return 0;
   }
 }
 
-/* Translate scancode -> ASCII (with modifiers). Returns 0 if unmapped. */
-static inline unsigned char kbd_translate(uint8_t sc) {
-  if (sc >= 128)
+/* ===== Cooked layer (tasklet side) ===== */
+
+/* Translate a keycode -> ASCII (with modifiers). Returns 0 if unmapped. */
+static unsigned char kbd_translate(uint8_t keycode, uint16_t mods) {
+  if (keycode == (KEY_EXTENDED | KEY_ENTER))
+    return '\n'; // keypad Enter
+  if (keycode == (KEY_EXTENDED | 0x35))
+    return '/'; // keypad slash
+  if (keycode & KEY_EXTENDED)
     return 0;
-  unsigned char c = kbdus[sc];
+  unsigned char c = kbdus[keycode];
   if (!c)
     return 0;
 
+  int shift = (mods & KBD_MOD_SHIFT) != 0;
   int is_letter = (c >= 'a' && c <= 'z');
 
   if (is_letter) {
-    if (shift_pressed ^ capslock_enabled)
+    if (mods & KBD_MOD_CTRL)
+      return (unsigned char)(c & 0x1F); // ^A .. ^Z
+    if (shift ^ ((mods & KBD_MOD_CAPSLOCK) != 0))
       c = (unsigned char)(c - 'a' + 'A');
     return c;
   }
-  if (shift_pressed) {
-    unsigned char s = kbdus_shifted[sc];
+  if (shift) {
+    unsigned char s = kbdus_shifted[keycode];
     if (s)
       return s;
   }
   return c;
 }
 
-/* Handle E0-extended navigation keys (make codes only). */
-static void handle_extended_make(uint8_t sc) {
-  switch (sc) {
-  case 0x48: // Up
+/* Scrollback navigation; returns false for keys that are not nav keys */
+static bool kbd_navigate(uint8_t keycode) {
+  switch (keycode) {
+  case KEY_UP:
     terminal_scroll_lines(1);
     break;
-  case 0x50: // Down
+  case KEY_DOWN:
     terminal_scroll_lines(-1);
     break;
-  case 0x49: // Page Up
+  case KEY_PAGEUP:
     terminal_scroll_page_up();
     break;
-  case 0x51: // Page Down
+  case KEY_PAGEDOWN:
     terminal_scroll_page_down();
     break;
-  case 0x47: // Home
+  case KEY_HOME:
     terminal_scroll_home();
     break;
-  case 0x4F: // End
+  case KEY_END:
     terminal_scroll_end();
     break;
   default:
-    /* ignore other extended keys for now */
-    break;
+    return false;
   }
+  return true;
 }
 
+static void kbd_cook(const kbd_event_t *ev) {
+  if (ev->flags & KBD_EVT_RELEASE)
+    return;
+  if (kbd_navigate(ev->keycode))
+    return;
+  unsigned char c = kbd_translate(ev->keycode, ev->modifiers);
+  if (c)
+    tty_input_char((char)c);
+}
+
+static void keyboard_tasklet(void *data) {
+  (void)data;
+  kbd_event_t ev;
+  while (kbd_pop(&ev)) {
+    uint64_t latency = i686_rdtsc() - ev.tsc;
+    if (latency > stats.max_latency)
+      stats.max_latency = latency;
+    kbd_cook(&ev);
+  }
+}
+
+static tasklet_t kbd_tasklet = TASKLET_INIT(keyboard_tasklet, NULL);
+
 /* ===== IRQ handler ===== */
 void keyboard_handler(registers *regs) {
   (void)regs;
-  uint8_t scancode = i686_inb(0x60);
+  uint64_t tsc = i686_rdtsc();
+  uint8_t scancode = i686_inb(KBD_DATA);
+
+  /* Pause sends E1 1D 45 E1 9D C5 and has no break code: drop it */
+  if (pause_skip) {
+    pause_skip--;
+    return;
+  }
+  if (scancode == 0xE1) {
+    pause_skip = 5;
+    return;
+  }
+  /* Controller replies, not keys */
+  if (scancode == KBD_ACK || scancode == KBD_RESEND || scancode == 0x00 ||
+      scancode == 0xFF)
+    return;
 
   /* Extended prefix */
   if (scancode == 0xE0) {
@@ -118,45 +217,83 @@ void keyboard_handler(registers *regs) {
     return;
   }
 
-  if (ext_prefix) {
-    /* Extended sequence: handle make/break for nav keys */
-    int is_break = (scancode & 0x80) != 0;
-    uint8_t code = scancode & 0x7F;
-    if (!is_break)
-      handle_extended_make(code);
-    ext_prefix = 0;
+  int extended = ext_prefix;
+  ext_prefix = 0;
+  uint8_t code = scancode & 0x7F;
+  /* Fake shifts wrapped around PrtSc and the keypad in some modes */
+  if (extended && (code == 0x2A || code == 0x36))
     return;
-  }
 
-  /* Non-extended */
+  kbd_event_t ev;
+  ev.scancode = (uint16_t)((extended ? 0xE000 : 0) | scancode);
+  ev.keycode = (uint8_t)((extended ? KEY_EXTENDED : 0) | code);
+  ev.flags = 0;
+  ev.tsc = tsc;
+
+  uint32_t *word = &key_down[ev.keycode / 32];
+  uint32_t bit = 1u << (ev.keycode % 32);
   if (scancode & 0x80) {
-    /* Key release */
-    scancode &= 0x7F;
-    if (scancode == 0x2A || scancode == 0x36) { /* LShift/RShift */
-      shift_pressed = 0;
-    }
+    ev.flags |= KBD_EVT_RELEASE;
+    *word &= ~bit;
+    modifiers &= (uint16_t)~modifier_bit(ev.keycode);
   } else {
-    /* Key press */
-    if (scancode == 0x2A || scancode == 0x36) { /* LShift/RShift */
-      shift_pressed = 1;
-      return;
-    }
-    if (scancode == 0x3A) { /* CapsLock toggle */
-      capslock_enabled = !capslock_enabled;
-      return;
-    }
+    if (*word & bit)
+      ev.flags |= KBD_EVT_REPEAT;
+    *word |= bit;
+    modifiers |= modifier_bit(ev.keycode);
+    if (!(ev.flags & KBD_EVT_REPEAT))
+      modifiers ^= lock_bit(ev.keycode);
+  }
+  ev.modifiers = modifiers;
+
+  kbd_push(&ev);
+  tasklet_schedule(&kbd_tasklet);
+}
+
+/* ===== i8042 commands ===== */
+static bool kbd_wait_write(void) {
+  for (int i = 0; i < 100000; i++)
+    if (!(i686_inb(KBD_STATUS) & KBD_STATUS_IN_FULL))
+      return true;
+  return false;
+}
 
-    unsigned char c = kbd_translate(scancode);
-    if (c)
-      kbd_put(c); /* enqueue printable chars */
+/* Send one byte to the keyboard and wait for its ACK (IRQ 1 masked) */
+static bool kbd_send(uint8_t byte) {
+  for (int attempt = 0; attempt < 3; attempt++) {
+    if (!kbd_wait_write())
+      return false;
+    i686_outb(KBD_DATA, byte);
+    for (int i = 0; i < 100000; i++) {
+      if (!(i686_inb(KBD_STATUS) & KBD_STATUS_OUT_FULL))
+        continue;
+      uint8_t reply = i686_inb(KBD_DATA);
+      if (reply == KBD_ACK)
+        return true;
+      if (reply == KBD_RESEND)
+        break;
+    }
   }
+  return false;
+}
+
+bool keyboard_set_typematic(uint8_t delay, uint8_t rate) {
+  i686_irq_mask(1);
+  bool ok = kbd_send(KBD_CMD_TYPEMATIC) &&
+            kbd_send((uint8_t)(((delay & 0x3) << 5) | (rate & 0x1F)));
+  i686_irq_unmask(1);
+  return ok;
+}
+
+void keyboard_get_stats(kbd_stats_t *out) {
+  uint32_t flags = i686_irq_save();
+  *out = stats;
+  i686_irq_restore(flags);
 }
 
-/* ===== Non-blocking getchar ===== */
-int keyboard_getchar(void) {
-  if (kbd_empty())
-    return -1;
-  unsigned char c = kbd_buf[kbd_tail];
-  kbd_tail = (kbd_tail + 1) & (KBD_BUFFER_SIZE - 1);
-  return (int)c;
+void keyboard_init() {
+  i686_irq_register_handler(1, keyboard_handler);
+  // 250 ms before repeating, then ~20 chars/s
+  if (!keyboard_set_typematic(0, 0x04))
+    printf("keyboard: typematic setup failed\n");
 }
@@ -0,0 +1,61 @@
+#include "arch/i686/drivers/pit.h"
+
+#include <arch/i686/io.h>
+#include <arch/i686/irq.h>
+#include <kernel/clockevent.h>
+#include <kernel/clocksource.h>
+#include <stdint.h>
+
+#define PIT_HZ 1193182u
+#define PIT_CH0_DATA 0x40
+#define PIT_COMMAND 0x43
+#define PIT_CMD_CH0_ONESHOT 0x30  // channel 0, lobyte/hibyte, mode 0
+#define PIT_CMD_CH0_PERIODIC 0x34 // channel 0, lobyte/hibyte, mode 2
+#define PIT_MAX_COUNT 0xFFFFu
+
+// ns -> PIT counts as (ns * mult) >> shift
+static uint32_t ns_mult, ns_shift;
+
+static void pit_load(uint8_t command, uint32_t count) {
+  if (count < 1)
+    count = 1;
+  if (count > PIT_MAX_COUNT)
+    count = PIT_MAX_COUNT;
+  i686_outb(PIT_COMMAND, command);
+  i686_outb(PIT_CH0_DATA, count & 0xFF);
+  i686_outb(PIT_CH0_DATA, (count >> 8) & 0xFF);
+}
+
+static void pit_set_next_event(uint64_t delta_ns) {
+  pit_load(PIT_CMD_CH0_ONESHOT, (uint32_t)((delta_ns * ns_mult) >> ns_shift));
+}
+
+static void pit_set_periodic(uint32_t hz) {
+  pit_load(PIT_CMD_CH0_PERIODIC, (PIT_HZ + hz / 2) / hz);
+}
+
+static void pit_shutdown(void) {
+  pit_load(PIT_CMD_CH0_ONESHOT, PIT_MAX_COUNT); // no reload after this one
+  i686_irq_mask(0);
+}
+
+static clockevent pit_clockevent = {
+    .name = "pit",
+    .min_delta_ns = 1000,
+    .max_delta_ns = (uint64_t)PIT_MAX_COUNT * NSEC_PER_SEC / PIT_HZ,
+    .rating = 100,
+    .set_next_event = &pit_set_next_event,
+    .set_periodic = &pit_set_periodic,
+    .shutdown = &pit_shutdown,
+};
+
+static void pit_handler(registers *regs) {
+  (void)regs;
+  clockevent_handle_interrupt();
+}
+
+void pit_init(void) {
+  clocks_calc_mult_shift(&ns_mult, &ns_shift, NSEC_PER_SEC, PIT_HZ, 1);
+  i686_irq_register_handler(0, pit_handler);
+  clockevent_register(&pit_clockevent);
+}
@@ -0,0 +1,88 @@
+#include "arch/i686/drivers/tsc.h"
+
+#include <arch/i686/io.h>
+#include <cpuid.h>
+#include <kernel/clocksource.h>
+#include <stdio.h>
+
+#define PIT_HZ 1193182u
+#define PIT_CH2_DATA 0x42
+#define PIT_COMMAND 0x43
+#define PIT_CH2_GATE_PORT 0x61 // bit 0 = gate, bit 1 = speaker, bit 5 = OUT2
+#define CALIBRATE_MS 10
+#define CALIBRATE_LATCH (PIT_HZ * CALIBRATE_MS / 1000)
+#define CALIBRATE_TRIES 5
+
+static uint64_t tsc_freq_hz = 0;
+static bool invariant = false;
+
+static uint64_t tsc_read(void) { return i686_rdtsc(); }
+
+static clocksource tsc_clocksource = {
+    .name = "tsc",
+    .read = &tsc_read,
+    .mask = ~0ull,
+    .freq_hz = 0,
+    .rating = 0,
+    .next = NULL,
+};
+
+/* TSC cycles while PIT channel 2 counts down CALIBRATE_LATCH (0 = failed) */
+static uint64_t pit_calibrate_once(void) {
+  uint8_t gate = i686_inb(PIT_CH2_GATE_PORT);
+  i686_outb(PIT_CH2_GATE_PORT, (gate & ~0x02) | 0x01); // gate on, speaker off
+
+  // channel 2, lobyte/hibyte, mode 0 (OUT2 goes high at terminal count)
+  i686_outb(PIT_COMMAND, 0xB0);
+  i686_outb(PIT_CH2_DATA, CALIBRATE_LATCH & 0xFF);
+  i686_outb(PIT_CH2_DATA, CALIBRATE_LATCH >> 8);
+
+  uint64_t start = i686_rdtsc();
+  uint32_t spins = 0;
+  while (!(i686_inb(PIT_CH2_GATE_PORT) & 0x20)) {
+    if (++spins > 10000000u) {
+      start = 0;
+      break;
+    }
+  }
+  uint64_t end = i686_rdtsc();
+
+  i686_outb(PIT_CH2_GATE_PORT, gate);
+  return start ? end - start : 0;
+}
+
+bool tsc_init(void) {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(edx & (1u << 4)))
+    return false; // no TSC
+
+  // CPUID 0x80000007 EDX bit 8: constant rate across P-/C-states
+  if (__get_cpuid_max(0x80000000u, NULL) >= 0x80000007u &&
+      __get_cpuid(0x80000007u, &eax, &ebx, &ecx, &edx))
+    invariant = (edx & (1u << 8)) != 0;
+
+  // Shortest run is the one least disturbed by SMIs and emulation hiccups
+  uint64_t best = 0;
+  uint32_t flags = i686_irq_save();
+  for (int i = 0; i < CALIBRATE_TRIES; i++) {
+    uint64_t cycles = pit_calibrate_once();
+    if (cycles && (!best || cycles < best))
+      best = cycles;
+  }
+  i686_irq_restore(flags);
+  if (!best)
+    return false;
+
+  tsc_freq_hz = best * PIT_HZ / CALIBRATE_LATCH;
+  tsc_clocksource.freq_hz = tsc_freq_hz;
+  // A TSC that stops or changes speed is only a last resort
+  tsc_clocksource.rating = invariant ? 300 : 50;
+  printf("TSC: %u MHz%s\n", (uint32_t)(tsc_freq_hz / 1000000),
+         invariant ? ", invariant" : "");
+  clocksource_register(&tsc_clocksource);
+  return true;
+}
+
+uint32_t tsc_khz(void) { return (uint32_t)(tsc_freq_hz / 1000); }
+
+bool tsc_is_invariant(void) { return invariant; }
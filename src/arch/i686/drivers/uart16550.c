@@ -0,0 +1,203 @@
+#include "arch/i686/drivers/uart16550.h"
+
+#include <arch/i686/io.h>
+#include <arch/i686/irq.h>
+#include <kernel/dev_tty.h> // tty_input_char
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Register offsets from the base port
+#define UART_RBR 0 // receive buffer (read, DLAB=0)
+#define UART_THR 0 // transmit holding (write, DLAB=0)
+#define UART_DLL 0 // divisor latch low (DLAB=1)
+#define UART_IER 1 // interrupt enable (DLAB=0)
+#define UART_DLM 1 // divisor latch high (DLAB=1)
+#define UART_IIR 2 // interrupt identification (read)
+#define UART_FCR 2 // FIFO control (write)
+#define UART_LCR 3 // line control
+#define UART_MCR 4 // modem control
+#define UART_LSR 5 // line status
+#define UART_MSR 6 // modem status
+#define UART_SCR 7 // scratch
+
+enum {
+  UART_IER_RDA = 0x01,  // received data available
+  UART_IER_THRE = 0x02, // transmit holding register empty
+  UART_IER_RLS = 0x04,  // receiver line status
+};
+
+enum {
+  UART_IIR_NO_INT = 0x01,
+  UART_IIR_ID_MASK = 0x0E,
+  UART_IIR_MSR = 0x00,
+  UART_IIR_THRE = 0x02,
+  UART_IIR_RDA = 0x04,
+  UART_IIR_RLS = 0x06,
+  UART_IIR_TIMEOUT = 0x0C,
+  UART_IIR_FIFO_MASK = 0xC0, // 11 = FIFOs enabled and working (16550A)
+};
+
+enum {
+  UART_FCR_ENABLE = 0x01,
+  UART_FCR_CLEAR_RX = 0x02,
+  UART_FCR_CLEAR_TX = 0x04,
+  UART_FCR_TRIGGER_14 = 0xC0,
+};
+
+enum {
+  UART_LCR_8N1 = 0x03,
+  UART_LCR_DLAB = 0x80,
+};
+
+enum {
+  UART_MCR_DTR = 0x01,
+  UART_MCR_RTS = 0x02,
+  UART_MCR_OUT2 = 0x08, // gates the IRQ line on PC hardware
+  UART_MCR_LOOP = 0x10,
+};
+
+enum {
+  UART_LSR_DR = 0x01,   // data ready
+  UART_LSR_THRE = 0x20, // THR empty
+};
+
+#define UART_CLOCK 115200u
+
+// ----- TX ring (power of two) -----
+#define TX_RING_SIZE 4096
+static volatile uint8_t tx_ring[TX_RING_SIZE];
+static volatile uint32_t tx_head = 0; // producer
+static volatile uint32_t tx_tail = 0; // consumer (THRE interrupt)
+static volatile bool tx_busy = false; // a THRE interrupt is outstanding
+
+static uint16_t port = 0;
+static uint32_t fifo_depth = 1; // bytes we may push per THRE
+
+static inline uint32_t tx_count(void) { return tx_head - tx_tail; }
+
+/* Move up to one FIFO's worth from the ring into THR; interrupts off */
+static void tx_fill_fifo(void) {
+  uint32_t n = 0;
+  while (n < fifo_depth && tx_tail != tx_head) {
+    i686_outb(port + UART_THR, tx_ring[tx_tail & (TX_RING_SIZE - 1)]);
+    tx_tail++;
+    n++;
+  }
+  tx_busy = n != 0;
+}
+
+/* Polled fallback for contexts that can't wait for the THRE interrupt */
+static void tx_drain_polled(void) {
+  while (tx_tail != tx_head) {
+    while (!(i686_inb(port + UART_LSR) & UART_LSR_THRE))
+      ;
+    tx_fill_fifo();
+  }
+  // the last fill armed tx_busy; the THRE interrupt that follows clears it
+}
+
+static void rx_drain(void) {
+  while (i686_inb(port + UART_LSR) & UART_LSR_DR) {
+    char c = (char)i686_inb(port + UART_RBR);
+    if (c == '\r')
+      c = '\n'; // terminals send CR for Enter
+    else if (c == 0x7F)
+      c = '\b'; // and DEL for Backspace
+    tty_input_char(c);
+  }
+}
+
+void uart16550_handler(registers *regs) {
+  (void)regs;
+  for (;;) {
+    uint8_t iir = i686_inb(port + UART_IIR);
+    if (iir & UART_IIR_NO_INT)
+      break;
+    switch (iir & UART_IIR_ID_MASK) {
+    case UART_IIR_RLS:
+      (void)i686_inb(port + UART_LSR);
+      break;
+    case UART_IIR_RDA:
+    case UART_IIR_TIMEOUT:
+      rx_drain();
+      break;
+    case UART_IIR_THRE:
+      tx_fill_fifo(); // refills or goes idle when the ring is empty
+      break;
+    default: // UART_IIR_MSR
+      (void)i686_inb(port + UART_MSR);
+      break;
+    }
+  }
+}
+
+size_t uart16550_write(const void *buf, size_t n) {
+  if (!port)
+    return 0;
+  const uint8_t *p = (const uint8_t *)buf;
+
+  for (size_t i = 0; i < n; i++) {
+    while (tx_count() >= TX_RING_SIZE) {
+      // Ring full. With interrupts on, sleep until THRE drains a FIFO's
+      // worth; otherwise (IRQ handler, panic) push it out by polling.
+      uint32_t flags = i686_irq_save();
+      if ((flags & 0x200) && tx_busy)
+        __asm__ volatile("sti; hlt" ::: "memory"); // no lost wakeup
+      else
+        tx_drain_polled();
+      i686_irq_restore(flags);
+    }
+    tx_ring[tx_head & (TX_RING_SIZE - 1)] = p[i];
+    tx_head++;
+  }
+
+  // Kick an idle transmitter; afterwards THRE interrupts keep it going
+  uint32_t flags = i686_irq_save();
+  if (!tx_busy)
+    tx_fill_fifo();
+  if (!(flags & 0x200))
+    tx_drain_polled(); // nobody will take the interrupt
+  i686_irq_restore(flags);
+  return n;
+}
+
+bool uart16550_present(void) { return port != 0; }
+
+bool uart16550_init(uint16_t base, int irq, uint32_t baud) {
+  // Probe: scratch register must hold a value, loopback must echo
+  i686_outb(base + UART_SCR, 0x5A);
+  if (i686_inb(base + UART_SCR) != 0x5A)
+    return false;
+
+  i686_outb(base + UART_IER, 0x00); // quiet while we set it up
+
+  if (baud == 0 || baud > UART_CLOCK)
+    baud = UART_CLOCK;
+  uint16_t divisor = (uint16_t)(UART_CLOCK / baud);
+  i686_outb(base + UART_LCR, UART_LCR_DLAB);
+  i686_outb(base + UART_DLL, divisor & 0xFF);
+  i686_outb(base + UART_DLM, divisor >> 8);
+  i686_outb(base + UART_LCR, UART_LCR_8N1);
+
+  i686_outb(base + UART_FCR, UART_FCR_ENABLE | UART_FCR_CLEAR_RX |
+                                 UART_FCR_CLEAR_TX | UART_FCR_TRIGGER_14);
+
+  i686_outb(base + UART_MCR, UART_MCR_LOOP | UART_MCR_RTS | UART_MCR_DTR);
+  i686_outb(base + UART_THR, 0xAE);
+  if (i686_inb(base + UART_RBR) != 0xAE)
+    return false;
+  i686_outb(base + UART_MCR, UART_MCR_DTR | UART_MCR_RTS | UART_MCR_OUT2);
+
+  // IIR bits 7:6 == 11 -> working 16-byte FIFOs (16550A); else 16450 style
+  fifo_depth =
+      ((i686_inb(base + UART_IIR) & UART_IIR_FIFO_MASK) == UART_IIR_FIFO_MASK)
+          ? 16
+          : 1;
+
+  port = base;
+  i686_irq_register_handler(irq, uart16550_handler);
+  i686_outb(base + UART_IER, UART_IER_RDA | UART_IER_THRE | UART_IER_RLS);
+  i686_irq_unmask(irq);
+  return true;
+}
@@ -1,37 +1,107 @@
 // arch/i686/irq.c
 #include "arch/i686/irq.h"
+#include "arch/i686/drivers/apic.h"
 #include "arch/i686/drivers/i8259.h"
+#include "arch/i686/gdt.h"
+#include "arch/i686/idt.h"
 #include "arch/i686/io.h"
+#include "arch/i686/irqstat.h"
 #include "arch/i686/isr.h"
 #include "arch/i686/pic.h"
+#include "kernel/softirq.h"
 #include "util/array.h"
 #include <stdio.h>
 
 #define PIC_REMAP_OFFSET 0x20
+#define PIC_LINES 16
+// Reaches IRQ_BENCH the way every device interrupt used to: through
+// isr_common, isr_c_handler and isr_handlers
+#define BENCH_GENERIC_VECTOR (PIC_REMAP_OFFSET + IRQ_COUNT)
 
-static irq_handler_t irq_handlers[16]; // zero-initialized
+// Read by the entry stubs in irq_asm.asm
+irq_handler_t irq_handlers[IRQ_COUNT]; // zero-initialized
+extern void *const i686_irq_stubs[IRQ_COUNT];
 
 static const pic_driver *driver = NULL;
+// Lines drivers asked to have enabled; replayed onto the controller at init
+// so drivers may unmask before i686_init_irq has picked one
+static uint16_t irq_enabled = 0;
 
-void i686_irq_handler(registers *regs) {
-  int irq = regs->interrupt - PIC_REMAP_OFFSET;
+// Lines whose handlers run start to finish with interrupts off. The timers
+// outrank everything else anyway, so they keep the cheap path. MSI shares
+// the LAPIC timer's priority class, so raising the TPR for it would hold
+// the tick off; its handlers only acknowledge and schedule a tasklet.
+#define IRQ_ATOMIC                                                             \
+  ((1u << 0) | (1u << IRQ_LOCAL_TIMER) | (1u << IRQ_BENCH) | (1u << IRQ_MSI))
 
-  if (irq_handlers[irq] != NULL) {
-    // handle IRQ
-    irq_handlers[irq](regs);
+// Interrupt nesting depth of this CPU (there is only the boot CPU), and the
+// controller priority each nested level replaced
+static volatile int irq_depth = 0;
+static uint32_t saved_priority[IRQ_COUNT + 1];
+
+/* --- Called from the entry stubs --- */
+void i686_irq_unhandled(int irq) { printf("Unhandled IRQ %d...\n", irq); }
+
+// Returns the TSC the handler starts at. Other lines hold off everything of
+// equal or lower priority, take their EOI now if edge-triggered, and run the
+// handler with interrupts enabled so higher lines (the timer) get through.
+uint64_t i686_irq_enter(int irq) {
+  int depth = ++irq_depth;
+  if (!(IRQ_ATOMIC & (1u << irq))) {
+    saved_priority[depth] = driver->raise_priority(irq);
+    if (!driver->is_level_triggered(irq))
+      driver->send_end_of_interrupt(irq);
+    i686_interrupts_enable();
+  }
+  return i686_rdtsc();
+}
+
+void i686_irq_exit(int irq, uint64_t start) {
+  // nested handlers that ran meanwhile are part of this figure
+  uint64_t cycles = i686_rdtsc() - start;
+  i686_interrupts_disable();
+  irqstat_record(PIC_REMAP_OFFSET + irq, cycles);
+
+  int depth = irq_depth;
+  if (IRQ_ATOMIC & (1u << irq)) {
+    if (irq != IRQ_BENCH)
+      driver->send_end_of_interrupt(irq);
   } else {
-    printf("Unhandled IRQ %d...\n", irq);
+    if (driver->is_level_triggered(irq))
+      driver->send_end_of_interrupt(irq);
+    driver->restore_priority(saved_priority[depth]);
   }
+  irq_depth = depth - 1;
 
-  // send EOI
-  driver->send_end_of_interrupt(irq);
+  // deferred work runs with interrupts enabled, after the PIC is re-armed,
+  // once the outermost handler is done
+  if (depth == 1)
+    softirq_run();
+}
+
+/* --- Entry benchmark --- */
+static void irq_bench_nop(registers *regs) { (void)regs; }
+
+static void irq_bench_generic(registers *regs) {
+  uint64_t start = i686_irq_enter(IRQ_BENCH);
+  irq_handlers[IRQ_BENCH](regs);
+  i686_irq_exit(IRQ_BENCH, start);
 }
 
 /* --- Public API --- */
 void i686_init_irq() {
+  // device lines enter through the fast stubs instead of i686_ISR<n>
+  for (int i = 0; i < IRQ_COUNT; i++)
+    i686_idt_set_gate(PIC_REMAP_OFFSET + i, i686_irq_stubs[i],
+                      i686_GDT_CODE_SEGMENT,
+                      IDT_FLAG_RING0 | IDT_FLAG_GATE_32BIT_INT |
+                          IDT_FLAG_PRESENT);
+  i686_isr_register_handler(BENCH_GENERIC_VECTOR, irq_bench_generic);
+
+  // later entries win: the APIC (found via the ACPI MADT) over the 8259
   const pic_driver *drivers[] = {
       i8259_get_driver(),
-
+      apic_get_driver(),
   };
 
   for (int i = 0; (signed)i < (int)SIZE(drivers); i++) {
@@ -49,17 +119,54 @@ void i686_init_irq() {
   driver->initialize(PIC_REMAP_OFFSET, PIC_REMAP_OFFSET + 8, false,
                      (void *)100);
 
-  // register ISR handlers for each of the 16 irq lines
-  for (int i = 0; i < 16; i++)
-    i686_isr_register_handler(PIC_REMAP_OFFSET + i, i686_irq_handler);
-
-  driver->unmask(0);
-  driver->unmask(1);
+  irq_enabled |= (1u << 0) | (1u << 1);
+  for (int i = 0; i < PIC_LINES; i++)
+    if (irq_enabled & (1u << i))
+      driver->unmask(i);
 
   // enable interrupts
   i686_interrupts_enable();
 }
 
+int i686_irq_depth(void) { return irq_depth; }
+
 void i686_irq_register_handler(int irq, irq_handler_t handler) {
   irq_handlers[irq] = handler;
 }
+
+void i686_irq_mask(int irq) {
+  if (irq >= PIC_LINES)
+    return; // local sources are masked at the source
+  irq_enabled &= (uint16_t)~(1u << irq);
+  if (driver)
+    driver->mask(irq);
+}
+
+void i686_irq_unmask(int irq) {
+  if (irq >= PIC_LINES)
+    return;
+  irq_enabled |= (uint16_t)(1u << irq);
+  if (driver)
+    driver->unmask(irq);
+}
+
+void i686_irq_benchmark(uint32_t iterations, uint32_t *generic_cycles,
+                        uint32_t *fast_cycles) {
+  if (iterations == 0)
+    iterations = 1;
+  irq_handlers[IRQ_BENCH] = irq_bench_nop;
+
+  // keep the timer and devices out of the measurement
+  uint32_t flags = i686_irq_save();
+  uint64_t start = i686_rdtsc();
+  for (uint32_t i = 0; i < iterations; i++)
+    asm volatile("int %0" ::"i"(BENCH_GENERIC_VECTOR) : "memory");
+  uint64_t mid = i686_rdtsc();
+  for (uint32_t i = 0; i < iterations; i++)
+    asm volatile("int %0" ::"i"(PIC_REMAP_OFFSET + IRQ_BENCH) : "memory");
+  uint64_t end = i686_rdtsc();
+  i686_irq_restore(flags);
+
+  *generic_cycles = (uint32_t)((mid - start) / iterations);
+  *fast_cycles = (uint32_t)((end - mid) / iterations);
+}
@@ -0,0 +1,95 @@
+[bits 32]
+
+; Device interrupt entry. Unlike the exception stubs in isr_asm.asm these do
+; not build a registers frame: only the caller-saved registers are pushed (the
+; C handler preserves the rest), and the data segments are reloaded only when
+; the interrupt arrived from ring 3 - in ring 0 they already hold 0x10. The
+; line's handler is called straight out of irq_handlers, bracketed by
+; i686_irq_enter and i686_irq_exit.
+
+%define IRQ_LINES 19        ; IRQ_COUNT in arch/i686/irq.h
+
+extern irq_handlers
+extern i686_irq_enter
+extern i686_irq_exit
+extern i686_irq_unhandled
+
+; eax = irq line; clobbers eax, ecx, edx
+%macro IRQ_DISPATCH 0
+    push eax                ; kept: the callee may reuse its argument slot
+    push eax
+    call i686_irq_enter     ; priority, early EOI; edx:eax = start tsc
+    add esp, 4
+    pop ecx
+    push edx                ; i686_irq_exit(irq, start tsc)
+    push eax
+    push ecx
+    mov ecx, [irq_handlers + ecx * 4]
+    test ecx, ecx
+    jz %%unhandled
+    push 0                  ; no register frame for device interrupts
+    call ecx
+    jmp %%exit
+%%unhandled:
+    push dword [esp]        ; irq
+    call i686_irq_unhandled
+%%exit:
+    add esp, 4
+    call i686_irq_exit      ; statistics, EOI and softirqs
+    add esp, 12
+%endmacro
+
+%assign i 0
+%rep IRQ_LINES
+global i686_IRQ %+ i
+i686_IRQ %+ i:
+    push eax
+    push ecx
+    push edx
+    mov eax, i              ; irq line
+    jmp irq_common
+%assign i i + 1
+%endrep
+
+irq_common:
+    test byte [esp + 16], 3 ; RPL of the interrupted cs (above edx, ecx, eax, eip)
+    jnz irq_from_user
+
+    IRQ_DISPATCH
+
+    pop edx
+    pop ecx
+    pop eax
+    iret
+
+irq_from_user:
+    push ds
+    push es
+    push fs
+    push gs
+    mov cx, 0x10            ; use kernel data segment
+    mov ds, cx
+    mov es, cx
+    mov fs, cx
+    mov gs, cx
+
+    IRQ_DISPATCH
+
+    pop gs
+    pop fs
+    pop es
+    pop ds
+    pop edx
+    pop ecx
+    pop eax
+    iret
+
+section .rodata
+
+global i686_irq_stubs
+i686_irq_stubs:             ; entry point of each line, for the IDT
+%assign i 0
+%rep IRQ_LINES
+    dd i686_IRQ %+ i
+%assign i i + 1
+%endrep
@@ -0,0 +1,32 @@
+#include "arch/i686/irqstat.h"
+#include "arch/i686/io.h"
+#include <string.h>
+
+static irqstat_t stats[256];
+
+void irqstat_record(int vector, uint64_t cycles) {
+  irqstat_t *s = &stats[vector & 0xFF];
+  uint32_t c = cycles > 0xFFFFFFFFu ? 0xFFFFFFFFu : (uint32_t)cycles;
+
+  int bucket = 31 - __builtin_clz(c | 1);
+  if (bucket >= IRQSTAT_BUCKETS)
+    bucket = IRQSTAT_BUCKETS - 1;
+
+  s->count++;
+  s->total_cycles += c;
+  if (c > s->max_cycles)
+    s->max_cycles = c;
+  s->hist[bucket]++;
+}
+
+void irqstat_get(int vector, irqstat_t *out) {
+  uint32_t flags = i686_irq_save();
+  *out = stats[vector & 0xFF];
+  i686_irq_restore(flags);
+}
+
+void irqstat_reset(void) {
+  uint32_t flags = i686_irq_save();
+  memset(stats, 0, sizeof(stats));
+  i686_irq_restore(flags);
+}
@@ -1,6 +1,7 @@
 #include "arch/i686/isr.h"
 #include "arch/i686/idt.h"
 #include "arch/i686/io.h"
+#include "arch/i686/irqstat.h"
 #include <kernel/tty.h>
 #include <kernel/vga.h>
 #include <stdio.h>
@@ -51,9 +52,12 @@ void i686_init_isr() {
 }
 
 void isr_c_handler(registers *regs) {
-  if (isr_handlers[regs->interrupt] != NULL)
+  if (isr_handlers[regs->interrupt] != NULL) {
+    uint64_t start = i686_rdtsc();
     isr_handlers[regs->interrupt](regs);
-  else if (regs->interrupt >= 32) {
+    irqstat_record(regs->interrupt, i686_rdtsc() - start);
+  } else if (regs->interrupt >= 32) {
+    irqstat_record(regs->interrupt, 0);
     terminal_set_color(VGA_COLOR_RED, VGA_COLOR_BLACK);
     printf("Unhandled interrupt %d!\n", regs->interrupt);
     terminal_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
@@ -72,6 +76,7 @@ void isr_c_handler(registers *regs) {
     printf("  interrupt=%x  errorcode=%x\n", regs->interrupt, regs->error);
     printf("KERNEL PANIC!");
     terminal_set_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
+    terminal_flush();
     i686_panic();
   }
 }
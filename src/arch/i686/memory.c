@@ -20,6 +20,7 @@ uint8_t physical_memory_bitmap[NUM_PAGE_FRAMES]; // TODO: Dynamically, bit array
 static uint32_t page_dirs[NUM_PAGES_DIRS][1024] __attribute__((aligned(4096)));
 static uint8_t page_dir_used[NUM_PAGES_DIRS];
 static int mem_num_vpages;
+static uint32_t mmio_next = KERNEL_MMIO; // bump pointer for device windows
 
 void invalidate(uint32_t vaddr) { asm volatile("invlpg %0" ::"m"(vaddr)); }
 
@@ -115,6 +116,42 @@ void mem_map_page(uint32_t vaddr, uint32_t paddr, uint32_t flags) {
   }
 }
 
+// Map a physical device range (framebuffer, MMIO registers) into the kernel's
+// device window and return the virtual address of paddr.
+void *mem_map_mmio(uint32_t paddr, uint32_t size, uint32_t flags) {
+  uint32_t offset = paddr & (PAGE_SIZE - 1);
+  uint32_t base = paddr - offset;
+  uint32_t pages = CEIL_DIV(size + offset, PAGE_SIZE);
+
+  if (pages == 0 || mmio_next + pages * PAGE_SIZE < mmio_next ||
+      mmio_next + pages * PAGE_SIZE > 0xFFC00000u) // recursive PD lives above
+    return NULL;
+
+  uint32_t vaddr = mmio_next;
+  for (uint32_t i = 0; i < pages; i++)
+    mem_map_page(vaddr + i * PAGE_SIZE, base + i * PAGE_SIZE, flags);
+  mmio_next += pages * PAGE_SIZE;
+
+  return (void *)(vaddr + offset);
+}
+
+// Physical address behind a kernel virtual address, for devices doing DMA;
+// 0 if it is not mapped. Walks the kernel page tables through the recursive
+// slot of initial_page_dir.
+uint32_t mem_virt_to_phys(const void *vaddr) {
+  uint32_t v = (uint32_t)vaddr;
+  uint32_t pde = REC_PAGEDIR[v >> 22];
+  if (!(pde & PAGE_FLAG_PRESENT))
+    return 0;
+  if (pde & PAGE_FLAG_4MB) // the boot mapping of the kernel image
+    return (pde & 0xFFC00000u) | (v & 0x003FFFFFu);
+
+  uint32_t pte = REC_PAGETABLE(v >> 22)[(v >> 12) & 0x3FF];
+  if (!(pte & PAGE_FLAG_PRESENT))
+    return 0;
+  return (pte & ~(uint32_t)(PAGE_SIZE - 1)) | (v & (PAGE_SIZE - 1));
+}
+
 void dump_physical_memory_bitmap() {
   printf("Physical memory bitmap:\n");
 
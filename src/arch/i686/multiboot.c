@@ -27,6 +27,7 @@ struct mb2_header {
 
   struct mb2_hdr_tag_info_req info;  // type=1
   struct mb2_hdr_tag_framebuffer fb; // type=5 (optional)
+  uint32_t fb_pad;                   // tags are 8-byte aligned
   struct mb2_hdr_tag end;            // type=0
 } __attribute__((packed, aligned(8)));
 
@@ -47,4 +48,16 @@ const struct mb2_header mb2_hdr = {
             .requests = {4u, 6u} // runtime tag types we want
         },
 
+    // Framebuffer: OPTIONAL; 640x480 holds the 80x25 console with 8x16 cells.
+    // If GRUB can't set a linear mode we keep running on VGA text.
+    .fb =
+        {
+            .type = 5,
+            .flags = 1, // optional
+            .size = sizeof(struct mb2_hdr_tag_framebuffer),
+            .width = 640,
+            .height = 480,
+            .depth = 32,
+        },
+
     .end = {.type = 0, .flags = 0, .size = 8}};
@@ -0,0 +1,269 @@
+#include "arch/i686/pci.h"
+
+#include <arch/i686/io.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <util/array.h>
+
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA 0xCFC
+
+#define PCI_BAR_IO (1u << 0)
+#define PCI_BAR_MEM_TYPE_MASK 0x6
+#define PCI_BAR_MEM_TYPE_64 0x4
+
+static pci_device_t devices[PCI_MAX_DEVICES];
+static size_t device_count = 0;
+
+/* ---------- Configuration mechanism #1 ---------- */
+static uint32_t config_address(uint8_t bus, uint8_t slot, uint8_t func,
+                               uint8_t offset) {
+  return 0x80000000u | ((uint32_t)bus << 16) | ((uint32_t)slot << 11) |
+         ((uint32_t)func << 8) | (offset & 0xFC);
+}
+
+static uint32_t config_read32(uint8_t bus, uint8_t slot, uint8_t func,
+                              uint8_t offset) {
+  uint32_t flags = i686_irq_save(); // address + data is one transaction
+  i686_outl(PCI_CONFIG_ADDRESS, config_address(bus, slot, func, offset));
+  uint32_t value = i686_inl(PCI_CONFIG_DATA);
+  i686_irq_restore(flags);
+  return value;
+}
+
+static void config_write32(uint8_t bus, uint8_t slot, uint8_t func,
+                           uint8_t offset, uint32_t value) {
+  uint32_t flags = i686_irq_save();
+  i686_outl(PCI_CONFIG_ADDRESS, config_address(bus, slot, func, offset));
+  i686_outl(PCI_CONFIG_DATA, value);
+  i686_irq_restore(flags);
+}
+
+/* A 16-bit store touches only its own register: no read-modify-write of a
+ * neighbour such as STATUS, whose bits are write-1-to-clear */
+static void config_write16(uint8_t bus, uint8_t slot, uint8_t func,
+                           uint8_t offset, uint16_t value) {
+  uint32_t flags = i686_irq_save();
+  i686_outl(PCI_CONFIG_ADDRESS, config_address(bus, slot, func, offset));
+  i686_outw((uint16_t)(PCI_CONFIG_DATA + (offset & 2)), value);
+  i686_irq_restore(flags);
+}
+
+uint32_t pci_read32(const pci_device_t *dev, uint8_t offset) {
+  return config_read32(dev->bus, dev->slot, dev->func, offset);
+}
+
+uint16_t pci_read16(const pci_device_t *dev, uint8_t offset) {
+  return (uint16_t)(pci_read32(dev, offset) >> ((offset & 2) * 8));
+}
+
+uint8_t pci_read8(const pci_device_t *dev, uint8_t offset) {
+  return (uint8_t)(pci_read32(dev, offset) >> ((offset & 3) * 8));
+}
+
+void pci_write32(const pci_device_t *dev, uint8_t offset, uint32_t value) {
+  config_write32(dev->bus, dev->slot, dev->func, offset, value);
+}
+
+void pci_write16(const pci_device_t *dev, uint8_t offset, uint16_t value) {
+  config_write16(dev->bus, dev->slot, dev->func, offset, value);
+}
+
+void pci_enable(const pci_device_t *dev, uint16_t command_bits) {
+  // the status half of the dword is write-1-to-clear: write the command only
+  uint32_t v = pci_read32(dev, PCI_COMMAND) & 0xFFFF;
+  pci_write32(dev, PCI_COMMAND, v | command_bits);
+}
+
+/* ---------- Capabilities ---------- */
+#define PCI_MSI_CONTROL 0x02
+#define PCI_MSI_ADDRESS 0x04
+#define PCI_MSI_DATA_32 0x08
+#define PCI_MSI_DATA_64 0x0C
+#define PCI_MSI_ENABLE (1u << 0)
+#define PCI_MSI_MME_MASK (7u << 4) // messages enabled, log2
+#define PCI_MSI_64BIT (1u << 7)
+
+uint8_t pci_find_capability(const pci_device_t *dev, uint8_t id) {
+  if (!(pci_read16(dev, PCI_STATUS) & PCI_STATUS_CAP_LIST))
+    return 0;
+  uint8_t cap = pci_read8(dev, PCI_CAPABILITY_LIST) & 0xFC;
+  // 48 capabilities fill the device-specific area: stop on a loop
+  for (int n = 0; cap && n < 48; n++) {
+    if (pci_read8(dev, cap) == id)
+      return cap;
+    cap = pci_read8(dev, (uint8_t)(cap + 1)) & 0xFC;
+  }
+  return 0;
+}
+
+bool pci_enable_msi(const pci_device_t *dev, uint32_t address, uint16_t data) {
+  uint8_t cap = pci_find_capability(dev, PCI_CAP_ID_MSI);
+  if (!cap)
+    return false;
+  uint16_t control = pci_read16(dev, cap + PCI_MSI_CONTROL);
+  pci_write32(dev, cap + PCI_MSI_ADDRESS, address);
+  if (control & PCI_MSI_64BIT) {
+    pci_write32(dev, cap + PCI_MSI_ADDRESS + 4, 0);
+    pci_write16(dev, cap + PCI_MSI_DATA_64, data);
+  } else {
+    pci_write16(dev, cap + PCI_MSI_DATA_32, data);
+  }
+  control = (uint16_t)((control & ~PCI_MSI_MME_MASK) | PCI_MSI_ENABLE);
+  pci_write16(dev, cap + PCI_MSI_CONTROL, control);
+  pci_enable(dev, PCI_COMMAND_INTX_DISABLE);
+  return true;
+}
+
+/* ---------- Enumeration ---------- */
+/* Decode and size the BARs; decoding is off meanwhile so the all-ones probe
+ * never lands on another device, and so are interrupts, since the device may
+ * be the framebuffer the console flush writes to */
+static void probe_bars(pci_device_t *dev) {
+  uint32_t flags = i686_irq_save();
+  uint32_t cmd = pci_read32(dev, PCI_COMMAND) & 0xFFFF;
+  pci_write32(dev, PCI_COMMAND,
+              cmd & ~(uint32_t)(PCI_COMMAND_IO | PCI_COMMAND_MEMORY));
+
+  for (int i = 0; i < PCI_BARS; i++) {
+    uint8_t reg = (uint8_t)(PCI_BAR0 + i * 4);
+    uint32_t orig = pci_read32(dev, reg);
+    pci_write32(dev, reg, 0xFFFFFFFFu);
+    uint32_t probe = pci_read32(dev, reg);
+    pci_write32(dev, reg, orig);
+
+    if (orig & PCI_BAR_IO) {
+      uint32_t mask = probe & ~3u & 0xFFFF;
+      dev->bar_io |= (uint8_t)(1u << i);
+      dev->bar[i] = orig & ~3u;
+      dev->bar_size[i] = mask ? (~mask & 0xFFFF) + 1 : 0;
+      continue;
+    }
+
+    uint32_t mask = probe & ~0xFu;
+    dev->bar[i] = orig & ~0xFu;
+    dev->bar_size[i] = mask ? ~mask + 1 : 0;
+    if ((orig & PCI_BAR_MEM_TYPE_MASK) == PCI_BAR_MEM_TYPE_64 &&
+        i + 1 < PCI_BARS) {
+      // the next BAR holds the upper half; the kernel only maps below 4 GiB
+      if (pci_read32(dev, (uint8_t)(reg + 4)) != 0)
+        dev->bar_size[i] = 0;
+      i++;
+    }
+  }
+
+  pci_write32(dev, PCI_COMMAND, cmd);
+  i686_irq_restore(flags);
+}
+
+static void add_function(uint8_t bus, uint8_t slot, uint8_t func) {
+  if (device_count >= PCI_MAX_DEVICES)
+    return;
+  pci_device_t *dev = &devices[device_count++];
+  uint32_t id = config_read32(bus, slot, func, PCI_VENDOR_ID);
+  uint32_t class_rev = config_read32(bus, slot, func, PCI_REVISION);
+  uint32_t misc = config_read32(bus, slot, func, 0x0C);
+  uint32_t intr = config_read32(bus, slot, func, PCI_INTERRUPT_LINE);
+
+  *dev = (pci_device_t){0};
+  dev->bus = bus;
+  dev->slot = slot;
+  dev->func = func;
+  dev->vendor_id = (uint16_t)id;
+  dev->device_id = (uint16_t)(id >> 16);
+  dev->revision = (uint8_t)class_rev;
+  dev->prog_if = (uint8_t)(class_rev >> 8);
+  dev->subclass = (uint8_t)(class_rev >> 16);
+  dev->class_code = (uint8_t)(class_rev >> 24);
+  dev->header_type = (uint8_t)(misc >> 16);
+  dev->irq_line = (uint8_t)intr;
+  dev->irq_pin = (uint8_t)(intr >> 8);
+
+  // only plain endpoints (header type 0) have six BARs
+  if ((dev->header_type & 0x7F) == 0)
+    probe_bars(dev);
+}
+
+size_t pci_init(void) {
+  device_count = 0;
+  // brute force: every bus/slot, so bridges need no special handling
+  for (uint32_t bus = 0; bus < 256; bus++) {
+    for (uint8_t slot = 0; slot < 32; slot++) {
+      if ((uint16_t)config_read32((uint8_t)bus, slot, 0, PCI_VENDOR_ID) ==
+          0xFFFF)
+        continue;
+      uint8_t header =
+          (uint8_t)(config_read32((uint8_t)bus, slot, 0, 0x0C) >> 16);
+      uint8_t funcs = (header & 0x80) ? 8 : 1; // multi-function device
+      for (uint8_t func = 0; func < funcs; func++)
+        if ((uint16_t)config_read32((uint8_t)bus, slot, func,
+                                    PCI_VENDOR_ID) != 0xFFFF)
+          add_function((uint8_t)bus, slot, func);
+    }
+  }
+  printf("PCI: %u function(s)\n", (uint32_t)device_count);
+  return device_count;
+}
+
+size_t pci_device_count(void) { return device_count; }
+
+const pci_device_t *pci_device_at(size_t index) {
+  return index < device_count ? &devices[index] : NULL;
+}
+
+static size_t next_index(const pci_device_t *from) {
+  return from ? (size_t)(from - devices) + 1 : 0;
+}
+
+const pci_device_t *pci_find_class(uint8_t class_code, uint8_t subclass,
+                                   const pci_device_t *from) {
+  for (size_t i = next_index(from); i < device_count; i++)
+    if (devices[i].class_code == class_code && devices[i].subclass == subclass)
+      return &devices[i];
+  return NULL;
+}
+
+const pci_device_t *pci_find_id(uint16_t vendor_id, uint16_t device_id,
+                                const pci_device_t *from) {
+  for (size_t i = next_index(from); i < device_count; i++)
+    if (devices[i].vendor_id == vendor_id &&
+        devices[i].device_id == device_id)
+      return &devices[i];
+  return NULL;
+}
+
+const char *pci_class_name(uint8_t class_code, uint8_t subclass) {
+  static const struct {
+    uint8_t class_code, subclass;
+    const char *name;
+  } names[] = {
+      {0x01, 0x01, "IDE controller"},
+      {0x01, 0x05, "ATA controller"},
+      {0x01, 0x06, "SATA controller"},
+      {0x01, 0x08, "NVMe controller"},
+      {0x02, 0x00, "Ethernet controller"},
+      {0x03, 0x00, "VGA controller"},
+      {0x04, 0x01, "Audio device"},
+      {0x04, 0x03, "Audio device"},
+      {0x06, 0x00, "Host bridge"},
+      {0x06, 0x01, "ISA bridge"},
+      {0x06, 0x04, "PCI bridge"},
+      {0x06, 0x80, "Bridge"},
+      {0x0C, 0x03, "USB controller"},
+      {0x0C, 0x05, "SMBus"},
+  };
+  static const char *const classes[] = {
+      "Unclassified",  "Mass storage", "Network",     "Display",
+      "Multimedia",    "Memory",       "Bridge",      "Communication",
+      "System",        "Input",        "Docking",     "Processor",
+      "Serial bus",    "Wireless",     "Intelligent", "Satellite",
+      "Encryption",    "Signal processing",
+  };
+  for (size_t i = 0; i < SIZE(names); i++)
+    if (names[i].class_code == class_code && names[i].subclass == subclass)
+      return names[i].name;
+  if (class_code < SIZE(classes))
+    return classes[class_code];
+  return "Unknown";
+}
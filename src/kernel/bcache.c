@@ -0,0 +1,513 @@
+#include "kernel/bcache.h"
+
+#include <arch/i686/io.h>
+#include <kernel/clocksource.h>
+#include <kernel/kmalloc.h>
+#include <kernel/timer.h>
+#include <kernel/wait.h>
+#include <stddef.h>
+#include <string.h>
+
+#define BCACHE_HASH_SIZE 128 // buckets, power of two
+// Dirty data reaches the disk at most this long after it was written
+#define BCACHE_WRITEBACK_NS (5 * NSEC_PER_SEC)
+
+static buffer_t buffers[BCACHE_NR_BUFFERS];
+static buffer_t *hash_table[BCACHE_HASH_SIZE];
+static buffer_t *lru_head = NULL;
+static buffer_t *lru_tail = NULL;
+static bcache_stats_t stats;
+static wait_queue_t bcache_wait = WAIT_QUEUE_INIT;
+static ktimer_t writeback_timer;
+
+// Sequential stream detection, one per device
+typedef struct {
+  blkdev_t *dev;
+  uint64_t next;   // block a sequential read starts at (or just before)
+  uint64_t ra_end; // first block not prefetched yet
+  uint32_t window; // blocks, 0 = readahead off
+} bcache_ra_t;
+
+static bcache_ra_t ra_state[BLK_MAX_DEVICES];
+
+/* ---------- Hash and LRU lists (callers hold interrupts off) ---------- */
+
+static unsigned bcache_hash(const blkdev_t *dev, uint64_t block) {
+  uint32_t h = ((uint32_t)block ^ (uint32_t)(block >> 32)) * 2654435761u;
+  h ^= (uint32_t)(uintptr_t)dev >> 4;
+  return (h ^ (h >> 16)) & (BCACHE_HASH_SIZE - 1);
+}
+
+static buffer_t *bcache_lookup(const blkdev_t *dev, uint64_t block) {
+  buffer_t *b = hash_table[bcache_hash(dev, block)];
+  while (b && (b->dev != dev || b->block != block))
+    b = b->hash_next;
+  return b;
+}
+
+static void hash_insert(buffer_t *b) {
+  buffer_t **bucket = &hash_table[bcache_hash(b->dev, b->block)];
+  b->hash_next = *bucket;
+  *bucket = b;
+}
+
+/* No-op for a buffer that is not hashed (its read failed) */
+static void hash_remove(buffer_t *b) {
+  buffer_t **link = &hash_table[bcache_hash(b->dev, b->block)];
+  while (*link && *link != b)
+    link = &(*link)->hash_next;
+  if (*link)
+    *link = b->hash_next;
+  b->hash_next = NULL;
+}
+
+static void lru_unlink(buffer_t *b) {
+  if (b->lru_prev)
+    b->lru_prev->lru_next = b->lru_next;
+  else
+    lru_head = b->lru_next;
+  if (b->lru_next)
+    b->lru_next->lru_prev = b->lru_prev;
+  else
+    lru_tail = b->lru_prev;
+}
+
+static void lru_push_front(buffer_t *b) {
+  b->lru_prev = NULL;
+  b->lru_next = lru_head;
+  if (lru_head)
+    lru_head->lru_prev = b;
+  else
+    lru_tail = b;
+  lru_head = b;
+}
+
+/* Least recently used buffer that can be recycled right away */
+static buffer_t *bcache_victim(void) {
+  for (buffer_t *b = lru_tail; b; b = b->lru_prev)
+    if (!b->refcount && !b->busy && !b->dirty)
+      return b;
+  return NULL;
+}
+
+/* ---------- I/O ---------- */
+
+static void bcache_read_end_io(bio_t *bio) {
+  buffer_t *b = bio->private;
+  uint32_t flags = i686_irq_save();
+  b->error = bio->error;
+  b->valid = !bio->error;
+  if (bio->error && b->readahead) {
+    // nobody asked for it: a real read retries and reports the error
+    hash_remove(b);
+    b->readahead = false;
+  }
+  b->busy = false;
+  i686_irq_restore(flags);
+  wake_up(&bcache_wait);
+}
+
+static void bcache_write_end_io(bio_t *bio) {
+  buffer_t *b = bio->private;
+  uint32_t flags = i686_irq_save();
+  b->error = bio->error;
+  if (bio->error) {
+    stats.write_errors++; // stays dirty: the next write-back retries
+  } else {
+    b->dirty = false;
+    stats.dirty--;
+    stats.writebacks++;
+  }
+  b->busy = false;
+  i686_irq_restore(flags);
+  wake_up(&bcache_wait);
+}
+
+static void bcache_prepare_bio(buffer_t *b, uint8_t op) {
+  b->bio = (bio_t){.dev = b->dev,
+                   .sector = b->block * BCACHE_BLOCK_SECTORS,
+                   .count = b->sectors,
+                   .buf = b->data,
+                   .op = op,
+                   .end_io = op == BIO_READ ? bcache_read_end_io
+                                            : bcache_write_end_io,
+                   .private = b};
+}
+
+/* Submit writes for the dirty, idle buffers of dev (NULL: all devices);
+ * held buffers only if asked to. The block queue merges neighbours. */
+static void bcache_start_writeback(blkdev_t *dev, bool held) {
+  buffer_t *batch = NULL;
+  uint32_t flags = i686_irq_save();
+  for (int i = 0; i < BCACHE_NR_BUFFERS; i++) {
+    buffer_t *b = &buffers[i];
+    if (!b->dirty || b->busy || (dev && b->dev != dev) ||
+        (b->refcount && !held))
+      continue;
+    b->busy = true;
+    bcache_prepare_bio(b, BIO_WRITE);
+    b->wb_next = batch;
+    batch = b;
+  }
+  i686_irq_restore(flags);
+
+  while (batch) {
+    buffer_t *next = batch->wb_next;
+    submit_bio(&batch->bio);
+    batch = next;
+  }
+}
+
+/* Timer (tasklet context): write back what nobody holds, come back while
+ * anything stays dirty */
+static void bcache_writeback_timer(void *data) {
+  (void)data;
+  bcache_start_writeback(NULL, false);
+  if (stats.dirty)
+    timer_add(&writeback_timer, ktime_get_ns() + BCACHE_WRITEBACK_NS,
+              bcache_writeback_timer, NULL);
+}
+
+static bool bcache_writeback_busy(const blkdev_t *dev) {
+  for (int i = 0; i < BCACHE_NR_BUFFERS; i++)
+    if (buffers[i].busy && buffers[i].dirty &&
+        (!dev || buffers[i].dev == dev))
+      return true;
+  return false;
+}
+
+/* Write back the dirty buffers of dev (NULL: all) and wait for them */
+static int bcache_writeback_wait(blkdev_t *dev) {
+  bcache_start_writeback(dev, true);
+  // also waits for write-backs the timer started
+  wait_event(&bcache_wait, !bcache_writeback_busy(dev));
+  for (int i = 0; i < BCACHE_NR_BUFFERS; i++)
+    if (buffers[i].dirty && (!dev || buffers[i].dev == dev))
+      return buffers[i].error ? buffers[i].error : BLK_EIO;
+  return BLK_OK;
+}
+
+/* Recycle the victim b for block of dev (interrupts off) */
+static void bcache_assign(buffer_t *b, blkdev_t *dev, uint64_t block) {
+  if (b->dev) {
+    hash_remove(b);
+    if (b->valid)
+      stats.evictions++;
+    if (b->readahead)
+      stats.ra_wasted++;
+  }
+  uint64_t first = block * BCACHE_BLOCK_SECTORS;
+  b->dev = dev;
+  b->block = block;
+  b->sectors = dev->sectors - first < BCACHE_BLOCK_SECTORS
+                   ? (uint32_t)(dev->sectors - first)
+                   : BCACHE_BLOCK_SECTORS;
+  b->valid = false;
+  b->dirty = false;
+  b->readahead = false;
+  b->fetched = false;
+  b->error = BLK_OK;
+  hash_insert(b);
+  lru_unlink(b);
+  lru_push_front(b);
+}
+
+/* ---------- Readahead ---------- */
+
+static uint64_t bcache_nr_blocks(const blkdev_t *dev) {
+  return (dev->sectors + BCACHE_BLOCK_SECTORS - 1) / BCACHE_BLOCK_SECTORS;
+}
+
+/* Start reads for the uncached blocks of [block, block + count) and return
+ * at once; stops early when no buffer is free without a write-back.
+ * readahead: nobody asked for them yet; otherwise bcache_read is about to. */
+static void bcache_prefetch(blkdev_t *dev, uint64_t block, uint32_t count,
+                            bool readahead) {
+  buffer_t *batch = NULL;
+  uint32_t flags = i686_irq_save();
+  for (uint64_t end = block + count; block < end; block++) {
+    if (bcache_lookup(dev, block))
+      continue;
+    buffer_t *b = bcache_victim();
+    if (!b)
+      break;
+    bcache_assign(b, dev, block);
+    b->readahead = readahead;
+    b->fetched = !readahead;
+    b->busy = true;
+    bcache_prepare_bio(b, BIO_READ);
+    if (readahead)
+      stats.ra_blocks++;
+    b->wb_next = batch;
+    batch = b;
+  }
+  i686_irq_restore(flags);
+
+  // lowest block first: each bio back-merges into the request before it
+  buffer_t *order = NULL;
+  while (batch) {
+    buffer_t *next = batch->wb_next;
+    batch->wb_next = order;
+    order = batch;
+    batch = next;
+  }
+  while (order) {
+    buffer_t *next = order->wb_next;
+    submit_bio(&order->bio);
+    order = next;
+  }
+}
+
+static bcache_ra_t *bcache_ra_state(blkdev_t *dev) {
+  for (int i = 0; i < BLK_MAX_DEVICES; i++) {
+    if (ra_state[i].dev == dev)
+      return &ra_state[i];
+    if (!ra_state[i].dev) {
+      ra_state[i].dev = dev; // next = 0: reading from the start counts
+      return &ra_state[i];
+    }
+  }
+  return NULL;
+}
+
+/* A read of blocks [first, last] is about to start */
+static void bcache_readahead(blkdev_t *dev, uint64_t first, uint64_t last) {
+  bcache_ra_t *ra = bcache_ra_state(dev);
+  if (!ra)
+    return;
+  // the previous read may have ended inside the block this one starts in
+  bool sequential = first == ra->next || first + 1 == ra->next;
+  ra->next = last + 1;
+  if (!sequential) {
+    if (ra->window)
+      stats.ra_resets++;
+    ra->window = 0;
+    return;
+  }
+  if (!ra->window) {
+    ra->window = BCACHE_RA_MIN;
+    ra->ra_end = last + 1;
+  }
+  if (ra->ra_end <= last)
+    ra->ra_end = last + 1; // the reader overtook the prefetch
+
+  // Keep at least half a window ahead of the reader: when less is left,
+  // prefetch the next window and make the one after it twice as large
+  if (ra->ra_end - (last + 1) > ra->window / 2)
+    return;
+  uint64_t nr_blocks = bcache_nr_blocks(dev);
+  if (ra->ra_end >= nr_blocks)
+    return;
+  uint32_t count = ra->window;
+  if (count > nr_blocks - ra->ra_end)
+    count = (uint32_t)(nr_blocks - ra->ra_end);
+  bcache_prefetch(dev, ra->ra_end, count, true);
+  ra->ra_end += count;
+  if (ra->window < BCACHE_RA_MAX)
+    ra->window *= 2;
+}
+
+/* ---------- API ---------- */
+
+void bcache_init(void) {
+  // Page-aligned data: one PRD entry per block when it is contiguous
+  uint8_t *data = kmalloc(BCACHE_NR_BUFFERS * BCACHE_BLOCK_SIZE + 0xFFF);
+  if (!data)
+    return;
+  data = (uint8_t *)(((uintptr_t)data + 0xFFF) & ~(uintptr_t)0xFFF);
+  for (int i = 0; i < BCACHE_NR_BUFFERS; i++) {
+    buffers[i].data = data + i * BCACHE_BLOCK_SIZE;
+    lru_push_front(&buffers[i]);
+  }
+}
+
+/* Reference the buffer of a block; fill = read it unless cached */
+static int bcache_getblk(blkdev_t *dev, uint64_t block, bool fill,
+                         buffer_t **out) {
+  if (!lru_head)
+    return BLK_ENOMEM; // bcache_init failed
+  if (block >= bcache_nr_blocks(dev))
+    return BLK_ERANGE;
+
+  uint32_t flags;
+  buffer_t *b;
+  for (int tries = 0;; tries++) {
+    flags = i686_irq_save();
+    if ((b = bcache_lookup(dev, block))) {
+      if (b->fetched) {
+        b->fetched = false;
+        stats.misses++; // read for this lookup a moment ago
+      } else {
+        stats.hits++;
+      }
+      if (b->readahead) {
+        b->readahead = false;
+        stats.ra_hits++;
+      }
+      b->refcount++;
+      lru_unlink(b);
+      lru_push_front(b);
+      i686_irq_restore(flags);
+      wait_event(&bcache_wait, !b->busy); // a read or write-back
+      if (!b->valid && (fill || b->error)) {
+        int err = b->error ? b->error : BLK_EIO; // the read we waited for
+        flags = i686_irq_save();
+        hash_remove(b); // the next lookup reads again
+        i686_irq_restore(flags);
+        bcache_put(b);
+        return err;
+      }
+      *out = b;
+      return BLK_OK;
+    }
+    if ((b = bcache_victim()))
+      break;
+    i686_irq_restore(flags);
+    if (tries)
+      return BLK_ENOMEM; // everything is held
+    bcache_writeback_wait(NULL); // make the dirty buffers clean, retry
+  }
+
+  stats.misses++;
+  bcache_assign(b, dev, block);
+  b->refcount = 1;
+  b->busy = fill;
+  if (fill)
+    bcache_prepare_bio(b, BIO_READ);
+  i686_irq_restore(flags);
+
+  if (fill) {
+    submit_bio(&b->bio);
+    wait_event(&bcache_wait, !b->busy);
+    if (!b->valid) {
+      int err = b->error;
+      flags = i686_irq_save();
+      hash_remove(b); // don't hand out a buffer that never got data
+      i686_irq_restore(flags);
+      bcache_put(b);
+      return err;
+    }
+  }
+  *out = b;
+  return BLK_OK;
+}
+
+int bcache_get(blkdev_t *dev, uint64_t block, buffer_t **out) {
+  return bcache_getblk(dev, block, true, out);
+}
+
+void bcache_mark_dirty(buffer_t *b) {
+  uint32_t flags = i686_irq_save();
+  b->valid = true;
+  if (!b->dirty) {
+    b->dirty = true;
+    stats.dirty++;
+  }
+  if (!timer_pending(&writeback_timer))
+    timer_add(&writeback_timer, ktime_get_ns() + BCACHE_WRITEBACK_NS,
+              bcache_writeback_timer, NULL);
+  i686_irq_restore(flags);
+}
+
+void bcache_put(buffer_t *b) {
+  uint32_t flags = i686_irq_save();
+  b->refcount--;
+  i686_irq_restore(flags);
+}
+
+int bcache_read(blkdev_t *dev, uint64_t sector, uint32_t count, void *buf) {
+  uint8_t *out = buf;
+  uint64_t last = count ? (sector + count - 1) / BCACHE_BLOCK_SECTORS : 0;
+  uint64_t fetched_end = 0; // blocks before it have their reads started
+  while (count) {
+    uint64_t block = sector / BCACHE_BLOCK_SECTORS;
+    uint32_t offset = (uint32_t)(sector % BCACHE_BLOCK_SECTORS);
+    uint32_t n = BCACHE_BLOCK_SECTORS - offset;
+    if (n > count)
+      n = count;
+
+    // The blocks asked for go out first, up to a readahead window at a
+    // time in one batch, so they neither queue behind the prefetch nor
+    // wait for the disk one block at a time
+    if (block >= fetched_end && lru_head && block < bcache_nr_blocks(dev)) {
+      uint64_t left = last + 1 - block;
+      uint32_t batch = left < BCACHE_RA_MAX ? (uint32_t)left : BCACHE_RA_MAX;
+      bcache_prefetch(dev, block, batch, false);
+      if (!fetched_end)
+        bcache_readahead(dev, block, last);
+      fetched_end = block + batch;
+    }
+
+    buffer_t *b;
+    int err = bcache_get(dev, block, &b);
+    if (err)
+      return err;
+    if (offset + n > b->sectors) {
+      bcache_put(b);
+      return BLK_ERANGE;
+    }
+    memcpy(out, b->data + offset * BLK_SECTOR_SIZE, n * BLK_SECTOR_SIZE);
+    bcache_put(b);
+
+    out += n * BLK_SECTOR_SIZE;
+    sector += n;
+    count -= n;
+  }
+  return BLK_OK;
+}
+
+int bcache_write(blkdev_t *dev, uint64_t sector, uint32_t count,
+                 const void *buf) {
+  const uint8_t *in = buf;
+  if (sector >= dev->sectors || count > dev->sectors - sector)
+    return BLK_ERANGE;
+  while (count) {
+    uint64_t block = sector / BCACHE_BLOCK_SECTORS;
+    uint32_t offset = (uint32_t)(sector % BCACHE_BLOCK_SECTORS);
+    uint32_t n = BCACHE_BLOCK_SECTORS - offset;
+    if (n > count)
+      n = count;
+    uint64_t left = dev->sectors - block * BCACHE_BLOCK_SECTORS;
+    // a block that is overwritten whole needn't be read first
+    bool whole = offset == 0 && (n == BCACHE_BLOCK_SECTORS || n >= left);
+
+    buffer_t *b;
+    int err = bcache_getblk(dev, block, !whole, &b);
+    if (err)
+      return err;
+    memcpy(b->data + offset * BLK_SECTOR_SIZE, in, n * BLK_SECTOR_SIZE);
+    bcache_mark_dirty(b);
+    bcache_put(b);
+
+    in += n * BLK_SECTOR_SIZE;
+    sector += n;
+    count -= n;
+  }
+  return BLK_OK;
+}
+
+int bcache_sync(blkdev_t *dev) {
+  int err = bcache_writeback_wait(dev);
+  if (err)
+    return err;
+  // the writes completed into the drive caches: get them onto the media
+  for (unsigned i = 0; i < blk_count(); i++) {
+    blkdev_t *d = blk_get(i);
+    if (dev && d != dev)
+      continue;
+    int e = blk_flush(d);
+    if (e && !err)
+      err = e;
+  }
+  return err;
+}
+
+void bcache_get_stats(bcache_stats_t *out) {
+  uint32_t flags = i686_irq_save();
+  *out = stats;
+  out->in_use = 0;
+  for (int i = 0; i < BCACHE_NR_BUFFERS; i++)
+    if (buffers[i].refcount)
+      out->in_use++;
+  i686_irq_restore(flags);
+}
@@ -0,0 +1,405 @@
+#include "kernel/blk.h"
+
+#include <arch/i686/io.h>
+#include <kernel/clocksource.h>
+#include <kernel/wait.h>
+#include <stddef.h>
+#include <string.h>
+
+// Deadline-style expiry: reads are waited on, writes usually are not
+#define BLK_READ_EXPIRE_NS (NSEC_PER_SEC / 2)
+#define BLK_WRITE_EXPIRE_NS (5 * NSEC_PER_SEC)
+
+static blkdev_t *devices[BLK_MAX_DEVICES];
+static unsigned device_count = 0;
+static wait_queue_t blk_wait = WAIT_QUEUE_INIT;
+
+void blk_register(blkdev_t *dev) {
+  if (device_count == BLK_MAX_DEVICES)
+    return;
+  dev->queue = NULL;
+  dev->flushes = dev->flushes_tail = NULL;
+  dev->free = NULL;
+  for (int i = BLK_NR_REQUESTS - 1; i >= 0; i--) {
+    dev->pool[i].next = dev->free;
+    dev->free = &dev->pool[i];
+  }
+  dev->backlog = dev->backlog_tail = NULL;
+  dev->inflight = 0;
+  dev->head = 0;
+  dev->epoch = 0;
+  dev->write_cache = BLK_WC_WRITEBACK;
+  dev->unflushed = false;
+  dev->last_error = BLK_OK;
+  memset(&dev->stats, 0, sizeof dev->stats);
+  if (!dev->depth)
+    dev->depth = 1;
+  devices[device_count++] = dev;
+}
+
+unsigned blk_count(void) { return device_count; }
+
+blkdev_t *blk_get(unsigned index) {
+  return index < device_count ? devices[index] : NULL;
+}
+
+blkdev_t *blk_find(const char *name) {
+  for (unsigned i = 0; i < device_count; i++)
+    if (strcmp(devices[i]->name, name) == 0)
+      return devices[i];
+  return NULL;
+}
+
+/* ---------- Queue (callers hold interrupts off) ---------- */
+
+/* Requests only merge within one epoch: a bio queued after a flush must
+ * not ride along with a request that may pass it */
+static bool blk_can_merge(const blkdev_t *dev, const blk_request_t *rq,
+                          uint8_t op, uint8_t flags, uint32_t epoch,
+                          uint32_t count, uint16_t nbios) {
+  return rq->op == op && rq->flags == flags && rq->epoch == epoch &&
+         rq->count + count <= dev->max_sectors &&
+         rq->nbios + nbios <= dev->max_segments;
+}
+
+/* Append next's bios to rq when they became adjacent */
+static void blk_coalesce(blkdev_t *dev, blk_request_t *rq) {
+  blk_request_t *next = rq->next;
+  if (!next || rq->sector + rq->count != next->sector ||
+      !blk_can_merge(dev, rq, next->op, next->flags, next->epoch,
+                     next->count, next->nbios))
+    return;
+  rq->tail->next = next->bios;
+  rq->tail = next->tail;
+  rq->count += next->count;
+  rq->nbios += next->nbios;
+  if (next->deadline < rq->deadline)
+    rq->deadline = next->deadline;
+  rq->next = next->next;
+  next->next = dev->free;
+  dev->free = next;
+}
+
+/* A flush waits in its own list; the requests queued so far carry an epoch
+ * that lets them pass it */
+static bool blk_enqueue_flush(blkdev_t *dev, bio_t *bio) {
+  blk_request_t *rq = dev->free;
+  if (!rq)
+    return false;
+  dev->free = rq->next;
+  bio->next = NULL;
+  *rq = (blk_request_t){.bios = bio,
+                        .tail = bio,
+                        .nbios = 1,
+                        .op = BIO_FLUSH,
+                        .epoch = dev->epoch++};
+  if (dev->flushes_tail)
+    dev->flushes_tail->next = rq;
+  else
+    dev->flushes = rq;
+  dev->flushes_tail = rq;
+  return true;
+}
+
+/* Merge bio into a waiting request or queue a new one; false if there is
+ * no free request slot */
+static bool blk_enqueue(blkdev_t *dev, bio_t *bio) {
+  if (bio->op == BIO_FLUSH)
+    return blk_enqueue_flush(dev, bio);
+  blk_request_t *prev = NULL, *rq = dev->queue;
+  for (; rq && rq->sector <= bio->sector; prev = rq, rq = rq->next)
+    ;
+  // prev ends at or before bio, rq starts after it
+  if (prev && prev->sector + prev->count == bio->sector &&
+      blk_can_merge(dev, prev, bio->op, bio->flags, dev->epoch, bio->count,
+                    1)) {
+    bio->next = NULL;
+    prev->tail->next = bio;
+    prev->tail = bio;
+    prev->count += bio->count;
+    prev->nbios++;
+    dev->stats.merges++;
+    blk_coalesce(dev, prev);
+    return true;
+  }
+  if (rq && bio->sector + bio->count == rq->sector &&
+      blk_can_merge(dev, rq, bio->op, bio->flags, dev->epoch, bio->count,
+                    1)) {
+    bio->next = rq->bios;
+    rq->bios = bio;
+    rq->sector = bio->sector;
+    rq->count += bio->count;
+    rq->nbios++;
+    dev->stats.merges++;
+    if (prev)
+      blk_coalesce(dev, prev);
+    return true;
+  }
+
+  blk_request_t *new_rq = dev->free;
+  if (!new_rq)
+    return false;
+  dev->free = new_rq->next;
+  bio->next = NULL;
+  new_rq->bios = new_rq->tail = bio;
+  new_rq->sector = bio->sector;
+  new_rq->count = bio->count;
+  new_rq->nbios = 1;
+  new_rq->op = bio->op;
+  new_rq->flags = bio->flags;
+  new_rq->epoch = dev->epoch;
+  new_rq->deadline =
+      ktime_get_ns() +
+      (bio->op == BIO_READ ? BLK_READ_EXPIRE_NS : BLK_WRITE_EXPIRE_NS);
+  new_rq->next = rq;
+  if (prev)
+    prev->next = new_rq;
+  else
+    dev->queue = new_rq;
+  return true;
+}
+
+/* C-LOOK: the first request at or past the head, wrapping to the lowest
+ * sector; an expired request preempts the sweep. Only requests queued
+ * before the oldest waiting flush qualify; once they have all completed,
+ * the flush goes. NULL: nothing can go now. */
+static blk_request_t *blk_pick(blkdev_t *dev) {
+  blk_request_t *flush = dev->flushes;
+  blk_request_t *first = NULL, *pick = NULL, *oldest = NULL;
+  for (blk_request_t *rq = dev->queue; rq; rq = rq->next) {
+    if (flush && rq->epoch > flush->epoch)
+      continue;
+    if (!first)
+      first = rq;
+    if (!oldest || rq->deadline < oldest->deadline)
+      oldest = rq;
+    if (!pick && rq->sector >= dev->head)
+      pick = rq;
+  }
+  if (!first)
+    return flush && !dev->inflight ? flush : NULL;
+  if (oldest->deadline <= ktime_get_ns()) {
+    if (oldest != (pick ? pick : first))
+      dev->stats.expired++;
+    return oldest;
+  }
+  return pick ? pick : first;
+}
+
+static void blk_unlink(blkdev_t *dev, blk_request_t *rq) {
+  if (rq->op == BIO_FLUSH) { // always the oldest
+    dev->flushes = rq->next;
+    if (!dev->flushes)
+      dev->flushes_tail = NULL;
+    rq->next = NULL;
+    return;
+  }
+  blk_request_t **link = &dev->queue;
+  while (*link != rq)
+    link = &(*link)->next;
+  *link = rq->next;
+  rq->next = NULL;
+}
+
+/* Put a request the driver refused back in sector order */
+static void blk_requeue(blkdev_t *dev, blk_request_t *rq) {
+  if (rq->op == BIO_FLUSH) {
+    rq->next = dev->flushes;
+    dev->flushes = rq;
+    if (!dev->flushes_tail)
+      dev->flushes_tail = rq;
+    return;
+  }
+  blk_request_t **link = &dev->queue;
+  while (*link && (*link)->sector <= rq->sector)
+    link = &(*link)->next;
+  rq->next = *link;
+  *link = rq;
+}
+
+/* ---------- Submission and completion ---------- */
+
+static void blk_finish_request(blkdev_t *dev, blk_request_t *rq, int error);
+
+static void bio_complete(bio_t *bio, int error) {
+  bio->error = error;
+  if (bio->end_io)
+    bio->end_io(bio);
+}
+
+void submit_bio(bio_t *bio) {
+  blkdev_t *dev = bio->dev;
+  if (bio->op == BIO_FLUSH) {
+    if (bio->count) {
+      bio_complete(bio, BLK_EINVAL);
+      return;
+    }
+  } else if (bio->count == 0) {
+    bio_complete(bio, BLK_EINVAL);
+    return;
+  } else if (bio->sector >= dev->sectors ||
+             bio->count > dev->sectors - bio->sector) {
+    bio_complete(bio, BLK_ERANGE);
+    return;
+  }
+  if (bio->op != BIO_WRITE || !(dev->features & BLK_FEAT_WCACHE))
+    bio->flags &= ~BIO_FUA; // nothing to write through
+  else if (dev->write_cache == BLK_WC_WRITETHROUGH)
+    bio->flags |= BIO_FUA;
+
+  uint32_t flags = i686_irq_save();
+  dev->stats.bios++;
+  if (dev->backlog || !blk_enqueue(dev, bio)) {
+    // out of request slots: keep submission order until some free up
+    bio->next = NULL;
+    if (dev->backlog_tail)
+      dev->backlog_tail->next = bio;
+    else
+      dev->backlog = bio;
+    dev->backlog_tail = bio;
+  }
+  i686_irq_restore(flags);
+  blk_run_queue(dev);
+}
+
+void blk_run_queue(blkdev_t *dev) {
+  for (;;) {
+    uint32_t flags = i686_irq_save();
+    if (dev->inflight >= dev->depth || (!dev->queue && !dev->flushes)) {
+      i686_irq_restore(flags);
+      return;
+    }
+    blk_request_t *rq = blk_pick(dev);
+    if (!rq) {
+      i686_irq_restore(flags); // a flush waits for the requests in flight
+      return;
+    }
+    uint64_t head = dev->head;
+    bool unflushed = dev->unflushed;
+    blk_unlink(dev, rq);
+    dev->inflight++;
+    if (rq->op == BIO_FLUSH && !unflushed) {
+      i686_irq_restore(flags);
+      blk_finish_request(dev, rq, BLK_OK); // the device has nothing cached
+      continue;
+    }
+    // before start(): the request may complete before it returns
+    if (rq->op == BIO_FLUSH) {
+      dev->unflushed = false;
+      dev->stats.flushes++;
+    } else {
+      dev->head = rq->sector + rq->count;
+      if (rq->flags & BIO_FUA)
+        dev->stats.fua++;
+    }
+    dev->stats.requests++;
+    i686_irq_restore(flags);
+
+    if (!dev->ops->start(dev, rq)) {
+      flags = i686_irq_save();
+      dev->inflight--;
+      dev->head = head;
+      dev->unflushed = unflushed;
+      dev->stats.requests--;
+      if (rq->op == BIO_FLUSH)
+        dev->stats.flushes--;
+      else if (rq->flags & BIO_FUA)
+        dev->stats.fua--;
+      blk_requeue(dev, rq);
+      i686_irq_restore(flags);
+      return;
+    }
+  }
+}
+
+/* Free rq's slot and complete its bios */
+static void blk_finish_request(blkdev_t *dev, blk_request_t *rq, int error) {
+  uint32_t flags = i686_irq_save();
+  bio_t *bio = rq->bios;
+  dev->inflight--;
+  if (error) {
+    dev->last_error = error;
+    dev->stats.errors++;
+    if (rq->op == BIO_FLUSH)
+      dev->unflushed = true; // whatever it covered may still be cached
+  } else if (rq->op != BIO_FLUSH) {
+    dev->stats.sectors[rq->op] += rq->count;
+  }
+  if (!error && rq->op == BIO_WRITE && !(rq->flags & BIO_FUA) &&
+      (dev->features & BLK_FEAT_WCACHE))
+    dev->unflushed = true;
+  rq->next = dev->free;
+  dev->free = rq;
+  // the freed slot goes to the oldest backlogged bios first
+  while (dev->backlog && dev->free) {
+    bio_t *b = dev->backlog;
+    dev->backlog = b->next;
+    if (!dev->backlog)
+      dev->backlog_tail = NULL;
+    blk_enqueue(dev, b);
+  }
+  i686_irq_restore(flags);
+
+  while (bio) {
+    bio_t *next = bio->next; // end_io may reuse the bio
+    bio_complete(bio, error);
+    bio = next;
+  }
+}
+
+void blk_end_request(blkdev_t *dev, blk_request_t *rq, int error) {
+  blk_finish_request(dev, rq, error);
+  blk_run_queue(dev);
+}
+
+/* ---------- Synchronous helpers ---------- */
+
+static void blk_wait_end_io(bio_t *bio) {
+  *(volatile bool *)bio->private = true;
+  wake_up(&blk_wait);
+}
+
+/* Also flushes (op BIO_FLUSH, count 0) */
+static int blk_rw(blkdev_t *dev, uint8_t op, uint64_t sector, uint32_t count,
+                  void *buf) {
+  volatile bool done = false;
+  bio_t bio = {.dev = dev,
+               .sector = sector,
+               .count = count,
+               .buf = buf,
+               .op = op,
+               .end_io = blk_wait_end_io,
+               .private = (void *)&done};
+  submit_bio(&bio);
+  wait_event(&blk_wait, done);
+  return bio.error;
+}
+
+int blk_read(blkdev_t *dev, uint64_t sector, uint32_t count, void *buf) {
+  return blk_rw(dev, BIO_READ, sector, count, buf);
+}
+
+int blk_write(blkdev_t *dev, uint64_t sector, uint32_t count,
+              const void *buf) {
+  return blk_rw(dev, BIO_WRITE, sector, count, (void *)buf);
+}
+
+int blk_flush(blkdev_t *dev) { return blk_rw(dev, BIO_FLUSH, 0, 0, NULL); }
+
+void blk_set_write_cache(blkdev_t *dev, uint8_t policy) {
+  uint8_t old = dev->write_cache;
+  dev->write_cache = policy;
+  // earlier writes must not stay behind in the cache either
+  if (policy == BLK_WC_WRITETHROUGH && old != policy)
+    blk_flush(dev);
+}
+
+const char *blk_strerror(int error) {
+  static const char *const names[] = {"ok",           "I/O error",
+                                      "timed out",    "out of range",
+                                      "read-only medium", "invalid request",
+                                      "out of buffers"};
+  if (error < 0 || error >= (int)(sizeof names / sizeof names[0]))
+    return "unknown error";
+  return names[error];
+}
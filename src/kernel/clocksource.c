@@ -0,0 +1,121 @@
+#include "kernel/clocksource.h"
+
+#include <arch/i686/io.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Longest stretch between timekeeping_tick() calls we must survive; bounds
+// the cycle delta that (delta * mult) may see.
+#define TK_MAX_INTERVAL_SEC 10
+
+static clocksource *sources = NULL;
+
+/* Timekeeper: readers retry while seq is odd or changed under them. Writers
+ * run with interrupts off, so a reader can never spin on a stalled writer. */
+static struct {
+  volatile uint32_t seq;
+  const clocksource *cs;
+  uint64_t cycle_last; // counter value at the last fold
+  uint64_t ns_base;    // ns at cycle_last
+  uint64_t ns_frac;    // sub-ns remainder at cycle_last, << shift
+  uint32_t mult;
+  uint32_t shift;
+} tk;
+
+void clocks_calc_mult_shift(uint32_t *mult, uint32_t *shift, uint64_t from,
+                            uint64_t to, uint32_t maxsec) {
+  // Find how many bits (delta) may take so that delta * mult fits in 64
+  uint32_t sftacc = 32;
+  uint64_t tmp = ((uint64_t)maxsec * from) >> 32;
+  while (tmp) {
+    tmp >>= 1;
+    sftacc--;
+  }
+
+  // Largest shift (most precision) whose mult still fits in sftacc bits
+  uint32_t sft;
+  for (sft = 32; sft > 0; sft--) {
+    tmp = (to << sft) + from / 2;
+    tmp /= from;
+    if ((tmp >> sftacc) == 0)
+      break;
+  }
+  *mult = (uint32_t)tmp;
+  *shift = sft;
+}
+
+static inline void tk_write_begin(void) {
+  tk.seq++;
+  __asm__ volatile("" ::: "memory");
+}
+
+static inline void tk_write_end(void) {
+  __asm__ volatile("" ::: "memory");
+  tk.seq++;
+}
+
+static inline uint64_t tk_delta_ns(uint64_t now) {
+  uint64_t delta = (now - tk.cycle_last) & tk.cs->mask;
+  return (delta * tk.mult + tk.ns_frac) >> tk.shift;
+}
+
+static void tk_install(const clocksource *cs) {
+  uint32_t flags = i686_irq_save();
+  tk_write_begin();
+  if (tk.cs) // carry the time over so ktime stays monotonic
+    tk.ns_base += tk_delta_ns(tk.cs->read());
+  tk.ns_frac = 0;
+  tk.cs = cs;
+  clocks_calc_mult_shift(&tk.mult, &tk.shift, cs->freq_hz, NSEC_PER_SEC,
+                         TK_MAX_INTERVAL_SEC);
+  tk.cycle_last = cs->read();
+  tk_write_end();
+  i686_irq_restore(flags);
+}
+
+void clocksource_register(clocksource *cs) {
+  if (!cs || !cs->read || !cs->freq_hz)
+    return;
+  cs->next = sources;
+  sources = cs;
+
+  if (!tk.cs || cs->rating > tk.cs->rating) {
+    tk_install(cs);
+    printf("clocksource: %s, %u kHz\n", cs->name,
+           (uint32_t)(cs->freq_hz / 1000));
+  }
+}
+
+const char *clocksource_current(void) { return tk.cs ? tk.cs->name : "none"; }
+
+bool clocksource_available(void) { return tk.cs != NULL; }
+
+uint64_t ktime_get_ns(void) {
+  uint32_t seq;
+  uint64_t ns;
+  do {
+    seq = tk.seq;
+    __asm__ volatile("" ::: "memory");
+    if (!tk.cs)
+      return 0;
+    ns = tk.ns_base + tk_delta_ns(tk.cs->read());
+    __asm__ volatile("" ::: "memory");
+  } while ((seq & 1) || seq != tk.seq);
+  return ns;
+}
+
+void timekeeping_tick(void) {
+  if (!tk.cs)
+    return;
+  uint32_t flags = i686_irq_save();
+  tk_write_begin();
+  uint64_t now = tk.cs->read();
+  uint64_t delta = (now - tk.cycle_last) & tk.cs->mask;
+  // keep the sub-ns remainder so rounding never accumulates
+  uint64_t scaled = delta * tk.mult + tk.ns_frac;
+  tk.ns_base += scaled >> tk.shift;
+  tk.ns_frac = scaled & (((uint64_t)1 << tk.shift) - 1);
+  tk.cycle_last = now;
+  tk_write_end();
+  i686_irq_restore(flags);
+}
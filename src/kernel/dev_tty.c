@@ -1,46 +1,181 @@
 #include "kernel/dev_tty.h"
 
 #include <kernel/tty.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
-#include "arch/i686/drivers/keyboard.h"
+#include "arch/i686/drivers/uart16550.h"
 #include "arch/i686/io.h"
 #include "kernel/fd.h"
+#include "kernel/wait.h"
+
+/* ===== Shared input ring (keyboard + serial RX) ===== */
+#define TTY_INPUT_SIZE 256
+static volatile char input_buf[TTY_INPUT_SIZE];
+static volatile unsigned int input_head = 0; // written by IRQ handlers
+static volatile unsigned int input_tail = 0; // read by tty_read
+
+static wait_queue_t input_wait = WAIT_QUEUE_INIT;
+
+static bool serial_mirror = false; // copy VGA console output to ttyS0
+
+/* ===== Line discipline ===== */
+#define TTY_LINE_MAX 256
+static unsigned int tty_mode = TTY_ICANON | TTY_ECHO;
+static char line_buf[TTY_LINE_MAX];
+static size_t line_len = 0;   // bytes collected (canonical) or buffered (raw)
+static size_t line_pos = 0;   // next byte handed to read()
+static bool line_ready = false;
+
+/* Where echo goes: the output side of the device being read */
+typedef struct {
+  long (*echo)(void *priv, const void *buf, size_t n);
+} tty_port_t;
+
+void tty_input_char(char c) {
+  // fed by the keyboard tasklet and the UART IRQ, which may preempt it
+  uint32_t flags = i686_irq_save();
+  unsigned int next = (input_head + 1) & (TTY_INPUT_SIZE - 1);
+  if (next != input_tail) { // full: drop
+    input_buf[input_head] = c;
+    input_head = next;
+    wake_up(&input_wait);
+  }
+  i686_irq_restore(flags);
+}
+
+static int tty_input_getchar(void) {
+  if (input_head == input_tail)
+    return -1;
+  char c = input_buf[input_tail];
+  input_tail = (input_tail + 1) & (TTY_INPUT_SIZE - 1);
+  return (unsigned char)c;
+}
+
+/* Write to the UART translating \n to \r\n for terminal emulators */
+static void serial_put(const char *p, size_t n) {
+  size_t start = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (p[i] == '\n') {
+      uart16550_write(p + start, i - start);
+      uart16550_write("\r\n", 2);
+      start = i + 1;
+    }
+  }
+  uart16550_write(p + start, n - start);
+}
 
 static long tty_write(void *priv, const void *buf, size_t n) {
   (void)priv;
   const char *p = (const char *)buf;
   for (size_t i = 0; i < n; i++)
     _putc(p[i]);
+  if (serial_mirror)
+    serial_put(p, n);
   return (long)n;
 }
+static void ldisc_echo(const tty_port_t *port, const char *p, size_t n) {
+  if ((tty_mode & TTY_ECHO) && port && port->echo)
+    port->echo(NULL, p, n);
+}
+
+/* Feed one input byte to the line discipline (reader context) */
+static void ldisc_input(const tty_port_t *port, char c) {
+  if (!(tty_mode & TTY_ICANON)) {
+    if (line_len < TTY_LINE_MAX) {
+      line_buf[line_len++] = c;
+      ldisc_echo(port, &c, 1);
+    }
+    line_ready = true;
+    return;
+  }
+
+  if (c == '\b') {
+    if (line_len) {
+      line_len--;
+      ldisc_echo(port, "\b \b", 3);
+    }
+  } else if (c == 0x15) { // ^U: kill line
+    while (line_len) {
+      line_len--;
+      ldisc_echo(port, "\b \b", 3);
+    }
+  } else if (c == '\n') {
+    line_buf[line_len++] = c; // one slot is always kept free for this
+    ldisc_echo(port, &c, 1);
+    line_ready = true;
+  } else if (line_len + 1 < TTY_LINE_MAX) {
+    line_buf[line_len++] = c;
+    ldisc_echo(port, &c, 1);
+  }
+}
+
+/* Blocks until a full line (canonical) or at least one byte (raw) */
 static long tty_read(void *priv, void *buf, size_t n) {
-  char *out = (char *)buf;
-  size_t got = 0;
-  while (got < n) {
-    int c = keyboard_getchar();
-    if (c < 0)
-      break; // make read() non-blocking for now
-    out[got++] = (char)c;
+  const tty_port_t *port = (const tty_port_t *)priv;
+  if (n == 0)
+    return 0;
+
+  while (!line_ready) {
+    int c = tty_input_getchar();
+    if (c >= 0) {
+      ldisc_input(port, (char)c);
+      continue;
+    }
+    terminal_flush(); // show pending output/echo before sleeping
+    wait_event(&input_wait, input_head != input_tail);
+  }
+
+  size_t got = line_len - line_pos;
+  if (got > n)
+    got = n;
+  memcpy(buf, line_buf + line_pos, got);
+  line_pos += got;
+  if (line_pos == line_len) {
+    line_len = line_pos = 0;
+    line_ready = false;
   }
   return (long)got;
-  return -1;
+}
+
+void tty_set_mode(unsigned int mode) {
+  tty_mode = mode;
+  if (!(mode & TTY_ICANON) && line_len)
+    line_ready = true; // hand over whatever was typed so far
+}
+
+unsigned int tty_get_mode(void) { return tty_mode; }
+
+static long serial_write(void *priv, const void *buf, size_t n) {
+  (void)priv;
+  serial_put((const char *)buf, n);
+  return (long)n;
 }
 static int tty_close(void *priv) {
   (void)priv;
   return 0;
 }
 
+static const tty_port_t CONSOLE_PORT = {.echo = tty_write};
+static const tty_port_t SERIAL_PORT = {.echo = serial_write};
+
 static const file_ops_t TTY_IN_OPS = {
     .read = tty_read, .write = NULL, .seek = NULL, .close = tty_close};
 static const file_ops_t TTY_OUT_OPS = {
     .read = NULL, .write = tty_write, .seek = NULL, .close = tty_close};
+static const file_ops_t TTYS_OPS = {
+    .read = tty_read, .write = serial_write, .seek = NULL, .close = tty_close};
 
 int dev_tty_install_std(void) {
-  static file_t tty_in = {
-      .ops = &TTY_IN_OPS, .priv = NULL, .flags = 0, .pos = 0, .refcnt = 0};
+  static file_t tty_in = {.ops = &TTY_IN_OPS,
+                          .priv = (void *)&CONSOLE_PORT,
+                          .flags = 0,
+                          .pos = 0,
+                          .refcnt = 0};
   static file_t tty_out = {
       .ops = &TTY_OUT_OPS, .priv = NULL, .flags = 0, .pos = 0, .refcnt = 0};
 
@@ -56,3 +191,28 @@ int dev_tty_install_std(void) {
   (void)fd2;
   return 0;
 }
+
+int dev_tty_install_serial(bool primary) {
+  static file_t ttys0 = {.ops = &TTYS_OPS,
+                         .priv = (void *)&SERIAL_PORT,
+                         .flags = 0,
+                         .pos = 0,
+                         .refcnt = 0};
+
+  if (!uart16550_present())
+    return -1;
+
+  int fd = fd_install(&ttys0);
+  if (fd < 0)
+    return -1;
+
+  if (primary) {
+    // headless: stdin/stdout/stderr all go through the serial line
+    dup2(fd, STDIN_FILENO);
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+  } else {
+    serial_mirror = true; // serial log of everything on the screen
+  }
+  return fd;
+}
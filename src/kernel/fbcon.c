@@ -0,0 +1,248 @@
+#include "kernel/fbcon.h"
+
+#include <arch/i686/memory.h>
+#include <kernel/font8x8.h>
+#include <kernel/kmalloc.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+enum { COLS = 80, ROWS = 25, CELL_W = 8, CELL_H = 16 };
+#define TEXT_W (COLS * CELL_W) // pixels
+#define TEXT_H (ROWS * CELL_H)
+
+// ----- Glyph cache -----
+// Direct-mapped cache of fully rasterized cells keyed by (char | attr << 8).
+// With one or two colors in use every printable glyph gets its own slot, so
+// drawing a cell is 16 row copies with no per-pixel font decoding.
+#define GLYPH_CACHE_SLOTS 256
+
+typedef struct {
+  uint16_t cell;
+  bool valid;
+  uint32_t px[CELL_H][CELL_W];
+} glyph_t;
+
+// ----- Framebuffer / shadow state -----
+static uint8_t *fb;       // mapped linear framebuffer
+static uint32_t fb_pitch; // bytes per scanline
+static uint32_t *shadow;  // TEXT_W x TEXT_H RAM copy of the text area
+static glyph_t *glyph_cache;
+static uint16_t shown[ROWS * COLS]; // cell currently rasterized in shadow
+static uint32_t palette[16];
+
+// Dirty rectangle in pixels: [x0,x1) x [y0,y1); empty when x0 >= x1
+static uint32_t dirty_x0 = TEXT_W, dirty_y0 = TEXT_H, dirty_x1, dirty_y1;
+
+// Cursor: requested position and whether it is currently drawn in shadow
+static size_t cursor_x, cursor_y;
+static bool cursor_visible, cursor_drawn;
+
+static const uint8_t vga_rgb[16][3] = {
+    {0, 0, 0},       {0, 0, 170},     {0, 170, 0},     {0, 170, 170},
+    {170, 0, 0},     {170, 0, 170},   {170, 85, 0},    {170, 170, 170},
+    {85, 85, 85},    {85, 85, 255},   {85, 255, 85},   {85, 255, 255},
+    {255, 85, 85},   {255, 85, 255},  {255, 255, 85},  {255, 255, 255},
+};
+
+static uint32_t pack_channel(uint8_t v, uint8_t pos, uint8_t size) {
+  if (size == 0)
+    return 0;
+  if (size > 8)
+    size = 8;
+  return (uint32_t)(v >> (8 - size)) << pos;
+}
+
+static void mark_dirty(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1) {
+  if (x0 < dirty_x0)
+    dirty_x0 = x0;
+  if (y0 < dirty_y0)
+    dirty_y0 = y0;
+  if (x1 > dirty_x1)
+    dirty_x1 = x1;
+  if (y1 > dirty_y1)
+    dirty_y1 = y1;
+}
+
+/* ---------- Glyphs ---------- */
+static const glyph_t *glyph_lookup(uint16_t cell) {
+  uint8_t ch = (uint8_t)(cell & 0xFF);
+  uint8_t attr = (uint8_t)(cell >> 8);
+  glyph_t *g = &glyph_cache[(ch ^ (attr * 37u)) & (GLYPH_CACHE_SLOTS - 1)];
+  if (g->valid && g->cell == cell)
+    return g;
+
+  // miss: rasterize the 8x8 font doubled vertically into the 8x16 cell
+  uint32_t fg = palette[attr & 0x0F];
+  uint32_t bg = palette[(attr >> 4) & 0x0F];
+  for (size_t y = 0; y < CELL_H; y++) {
+    uint8_t bits = (ch < 128) ? font8x8_basic[ch][y / 2] : 0;
+    for (size_t x = 0; x < CELL_W; x++)
+      g->px[y][x] = (bits & (1u << x)) ? fg : bg;
+  }
+  g->cell = cell;
+  g->valid = true;
+  return g;
+}
+
+static void draw_cell(size_t col, size_t row, uint16_t cell) {
+  const glyph_t *g = glyph_lookup(cell);
+  uint32_t *dst = &shadow[(row * CELL_H) * TEXT_W + col * CELL_W];
+  for (size_t y = 0; y < CELL_H; y++, dst += TEXT_W)
+    memcpy(dst, g->px[y], sizeof g->px[y]);
+
+  shown[row * COLS + col] = cell;
+  if (cursor_drawn && col == cursor_x && row == cursor_y)
+    cursor_drawn = false; // glyph overwrote the underline
+  mark_dirty(col * CELL_W, row * CELL_H, (col + 1) * CELL_W,
+             (row + 1) * CELL_H);
+}
+
+/* ---------- Cursor (underline in the cell's foreground color) ---------- */
+static void cursor_erase(void) {
+  if (!cursor_drawn)
+    return;
+  cursor_drawn = false;
+  draw_cell(cursor_x, cursor_y, shown[cursor_y * COLS + cursor_x]);
+}
+
+static void cursor_draw(void) {
+  if (!cursor_visible || cursor_drawn)
+    return;
+  uint8_t attr = (uint8_t)(shown[cursor_y * COLS + cursor_x] >> 8);
+  uint32_t fg = palette[attr & 0x0F];
+  for (size_t y = CELL_H - 2; y < CELL_H; y++) {
+    uint32_t *dst = &shadow[(cursor_y * CELL_H + y) * TEXT_W + cursor_x * CELL_W];
+    for (size_t x = 0; x < CELL_W; x++)
+      dst[x] = fg;
+  }
+  cursor_drawn = true;
+  mark_dirty(cursor_x * CELL_W, cursor_y * CELL_H, (cursor_x + 1) * CELL_W,
+             (cursor_y + 1) * CELL_H);
+}
+
+/* ---------- console_driver ops ---------- */
+static void fbcon_draw_row(size_t row, const uint16_t *cells, size_t cols) {
+  if (row >= ROWS)
+    return;
+  if (cols > COLS)
+    cols = COLS;
+  for (size_t x = 0; x < cols; x++)
+    if (shown[row * COLS + x] != cells[x])
+      draw_cell(x, row, cells[x]);
+}
+
+static void fbcon_scroll(size_t rows) {
+  if (rows == 0)
+    return;
+  if (rows > ROWS)
+    rows = ROWS;
+  cursor_erase();
+
+  // Shift the shadow up; exposed rows become cell 0 (blank, black), which is
+  // exactly what zeroed pixels represent, so the diff in draw_row stays valid.
+  size_t keep = ROWS - rows;
+  memmove(shadow, &shadow[rows * CELL_H * TEXT_W],
+          keep * CELL_H * TEXT_W * sizeof(uint32_t));
+  memset(&shadow[keep * CELL_H * TEXT_W], 0,
+         rows * CELL_H * TEXT_W * sizeof(uint32_t));
+  memmove(shown, &shown[rows * COLS], keep * COLS * sizeof(uint16_t));
+  memset(&shown[keep * COLS], 0, rows * COLS * sizeof(uint16_t));
+
+  mark_dirty(0, 0, TEXT_W, TEXT_H);
+}
+
+static void fbcon_set_cursor(size_t x, size_t y, bool visible) {
+  if (x >= COLS)
+    x = COLS - 1;
+  if (y >= ROWS)
+    y = ROWS - 1;
+  if (x != cursor_x || y != cursor_y || !visible)
+    cursor_erase();
+  cursor_x = x;
+  cursor_y = y;
+  cursor_visible = visible;
+}
+
+static void fbcon_present(void) {
+  cursor_draw();
+  if (dirty_x0 >= dirty_x1 || dirty_y0 >= dirty_y1)
+    return;
+
+  size_t bytes = (dirty_x1 - dirty_x0) * sizeof(uint32_t);
+  for (uint32_t y = dirty_y0; y < dirty_y1; y++)
+    memcpy(fb + y * fb_pitch + dirty_x0 * sizeof(uint32_t),
+           &shadow[y * TEXT_W + dirty_x0], bytes);
+
+  dirty_x0 = TEXT_W;
+  dirty_y0 = TEXT_H;
+  dirty_x1 = 0;
+  dirty_y1 = 0;
+}
+
+static const console_driver driver = {
+    .name = "framebuffer",
+    .draw_row = &fbcon_draw_row,
+    .scroll = &fbcon_scroll,
+    .set_cursor = &fbcon_set_cursor,
+    .present = &fbcon_present,
+};
+
+const console_driver *fbcon_get_driver(void) { return &driver; }
+
+/* ---------- Setup ---------- */
+bool fbcon_init(const struct mb2_info_fixed *info) {
+  uint64_t phys;
+  uint32_t pitch, w, h;
+  uint8_t bpp, type;
+  if (!mb2_get_framebuffer(info, &phys, &pitch, &w, &h, &bpp, &type))
+    return false;
+  if (type != MB2_FB_TYPE_RGB || bpp != 32 || w < TEXT_W || h < TEXT_H ||
+      phys + (uint64_t)pitch * h > 0x100000000ull) {
+    printf("fbcon: unsupported framebuffer %ux%ux%u type %u\n", w, h, bpp,
+           type);
+    return false;
+  }
+
+  const struct mb2_tag *tag = mb2_find_tag(info, MB2_TAG_FRAMEBUFFER);
+  const struct mb2_fb_rgb_info *ci =
+      (const struct mb2_fb_rgb_info *)((const uint8_t *)tag +
+                                       sizeof(struct mb2_tag_framebuffer));
+  for (int i = 0; i < 16; i++)
+    palette[i] =
+        pack_channel(vga_rgb[i][0], ci->red_field_position,
+                     ci->red_mask_size) |
+        pack_channel(vga_rgb[i][1], ci->green_field_position,
+                     ci->green_mask_size) |
+        pack_channel(vga_rgb[i][2], ci->blue_field_position,
+                     ci->blue_mask_size);
+
+  shadow = kmalloc(TEXT_W * TEXT_H * sizeof(uint32_t));
+  glyph_cache = kmalloc(GLYPH_CACHE_SLOTS * sizeof(glyph_t));
+  if (!shadow || !glyph_cache) {
+    printf("fbcon: out of memory for shadow buffer\n");
+    kfree(shadow);
+    kfree(glyph_cache);
+    return false;
+  }
+
+  fb = mem_map_mmio((uint32_t)phys, pitch * h, PAGE_FLAG_WRITE);
+  if (!fb) {
+    printf("fbcon: failed to map framebuffer at 0x%X\n", (uint32_t)phys);
+    kfree(shadow);
+    kfree(glyph_cache);
+    return false;
+  }
+  fb_pitch = pitch;
+
+  memset(glyph_cache, 0, GLYPH_CACHE_SLOTS * sizeof(glyph_t));
+  memset(shadow, 0, TEXT_W * TEXT_H * sizeof(uint32_t));
+  memset(shown, 0, sizeof shown);
+  for (uint32_t y = 0; y < h; y++) // clear borders outside the text area too
+    memset(fb + y * pitch, 0, w * sizeof(uint32_t));
+
+  printf("fbcon: %ux%u framebuffer at 0x%X\n", w, h, (uint32_t)phys);
+  return true;
+}
@@ -2,7 +2,7 @@
 
 #include <stddef.h>
 
-static file_t *g_fds[MAX_FD];
+file_t *g_fds[MAX_FD]; // shared with dup()/dup2() in libk
 
 int fd_install(file_t *f) {
     for (int i = 0; i < MAX_FD; i++) {
@@ -1,22 +1,35 @@
 #include "kernel/kinit.h"
 
-#include <arch/i686/cpu_brand.h>        // cpu_get_brand_string
-#include <arch/i686/drivers/ide.h>      // ide_init
-#include <arch/i686/drivers/keyboard.h> // keyboard_init
-#include <arch/i686/gdt.h>              // i686_init_gdt
-#include <arch/i686/idt.h>              // i686_init_idt
-#include <arch/i686/irq.h>              // i686_init_irq
-#include <arch/i686/isr.h>              // i686_init_isr
-#include <arch/i686/memory.h>           // KERNEL_START, i686_init_memory
+#include <arch/i686/acpi.h>              // acpi_init
+#include <arch/i686/cpu_brand.h>         // cpu_get_brand_string
+#include <arch/i686/drivers/acpi_pm.h>   // acpi_pm_init
+#include <arch/i686/drivers/ahci.h>      // ahci_init_pci
+#include <arch/i686/drivers/apic.h>      // lapic_timer_init
+#include <arch/i686/drivers/hpet.h>      // hpet_init
+#include <arch/i686/drivers/ide.h>       // ide_init_pci, ide_get_blkdev
+#include <arch/i686/drivers/keyboard.h>  // keyboard_init
+#include <arch/i686/drivers/pit.h>       // pit_init
+#include <arch/i686/drivers/tsc.h>       // tsc_init
+#include <arch/i686/drivers/uart16550.h> // uart16550_init
+#include <arch/i686/gdt.h>               // i686_init_gdt
+#include <arch/i686/idt.h>               // i686_init_idt
+#include <arch/i686/irq.h>               // i686_init_irq
+#include <arch/i686/isr.h>               // i686_init_isr
+#include <arch/i686/memory.h>            // KERNEL_START, i686_init_memory
 #include <arch/i686/multiboot.h> // MB2_BOOTLOADER_MAGIC, mb2_info_fixed, mb2_mem_top_bytes
+#include <arch/i686/pci.h>       // pci_init
 #include <arch/i686/pmm_stats.h> // pmm_get_stats
+#include <kernel/bcache.h>       // bcache_init
+#include <kernel/blk.h>          // blk_read
 #include <kernel/dev_tty.h>      // dev_tty_install_std
+#include <kernel/fbcon.h>        // fbcon_init, fbcon_get_driver
 #include <kernel/kmalloc.h>      // kmalloc_init
-#include <kernel/sleep.h>        // init_sleep
+#include <kernel/timer.h>        // timer_init
 #include <kernel/tty.h>          // terminal_*()
 #include <kernel/vga.h>          // VGA_COLOR_*
 #include <stdint.h>              // uint32_t, uintptr_t
 #include <stdio.h>               // printf
+#include <string.h>              // strstr
 
 #define PHYS_TO_VIRT(p) ((void *)((uintptr_t)(p) + KERNEL_START))
 #define ALIGN_UP(x, a) (((x) + ((a) - 1)) & ~((a) - 1))
@@ -28,14 +41,27 @@ void init(uint32_t magic, void *boot_info_phys, uint32_t *mem_high_bytes,
   terminal_set_color(VGA_COLOR_LIGHT_GREEN, VGA_COLOR_BLACK);
   printf("----- Zircon OS v0.0.1 (Kernel) -----\n");
 
-  // Early CPU/IDT/IRQ init
+  // Early CPU/IDT init; interrupts stay off until the controller is picked
+  // (the APIC needs ACPI, which needs paging), so early drivers poll
   i686_init_gdt();
   i686_init_idt();
   i686_init_isr();
-  i686_init_irq();
   keyboard_init();
-  init_sleep();
-  printf("Early CPU/IDT/IRQ init done.\n");
+  pit_init();
+  printf("Early CPU/IDT init done.\n");
+
+  // COM1: serial log of the console, or the console itself with
+  // "console=ttyS0" on the kernel command line (headless boxes)
+  const char *cmdline =
+      (magic == MB2_BOOTLOADER_MAGIC)
+          ? mb2_get_cmdline(
+                (const struct mb2_info_fixed *)PHYS_TO_VIRT(boot_info_phys))
+          : "";
+  if (uart16550_init(COM1_PORT, COM1_IRQ, 115200)) {
+    bool serial_primary = strstr(cmdline, "console=ttyS0") != NULL;
+    dev_tty_install_serial(serial_primary);
+    printf("COM1: 16550 UART%s\n", serial_primary ? " (console)" : "");
+  }
 
   // --- Work out top-of-RAM (bytes) and first free physical byte ---
   *mem_high_bytes = 0x00100000u; // safe default = 1 MiB
@@ -64,20 +90,39 @@ void init(uint32_t magic, void *boot_info_phys, uint32_t *mem_high_bytes,
 
   kmalloc_init(16 * 1024); // 16 KiB
 
-  ide_init(0x1F0, 0x3F6, 0x170, 0x376, 0x000); // IDE
+  // Switch to the linear framebuffer console if GRUB set a graphics mode;
+  // everything printed so far is repainted from scrollback.
+  if (magic == MB2_BOOTLOADER_MAGIC &&
+      fbcon_init((const struct mb2_info_fixed *)PHYS_TO_VIRT(boot_info_phys)))
+    terminal_set_console(fbcon_get_driver());
 
-  // read mbr on first disk
+  // Clocksources: the TSC if it is invariant, else HPET, else the PM timer
+  acpi_init(magic == MB2_BOOTLOADER_MAGIC
+                ? (const struct mb2_info_fixed *)PHYS_TO_VIRT(boot_info_phys)
+                : NULL);
+  tsc_init();
+  hpet_init();
+  acpi_pm_init();
 
-#define KDATA_SEL 0x10 // your kernel data selector
-  static uint8_t mbr[512] __attribute__((aligned(2)));
+  // Interrupt controller: APIC when the MADT describes one, else the 8259
+  i686_init_irq();
+  lapic_timer_init();
+  timer_init(); // one-shot from here on: no interrupts while nothing is due
 
-  ide_read_sectors(/*drive*/ 0, /*numsects*/ 1, /*lba*/ 0,
-                   /*es*/ KDATA_SEL, /*edi*/ (uint32_t)mbr);
+  pci_init();
+  ide_init_pci(); // IDE
+  ahci_init_pci(); // SATA
+  bcache_init();
 
-  if (package[0] != 0) {
-    printf("IDE read error: %u\n", package[0]);
-  } else {
-    printf("MBR sig: 0x%X%X\n", mbr[511], mbr[510]); // expect 55 AA
+  // read mbr on first disk
+  static uint8_t mbr[512] __attribute__((aligned(2)));
+  blkdev_t *disk = ide_get_blkdev(0);
+  if (disk) {
+    int err = blk_read(disk, 0, 1, mbr);
+    if (err)
+      printf("%s: MBR read failed: %s\n", disk->name, blk_strerror(err));
+    else
+      printf("MBR sig: 0x%X%X\n", mbr[511], mbr[510]); // expect 55 AA
   }
 
   // CPU brand
@@ -1,27 +1,229 @@
 #include "kernel/shell.h"
 
-#include <arch/i686/cpu_brand.h>   // cpu_get_brand_string (used by "info")
-#include <arch/i686/drivers/ide.h> // ide_devices, ide_read_sectors
-#include <arch/i686/io.h>          // inb/outb
-#include <arch/i686/memory.h>      // dump_physical_memory_bitmap
-#include <arch/i686/pmm_stats.h>   // pmm_get_stats
-#include <kernel/kmalloc.h>        // kmalloc/kfree
-#include <kernel/sleep.h>          // sleep
-#include <kernel/tty.h>            // terminal_*()
-#include <kernel/vga.h>            // VGA_COLOR_*
-#include <stdint.h>                // uint32_t
-#include <stdio.h>                 // printf
-#include <stdlib.h>                // strtoul
-#include <string.h>                // strtok, strcmp, memset, strlen
-#include <unistd.h>                // read
-#include <util/hex.h>              // hexdump
-
-#ifndef KERNEL_DATA_SEL
-#define KERNEL_DATA_SEL 0x10 // typical GDT data selector
-#endif
-
-// from IDE driver (used to retrieve last error)
-extern unsigned char package[2];
+#include <arch/i686/cpu_brand.h>        // cpu_get_brand_string (used by "info")
+#include <arch/i686/drivers/ahci.h>     // ahci_disk_info, ahci_get_stats
+#include <arch/i686/drivers/ide.h>      // ide_devices, ide_get_blkdev
+#include <arch/i686/drivers/keyboard.h> // keyboard_get_stats
+#include <arch/i686/io.h>               // inb/outb
+#include <arch/i686/irq.h>              // i686_irq_benchmark
+#include <arch/i686/irqstat.h>          // irqstat_get, irqstat_reset
+#include <arch/i686/memory.h>           // dump_physical_memory_bitmap
+#include <arch/i686/pci.h>              // pci_device_at, pci_class_name
+#include <arch/i686/pmm_stats.h>        // pmm_get_stats
+#include <kernel/bcache.h>              // bcache_read, bcache_sync
+#include <kernel/blk.h>                 // blk_read, submit_bio, blk_get
+#include <kernel/clocksource.h>         // ktime_get_ns, clocksource_current
+#include <kernel/kmalloc.h>             // kmalloc/kfree
+#include <kernel/sleep.h>               // sleep
+#include <kernel/tty.h>                 // terminal_*()
+#include <kernel/vga.h>                 // VGA_COLOR_*
+#include <kernel/wait.h>                // wait_idle_cycles
+#include <stdint.h>                     // uint32_t
+#include <stdio.h>                      // printf
+#include <stdlib.h>                     // strtoul
+#include <string.h>                     // strtok, strcmp, memset, strlen
+#include <unistd.h>                     // read
+#include <util/hex.h>                   // hexdump
+
+#define BENCH_CHUNK_SECTORS 2048 // 1 MiB per request
+#define BENCH_BIO_SECTORS 8      // 4 KiB bios for the queued pass
+
+/* A disk argument: an IDE drive number or a block device name (sd0) */
+static blkdev_t *dsk_find(const char *arg) {
+  if (!arg)
+    return NULL;
+  if (arg[0] < '0' || arg[0] > '9')
+    return blk_find(arg);
+  unsigned long drive = strtoul(arg, NULL, 0);
+  return drive > 3 ? NULL : ide_get_blkdev((unsigned char)drive);
+}
+
+static void dsk_bench_report(const char *label, uint32_t sectors, uint64_t ns,
+                             uint64_t cycles, uint64_t idle) {
+  if (ns == 0 || cycles == 0)
+    ns = cycles = 1;
+  printf("%s: %u KiB in %u ms, %u KiB/s, CPU busy %u%%\n", label,
+         sectors / 2, (uint32_t)(ns / 1000000),
+         (uint32_t)((uint64_t)sectors * 512 / 1024 * 1000000000ull / ns),
+         (uint32_t)(100 - idle * 100 / cycles));
+}
+
+/* One sequential read pass over [0, sectors) for "dsk bench" */
+static void dsk_bench_pass(const char *label, blkdev_t *dev,
+                           uint32_t sectors, void *buf) {
+  uint64_t t0 = ktime_get_ns();
+  uint64_t c0 = i686_rdtsc();
+  uint64_t idle0 = wait_idle_cycles;
+  int err = BLK_OK;
+
+  for (uint32_t lba = 0; lba < sectors && !err; lba += BENCH_CHUNK_SECTORS) {
+    uint32_t n = sectors - lba;
+    if (n > BENCH_CHUNK_SECTORS)
+      n = BENCH_CHUNK_SECTORS;
+    err = blk_read(dev, lba, n, buf);
+  }
+
+  if (err) {
+    printf("%s: %s\n", label, blk_strerror(err));
+    return;
+  }
+  dsk_bench_report(label, sectors, ktime_get_ns() - t0, i686_rdtsc() - c0,
+                   wait_idle_cycles - idle0);
+}
+
+/* The same pass as 4 KiB reads through the buffer cache and its
+ * readahead */
+static void dsk_bench_cached(blkdev_t *dev, uint32_t sectors, void *buf) {
+  bcache_stats_t st0, st;
+  bcache_get_stats(&st0);
+  uint64_t t0 = ktime_get_ns();
+  uint64_t c0 = i686_rdtsc();
+  uint64_t idle0 = wait_idle_cycles;
+  int err = BLK_OK;
+
+  for (uint32_t lba = 0; lba < sectors && !err; lba += BENCH_BIO_SECTORS) {
+    uint32_t n = sectors - lba;
+    if (n > BENCH_BIO_SECTORS)
+      n = BENCH_BIO_SECTORS;
+    err = bcache_read(dev, lba, n, buf);
+  }
+
+  if (err) {
+    printf("cached: %s\n", blk_strerror(err));
+    return;
+  }
+  dsk_bench_report("cached 4K", sectors, ktime_get_ns() - t0,
+                   i686_rdtsc() - c0, wait_idle_cycles - idle0);
+  bcache_get_stats(&st);
+  printf("cached 4K: %u hits, %u misses, %u blocks read ahead\n",
+         (uint32_t)(st.hits - st0.hits), (uint32_t)(st.misses - st0.misses),
+         (uint32_t)(st.ra_blocks - st0.ra_blocks));
+}
+
+static wait_queue_t bench_wait = WAIT_QUEUE_INIT;
+static volatile uint32_t bench_pending;
+static volatile int bench_error;
+
+static void dsk_bench_end_io(bio_t *bio) {
+  if (bio->error)
+    bench_error = bio->error;
+  bench_pending--;
+  wake_up(&bench_wait);
+}
+
+/* The same pass as many small asynchronous bios, left to the queue to
+ * merge */
+static void dsk_bench_queued(blkdev_t *dev, uint32_t sectors, void *buf) {
+  const uint32_t nbios = BENCH_CHUNK_SECTORS / BENCH_BIO_SECTORS;
+  bio_t *bios = kmalloc(nbios * sizeof(bio_t));
+  if (!bios) {
+    printf("queued: OOM\n");
+    return;
+  }
+  uint64_t t0 = ktime_get_ns();
+  uint64_t c0 = i686_rdtsc();
+  uint64_t idle0 = wait_idle_cycles;
+  uint64_t bios0 = dev->stats.bios, requests0 = dev->stats.requests;
+
+  bench_error = BLK_OK;
+  for (uint32_t lba = 0; lba < sectors && !bench_error;
+       lba += BENCH_CHUNK_SECTORS) {
+    uint32_t n = 0;
+    for (uint32_t s = 0; s < BENCH_CHUNK_SECTORS && lba + s < sectors;
+         s += BENCH_BIO_SECTORS, n++) {
+      uint32_t count = sectors - (lba + s);
+      if (count > BENCH_BIO_SECTORS)
+        count = BENCH_BIO_SECTORS;
+      bios[n] = (bio_t){.dev = dev,
+                        .sector = lba + s,
+                        .count = count,
+                        .buf = (uint8_t *)buf + s * 512,
+                        .op = BIO_READ,
+                        .end_io = dsk_bench_end_io};
+    }
+    bench_pending = n; // before any completion can count down
+    for (uint32_t i = 0; i < n; i++)
+      submit_bio(&bios[i]);
+    wait_event(&bench_wait, bench_pending == 0);
+  }
+  kfree(bios);
+
+  if (bench_error) {
+    printf("queued: %s\n", blk_strerror(bench_error));
+    return;
+  }
+  dsk_bench_report("queued 4K", sectors, ktime_get_ns() - t0,
+                   i686_rdtsc() - c0, wait_idle_cycles - idle0);
+  printf("queued 4K: %u bios in %u requests\n",
+         (uint32_t)(dev->stats.bios - bios0),
+         (uint32_t)(dev->stats.requests - requests0));
+}
+
+/* One drive's sequential read for "dsk bench2": each chunk's end_io
+ * submits the next, so the drives proceed independently */
+typedef struct {
+  bio_t bio;
+  uint32_t sectors;
+  int error;
+  volatile bool done;
+} bench_stream_t;
+
+static void dsk_bench_stream_next(bench_stream_t *st) {
+  uint32_t lba = st->bio.sector + st->bio.count;
+  uint32_t n = st->sectors - lba;
+  if (n > BENCH_CHUNK_SECTORS)
+    n = BENCH_CHUNK_SECTORS;
+  st->bio.sector = lba;
+  st->bio.count = n;
+  submit_bio(&st->bio);
+}
+
+static void dsk_bench_stream_end_io(bio_t *bio) {
+  bench_stream_t *st = bio->private;
+  if (!bio->error && bio->sector + bio->count < st->sectors) {
+    dsk_bench_stream_next(st); // from tasklet context: never sleeps
+    return;
+  }
+  st->error = bio->error;
+  st->done = true;
+  wake_up(&bench_wait);
+}
+
+static bool dsk_bench_streams_done(bench_stream_t *st, int n) {
+  for (int i = 0; i < n; i++)
+    if (!st[i].done)
+      return false;
+  return true;
+}
+
+/* Read [0, sectors) from n drives at once; reports the aggregate rate */
+static void dsk_bench_parallel(const char *label, blkdev_t **devs, int n,
+                               uint32_t sectors, void **bufs) {
+  bench_stream_t st[2];
+  uint64_t t0 = ktime_get_ns();
+  uint64_t c0 = i686_rdtsc();
+  uint64_t idle0 = wait_idle_cycles;
+
+  for (int i = 0; i < n; i++) {
+    st[i] = (bench_stream_t){.bio = {.dev = devs[i],
+                                     .buf = bufs[i],
+                                     .op = BIO_READ,
+                                     .end_io = dsk_bench_stream_end_io,
+                                     .private = &st[i]},
+                             .sectors = sectors};
+    dsk_bench_stream_next(&st[i]);
+  }
+  wait_event(&bench_wait, dsk_bench_streams_done(st, n));
+
+  for (int i = 0; i < n; i++)
+    if (st[i].error) {
+      printf("%s: %s: %s\n", label, devs[i]->name,
+             blk_strerror(st[i].error));
+      return;
+    }
+  dsk_bench_report(label, sectors * n, ktime_get_ns() - t0,
+                   i686_rdtsc() - c0, wait_idle_cycles - idle0);
+}
 
 void analyze_cmd(char *cmd, uint32_t mem_high_bytes) {
   if (!cmd)
@@ -32,8 +234,6 @@ void analyze_cmd(char *cmd, uint32_t mem_high_bytes) {
   if (!command)
     return;
 
-  printf("\n");
-
   if (strcmp(command, "color") == 0) {
     if (!arg) {
       printf("usage: color <light_green|red|white>\n");
@@ -69,6 +269,13 @@ void analyze_cmd(char *cmd, uint32_t mem_high_bytes) {
     printf("outb <port> <value>            : write byte to I/O port\n");
     printf("info                           : print kernel/CPU/memory info\n");
     printf("dsk <cmd> <arg>                : disk commands (see dsk help)\n");
+    printf("kbd                            : keyboard queue statistics\n");
+    printf("irqbench                       : interrupt entry/exit cycles\n");
+    printf("irqstat [reset]                : per-vector interrupt counters\n");
+    printf("lspci [-v]                     : list PCI devices (-v: BARs)\n");
+    printf("sync                           : flush buffers and disks\n");
+    printf("bcache                         : buffer cache statistics\n");
+    printf("ahci                           : SATA disks and NCQ statistics\n");
     printf("help                           : this text\n");
 
   } else if (strcmp(command, "kmalloc") == 0) {
@@ -141,6 +348,100 @@ void analyze_cmd(char *cmd, uint32_t mem_high_bytes) {
       printf("CPU brand string not supported.\n");
     printf("Memory: %u/%u MiB\n", stats.used_bytes_overall / (1024 * 1024),
            stats.total_bytes_usable / (1024 * 1024));
+    printf("Clocksource: %s, uptime %llu ms\n", clocksource_current(),
+           ktime_get_ns() / 1000000);
+
+  } else if (strcmp(command, "kbd") == 0) {
+    kbd_stats_t ks;
+    keyboard_get_stats(&ks);
+    printf("events: %u dropped: %u max queue depth: %u\n", ks.events,
+           ks.dropped, ks.max_depth);
+    printf("max IRQ-to-tty latency: %llu cycles\n", ks.max_latency);
+
+  } else if (strcmp(command, "irqbench") == 0) {
+    uint32_t generic, fast;
+    i686_irq_benchmark(10000, &generic, &fast);
+    printf("generic ISR path: %u cycles, fast IRQ stub: %u cycles\n", generic,
+           fast);
+
+  } else if (strcmp(command, "irqstat") == 0) {
+    if (arg && strcmp(arg, "reset") == 0) {
+      irqstat_reset();
+      return;
+    }
+    // one line per vector that fired, then its non-empty log2 buckets
+    for (int v = 0; v < 256; v++) {
+      irqstat_t st;
+      irqstat_get(v, &st);
+      if (st.count == 0)
+        continue;
+      printf("vec 0x%X: count %u, avg %u, max %u cycles\n", v, st.count,
+             (uint32_t)(st.total_cycles / st.count), st.max_cycles);
+      printf(" ");
+      for (int b = 0; b < IRQSTAT_BUCKETS; b++)
+        if (st.hist[b])
+          printf(" 2^%d:%u", b, st.hist[b]);
+      printf("\n");
+    }
+
+  } else if (strcmp(command, "lspci") == 0) {
+    bool verbose = arg && strcmp(arg, "-v") == 0;
+    for (size_t i = 0; i < pci_device_count(); i++) {
+      const pci_device_t *d = pci_device_at(i);
+      printf("%X:%X.%u %X:%X %s (class %X.%X.%X rev %u)", d->bus, d->slot,
+             d->func, d->vendor_id, d->device_id,
+             pci_class_name(d->class_code, d->subclass), d->class_code,
+             d->subclass, d->prog_if, d->revision);
+      if (d->irq_pin)
+        printf(" IRQ %u", d->irq_line);
+      printf("\n");
+      if (!verbose)
+        continue;
+      for (int b = 0; b < PCI_BARS; b++)
+        if (d->bar_size[b])
+          printf("  BAR%d: %s 0x%X size 0x%X\n", b,
+                 (d->bar_io & (1u << b)) ? "io " : "mem", d->bar[b],
+                 d->bar_size[b]);
+    }
+
+  } else if (strcmp(command, "sync") == 0) {
+    int err = bcache_sync(NULL);
+    if (err)
+      printf("sync: %s\n", blk_strerror(err));
+
+  } else if (strcmp(command, "bcache") == 0) {
+    bcache_stats_t st;
+    bcache_get_stats(&st);
+    uint64_t lookups = st.hits + st.misses;
+    printf("buffers: %u x %u KiB, %u dirty, %u in use\n", BCACHE_NR_BUFFERS,
+           BCACHE_BLOCK_SIZE / 1024, st.dirty, st.in_use);
+    printf("hits: %llu misses: %llu (hit rate %llu%%)\n", st.hits, st.misses,
+           lookups ? st.hits * 100 / lookups : 0);
+    printf("written back: %llu evictions: %llu write errors: %llu\n",
+           st.writebacks, st.evictions, st.write_errors);
+    printf("readahead: %llu blocks, %llu used (%llu%%), %llu wasted, "
+           "%llu back-offs\n",
+           st.ra_blocks, st.ra_hits,
+           st.ra_blocks ? st.ra_hits * 100 / st.ra_blocks : 0, st.ra_wasted,
+           st.ra_resets);
+
+  } else if (strcmp(command, "ahci") == 0) {
+    ahci_disk_info_t d;
+    for (unsigned i = 0; ahci_disk_info(i, &d); i++)
+      printf("%s: port %u, %llu MiB, %s depth %u, FUA %s, cache %s - %s\n",
+             d.name, d.port, d.sectors / 2048, d.ncq ? "NCQ" : "DMA", d.depth,
+             d.fua ? "yes" : "no", d.wcache ? "on" : "off", d.model);
+    if (!ahci_disk_count()) {
+      printf("no AHCI disks\n");
+      return;
+    }
+    ahci_stats_t st;
+    ahci_get_stats(&st);
+    printf("irqs: %llu completions: %llu (%llu per irq, at most %u)\n",
+           st.irqs, st.completions, st.irqs ? st.completions / st.irqs : 0,
+           st.max_batch);
+    printf("interrupts: %s, coalescing: %s%s\n", st.msi ? "MSI" : "INTx",
+           st.coalescing ? "hardware" : "per irq", st.polled ? ", polled" : "");
 
   } else if (strcmp(command, "dsk") == 0) {
     if (!arg) {
@@ -152,12 +453,21 @@ void analyze_cmd(char *cmd, uint32_t mem_high_bytes) {
     if (strcmp(arg, "help") == 0) {
       printf("dsk list                         : list disk(s)\n");
       printf("dsk read <drive> <lba> <sectors> : read and hexdump sectors\n");
+      printf("dsk write <drive> <lba> <sectors> <byte> : fill sectors\n");
+      printf("dsk info <drive>                 : transfer modes of a drive\n");
+      printf("dsk bench <drive> [KiB]          : sequential read, DMA vs PIO\n");
+      printf("dsk bench <name> [KiB]           : same for e.g. sd0, no PIO\n");
+      printf("dsk bench2 <drive> <drive> [KiB] : both drives at once\n");
+      printf("dsk stats                        : block queue statistics\n");
+      printf("dsk cache <drive> [writeback|writethrough] : cache policy\n");
+      printf("dsk flush <drive>                : flush the drive cache\n");
+      printf("<drive> is 0..3 or, except for info, a name such as sd0\n");
 
     } else if (strcmp(arg, "list") == 0) {
       for (int i = 0; i < 4; i++) {
         if (ide_devices[i].reserved) {
           // KiB = sectors * 512 / 1024 = sectors / 2
-          printf("Drive %d: Type: %s Size: %u KiB - %s\n", i,
+          printf("Drive %d: Type: %s Size: %llu KiB - %s\n", i,
                  (const char *[]){"ATA", "ATAPI"}[ide_devices[i].type],
                  ide_devices[i].size / 2, ide_devices[i].model);
         }
@@ -173,29 +483,22 @@ void analyze_cmd(char *cmd, uint32_t mem_high_bytes) {
         return;
       }
 
-      unsigned long drive_ul = strtoul(drive_str, NULL, 0);
+      blkdev_t *dev = dsk_find(drive_str);
       unsigned long lba_ul = strtoul(lba_str, NULL, 0);
       unsigned long nsec_ul = strtoul(sec_str, NULL, 0);
 
-      if (drive_ul > 3) {
-        printf("read: drive must be 0..3\n");
-        return;
-      }
-      if (!ide_devices[drive_ul].reserved) {
-        printf("read: drive %lu not present\n", drive_ul);
-        return;
-      }
-      if (ide_devices[drive_ul].type != 0) {
-        printf("read: drive %lu is ATAPI (not ATA PIO here)\n", drive_ul);
+      if (!dev) {
+        printf("read: %s is not a disk (ATA drive 0..3 or sdN)\n",
+               drive_str);
         return;
       }
       if (nsec_ul == 0) {
         printf("read: sectors must be >= 1\n");
         return;
       }
-      if (lba_ul + nsec_ul > ide_devices[drive_ul].size) {
-        printf("read: range exceeds drive size (max LBA %u)\n",
-               ide_devices[drive_ul].size - 1);
+      if ((uint64_t)lba_ul + nsec_ul > dev->sectors) {
+        printf("read: range exceeds drive size (max LBA %llu)\n",
+               dev->sectors - 1);
         return;
       }
 
@@ -213,13 +516,9 @@ void analyze_cmd(char *cmd, uint32_t mem_high_bytes) {
         return;
       }
 
-      package[0] = 0; // clear previous error
-      ide_read_sectors((unsigned char)drive_ul, (unsigned char)nsec_ul,
-                       (unsigned int)lba_ul, KERNEL_DATA_SEL,
-                       (unsigned int)buf);
-
-      if (package[0] != 0) {
-        printf("read: IDE error %u\n", package[0]);
+      int err = bcache_read(dev, lba_ul, (uint32_t)nsec_ul, buf);
+      if (err) {
+        printf("read: %s\n", blk_strerror(err));
         kfree(buf);
         return;
       }
@@ -234,6 +533,192 @@ void analyze_cmd(char *cmd, uint32_t mem_high_bytes) {
       hexdump(buf, show, (uint32_t)(lba_ul * 512u));
 
       kfree(buf);
+    } else if (strcmp(arg, "write") == 0) {
+      // dsk write <drive> <lba> <sectors> <byte>, cached until write-back
+      char *lba_str = strtok(NULL, " \t\r\n");
+      char *sec_str = strtok(NULL, " \t\r\n");
+      char *byte_str = strtok(NULL, " \t\r\n");
+      if (!arg2 || !lba_str || !sec_str || !byte_str) {
+        printf("usage: dsk write <drive> <lba> <sectors> <byte>\n");
+        return;
+      }
+      blkdev_t *dev = dsk_find(arg2);
+      unsigned long lba_ul = strtoul(lba_str, NULL, 0);
+      unsigned long nsec_ul = strtoul(sec_str, NULL, 0);
+      if (!dev) {
+        printf("write: %s is not a disk (ATA drive 0..3 or sdN)\n", arg2);
+        return;
+      }
+      if (nsec_ul == 0 || nsec_ul > 256) {
+        printf("write: sectors must be 1..256\n");
+        return;
+      }
+
+      void *buf = kmalloc((uint32_t)nsec_ul * 512u);
+      if (!buf) {
+        printf("write: OOM\n");
+        return;
+      }
+      memset(buf, (int)strtoul(byte_str, NULL, 0), nsec_ul * 512u);
+      int err = bcache_write(dev, lba_ul, (uint32_t)nsec_ul, buf);
+      if (err)
+        printf("write: %s\n", blk_strerror(err));
+      kfree(buf);
+    } else if (strcmp(arg, "info") == 0) {
+      // dsk info <drive>
+      unsigned long drive_ul = arg2 ? strtoul(arg2, NULL, 0) : 4;
+      if (drive_ul > 3 || !ide_devices[drive_ul].reserved) {
+        printf("usage: dsk info <drive> (a present drive 0..3)\n");
+        return;
+      }
+      const ide_device_t *dev = &ide_devices[drive_ul];
+      const IDEChannelRegisters *ch = &channels[dev->channel];
+      printf("model:    %s\n", dev->model);
+      printf("location: %s %s, IRQ %u%s\n",
+             dev->channel ? "secondary" : "primary",
+             dev->drive ? "slave" : "master", ch->irq,
+             ch->irq_broken ? " (not firing, polled)" : "");
+      if (dev->type != IDE_ATA) {
+        printf("type:     ATAPI\n");
+        return;
+      }
+      printf("size:     %llu sectors, %s\n", dev->size,
+             (dev->command_sets & (1 << 26)) ? "LBA48" : "LBA28");
+      printf("PIO:      mode %u, %s-bit data port, %u sectors/DRQ\n",
+             dev->pio_mode, dev->io32 ? "32" : "16",
+             dev->multiple ? dev->multiple : 1);
+      if (!dev->dma_mode)
+        printf("DMA:      none\n");
+      else
+        printf("DMA:      %s %u\n",
+               (dev->dma_mode & ATA_XFER_UDMA) ? "UDMA" : "MWDMA",
+               dev->dma_mode & 0x07);
+      printf("cache:    %s, FUA %s\n",
+             dev->wcache ? "volatile write cache" : "none",
+             dev->fua ? "supported" : "by flushing");
+    } else if (strcmp(arg, "bench") == 0) {
+      // dsk bench <drive|name> [KiB]
+      if (!arg2) {
+        printf("usage: dsk bench <drive|name> [KiB]\n");
+        return;
+      }
+      unsigned long drive_ul = strtoul(arg2, NULL, 0);
+      char *kib_str = strtok(NULL, " \t\r\n");
+      uint32_t sectors = kib_str ? (uint32_t)strtoul(kib_str, NULL, 0) * 2
+                                 : 8192; // 4 MiB
+      if (arg2[0] < '0' || arg2[0] > '9') {
+        // another driver's disk by block device name, e.g. sd0
+        blkdev_t *dev = dsk_find(arg2);
+        void *buf = dev ? kmalloc(BENCH_CHUNK_SECTORS * 512) : NULL;
+        if (!buf) {
+          printf("bench: %s\n", dev ? "OOM" : "no such device");
+          return;
+        }
+        if (sectors == 0 || sectors > dev->sectors)
+          sectors = (uint32_t)dev->sectors;
+        dsk_bench_pass(dev->name, dev, sectors, buf);
+        dsk_bench_queued(dev, sectors, buf);
+        dsk_bench_cached(dev, sectors, buf);
+        kfree(buf);
+        return;
+      }
+      if (drive_ul > 3 || !ide_devices[drive_ul].reserved ||
+          ide_devices[drive_ul].type != 0) {
+        printf("bench: drive %lu is not an ATA disk\n", drive_ul);
+        return;
+      }
+      if (sectors == 0 || sectors > ide_devices[drive_ul].size)
+        sectors = (uint32_t)ide_devices[drive_ul].size;
+
+      void *buf = kmalloc(BENCH_CHUNK_SECTORS * 512);
+      if (!buf) {
+        printf("bench: OOM\n");
+        return;
+      }
+      blkdev_t *dev = ide_get_blkdev((unsigned char)drive_ul);
+      bool was = ide_set_dma(true);
+      dsk_bench_pass("DMA", dev, sectors, buf);
+      dsk_bench_queued(dev, sectors, buf);
+      dsk_bench_cached(dev, sectors, buf);
+      ide_set_dma(false);
+      dsk_bench_pass("PIO", dev, sectors, buf);
+      ide_set_dma(was);
+      kfree(buf);
+    } else if (strcmp(arg, "bench2") == 0) {
+      // dsk bench2 <drive> <drive> [KiB]: each alone, then both together
+      char *drive2_str = strtok(NULL, " \t\r\n");
+      char *kib_str = strtok(NULL, " \t\r\n");
+      blkdev_t *devs[2] = {NULL, NULL};
+      unsigned char drives[2];
+      if (arg2 && drive2_str) {
+        drives[0] = (unsigned char)strtoul(arg2, NULL, 0);
+        drives[1] = (unsigned char)strtoul(drive2_str, NULL, 0);
+        devs[0] = ide_get_blkdev(drives[0]);
+        devs[1] = ide_get_blkdev(drives[1]);
+      }
+      if (!devs[0] || !devs[1] || devs[0] == devs[1]) {
+        printf("usage: dsk bench2 <drive> <drive> [KiB] (two ATA disks)\n");
+        return;
+      }
+      uint32_t sectors = kib_str ? (uint32_t)strtoul(kib_str, NULL, 0) * 2
+                                 : 8192; // 4 MiB each
+      for (int i = 0; i < 2; i++)
+        if (sectors == 0 || sectors > devs[i]->sectors)
+          sectors = (uint32_t)devs[i]->sectors;
+
+      void *bufs[2];
+      bufs[0] = kmalloc(BENCH_CHUNK_SECTORS * 512);
+      bufs[1] = kmalloc(BENCH_CHUNK_SECTORS * 512);
+      if (!bufs[0] || !bufs[1]) {
+        printf("bench2: OOM\n");
+        kfree(bufs[0]);
+        kfree(bufs[1]);
+        return;
+      }
+      if (ide_devices[drives[0]].channel == ide_devices[drives[1]].channel)
+        printf("note: same channel, the drives take turns\n");
+      dsk_bench_parallel(devs[0]->name, &devs[0], 1, sectors, &bufs[0]);
+      dsk_bench_parallel(devs[1]->name, &devs[1], 1, sectors, &bufs[1]);
+      dsk_bench_parallel("both", devs, 2, sectors, bufs);
+      kfree(bufs[0]);
+      kfree(bufs[1]);
+    } else if (strcmp(arg, "stats") == 0) {
+      for (unsigned i = 0; i < blk_count(); i++) {
+        const blkdev_t *dev = blk_get(i);
+        const blk_stats_t *st = &dev->stats;
+        printf("%s: %llu bios, %llu requests (%llu merged, %llu expired)\n",
+               dev->name, st->bios, st->requests, st->merges, st->expired);
+        printf("     read %llu KiB, written %llu KiB, %llu errors"
+               " (last: %s)\n",
+               st->sectors[BIO_READ] / 2, st->sectors[BIO_WRITE] / 2,
+               st->errors, blk_strerror(dev->last_error));
+        printf("     %llu flushes, %llu FUA writes\n", st->flushes, st->fua);
+      }
+    } else if (strcmp(arg, "cache") == 0 || strcmp(arg, "flush") == 0) {
+      // dsk cache <drive> [writeback|writethrough], dsk flush <drive>
+      blkdev_t *dev = dsk_find(arg2);
+      if (!dev) {
+        printf("usage: dsk %s <drive> (ATA drive 0..3 or sdN)\n", arg);
+        return;
+      }
+      char *policy = strtok(NULL, " \t\r\n");
+      if (strcmp(arg, "flush") == 0) {
+        int err = blk_flush(dev);
+        if (err)
+          printf("flush: %s\n", blk_strerror(err));
+      } else if (policy && strcmp(policy, "writeback") == 0) {
+        blk_set_write_cache(dev, BLK_WC_WRITEBACK);
+      } else if (policy && strcmp(policy, "writethrough") == 0) {
+        blk_set_write_cache(dev, BLK_WC_WRITETHROUGH);
+      } else if (policy) {
+        printf("cache: writeback or writethrough\n");
+      } else {
+        printf("%s: %s%s\n", dev->name,
+               dev->write_cache == BLK_WC_WRITETHROUGH ? "writethrough"
+                                                       : "writeback",
+               (dev->features & BLK_FEAT_WCACHE) ? ""
+                                                 : " (drive has no cache)");
+      }
     } else {
       printf("dsk: unknown subcommand: %s\n", arg);
     }
@@ -244,29 +729,19 @@ void analyze_cmd(char *cmd, uint32_t mem_high_bytes) {
 }
 
 void loop(uint32_t mem_high_bytes) {
-  printf("> ");
-  char input_buf[64] = {0};
+  char input_buf[64];
   for (;;) {
-    char ch;
-    if (read(STDIN_FILENO, &ch, 1) > 0) {
-      if (ch == '\n') {
-        analyze_cmd(input_buf, mem_high_bytes);
-        memset(input_buf, 0, sizeof input_buf);
-        printf("\n> ");
-      } else if (ch == '\b') {
-        size_t L = strlen(input_buf);
-        if (L) {
-          input_buf[L - 1] = '\0';
-          printf("\b \b");
-        }
-      } else {
-        size_t L = strlen(input_buf);
-        if (L + 1 < sizeof input_buf) {
-          input_buf[L] = ch;
-          input_buf[L + 1] = '\0';
-        }
-        printf("%c", ch);
-      }
+    printf("> ");
+    // the tty line discipline echoes and edits; read() sleeps until Enter
+    long n = read(STDIN_FILENO, input_buf, sizeof input_buf - 1);
+    if (n <= 0)
+      continue;
+    input_buf[n] = '\0';
+    if (input_buf[n - 1] != '\n') {
+      char ch; // line longer than the buffer: drop the rest
+      while (read(STDIN_FILENO, &ch, 1) > 0 && ch != '\n')
+        ;
     }
+    analyze_cmd(input_buf, mem_high_bytes);
   }
 }
@@ -1,21 +1,21 @@
 #include "kernel/sleep.h"
 
-#include <arch/i686/irq.h>
-#include <stdio.h>
+#include <kernel/clocksource.h>
+#include <kernel/timer.h>
+#include <kernel/wait.h>
+#include <stdbool.h>
 
-uint32_t countdown = 0;
+static wait_queue_t sleep_wait = WAIT_QUEUE_INIT;
 
-void sleep(uint32_t ms) {
-    countdown = (ms * 100 + 999) / 1000;
-    while (countdown > 0) {
-        __asm__ volatile("hlt");
-    }
+static void sleep_expired(void *data) {
+    *(volatile bool *)data = true;
+    wake_up(&sleep_wait);
 }
 
-void time_tick(registers *regs) {
-    if (countdown > 0) {
-        countdown--;
-    }
+void sleep(uint32_t ms) {
+    volatile bool done = false;
+    ktimer_t timer = {0};
+    timer_add(&timer, ktime_get_ns() + (uint64_t)ms * 1000000u,
+              sleep_expired, (void *)&done);
+    wait_event(&sleep_wait, done);
 }
-
-void init_sleep() { i686_irq_register_handler(0, time_tick); }
\ No newline at end of file
@@ -0,0 +1,49 @@
+#include "kernel/softirq.h"
+
+#include <arch/i686/io.h>
+#include <stddef.h>
+
+// FIFO of scheduled tasklets; only touched with interrupts off
+static tasklet_t *queue_head = NULL;
+static tasklet_t *queue_tail = NULL;
+// Set while softirq_run() is draining, so IRQs that arrive meanwhile leave
+// their work to the outer loop instead of recursing on the stack.
+static bool softirq_active = false;
+
+void tasklet_schedule(tasklet_t *t) {
+  uint32_t flags = i686_irq_save();
+  if (!t->scheduled) {
+    t->scheduled = true;
+    t->next = NULL;
+    if (queue_tail)
+      queue_tail->next = t;
+    else
+      queue_head = t;
+    queue_tail = t;
+  }
+  i686_irq_restore(flags);
+}
+
+void softirq_run(void) {
+  uint32_t flags = i686_irq_save();
+  if (softirq_active) {
+    i686_irq_restore(flags);
+    return;
+  }
+  softirq_active = true;
+
+  while (queue_head) {
+    tasklet_t *t = queue_head;
+    queue_head = t->next;
+    if (!queue_head)
+      queue_tail = NULL;
+    t->scheduled = false; // may be re-queued by the IRQs it lets in
+
+    i686_interrupts_enable();
+    t->func(t->data);
+    i686_interrupts_disable();
+  }
+
+  softirq_active = false;
+  i686_irq_restore(flags);
+}
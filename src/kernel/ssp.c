@@ -1,3 +1,4 @@
+#include <kernel/tty.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -7,6 +8,7 @@ uintptr_t __stack_chk_guard = STACK_CHK_GUARD;
 
 __attribute__((noreturn)) void __stack_chk_fail(void) {
   printf("Stack smashing detected!");
+  terminal_flush();
   while (1)
     ;
 }
\ No newline at end of file
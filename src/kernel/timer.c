@@ -0,0 +1,304 @@
+#include "kernel/timer.h"
+
+#include <arch/i686/io.h>
+#include <kernel/clockevent.h>
+#include <kernel/clocksource.h>
+#include <kernel/softirq.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/* ---------- Hierarchical timing wheel ----------
+ * Four levels of 64 slots. Level 0 slots are one tick wide; level L slots
+ * are 64^L ticks wide and are cascaded down into the finer levels when the
+ * level below wraps. Insert and expiry are O(1); each timer cascades at
+ * most three times. */
+#define TIMER_TICK_SHIFT 20 // wheel tick = 2^20 ns (~1.05 ms)
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1u << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_MAX_DELTA ((1ull << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+// Housekeeping period: keeps the clocksource folded even when idle
+#define TIMEKEEPING_PERIOD_NS 1000000000ull
+// Tick rate when there is no clocksource and the clockevent runs periodic
+#define FALLBACK_HZ 1000
+
+static ktimer_t *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static uint64_t occupied[WHEEL_LEVELS]; // bit N = wheel[level][N] non-empty
+static uint64_t wheel_clk = 0;          // next tick to process
+// Due timers waiting for their callback; level == EXPIRED_LEVEL marks them
+#define EXPIRED_LEVEL 0xFF
+static ktimer_t *expired_list = NULL;
+
+static const clockevent *event_dev = NULL;
+static bool timers_running = false;
+static bool periodic = false;
+static uint64_t programmed_tick = UINT64_MAX; // when the device will fire
+
+static inline uint64_t ns_to_tick_up(uint64_t ns) {
+  return (ns + (1ull << TIMER_TICK_SHIFT) - 1) >> TIMER_TICK_SHIFT;
+}
+
+/* ---------- Fallback time base: counts periodic interrupts ---------- */
+static volatile uint64_t jiffies = 0;
+
+static uint64_t jiffies_read(void) { return jiffies; }
+
+static clocksource jiffies_clocksource = {
+    .name = "jiffies",
+    .read = &jiffies_read,
+    .mask = ~0ull,
+    .freq_hz = FALLBACK_HZ,
+    .rating = 1,
+    .next = NULL,
+};
+
+/* ---------- Wheel lists (callers hold interrupts off) ---------- */
+static inline ktimer_t **list_head(unsigned level, unsigned slot) {
+  return level == EXPIRED_LEVEL ? &expired_list : &wheel[level][slot];
+}
+
+static void wheel_link(ktimer_t *t, unsigned level, unsigned slot) {
+  ktimer_t **head = list_head(level, slot);
+  t->level = (uint8_t)level;
+  t->slot = (uint8_t)slot;
+  t->prev = NULL;
+  t->next = *head;
+  if (*head)
+    (*head)->prev = t;
+  *head = t;
+  if (level != EXPIRED_LEVEL)
+    occupied[level] |= 1ull << slot;
+}
+
+static void wheel_unlink(ktimer_t *t) {
+  ktimer_t **head = list_head(t->level, t->slot);
+  if (t->prev)
+    t->prev->next = t->next;
+  else
+    *head = t->next;
+  if (t->next)
+    t->next->prev = t->prev;
+  if (!*head && t->level != EXPIRED_LEVEL)
+    occupied[t->level] &= ~(1ull << t->slot);
+  t->next = t->prev = NULL;
+}
+
+static void wheel_insert(ktimer_t *t) {
+  uint64_t expires = t->expires;
+  if ((int64_t)(expires - wheel_clk) < 0)
+    expires = wheel_clk; // overdue: fire on the next pass
+  uint64_t delta = expires - wheel_clk;
+  if (delta > WHEEL_MAX_DELTA) {
+    expires = wheel_clk + WHEEL_MAX_DELTA; // re-queued from there
+    delta = WHEEL_MAX_DELTA;
+  }
+
+  unsigned level = 0;
+  while (level < WHEEL_LEVELS - 1 &&
+         delta >= (1ull << (WHEEL_BITS * (level + 1))))
+    level++;
+  wheel_link(t, level, (expires >> (WHEEL_BITS * level)) & WHEEL_MASK);
+}
+
+/* Re-file every timer of one coarse slot; returns the slot index */
+static unsigned wheel_cascade(unsigned level) {
+  unsigned slot = (wheel_clk >> (WHEEL_BITS * level)) & WHEEL_MASK;
+  ktimer_t *t = wheel[level][slot];
+  wheel[level][slot] = NULL;
+  occupied[level] &= ~(1ull << slot);
+  while (t) {
+    ktimer_t *next = t->next;
+    wheel_insert(t);
+    t = next;
+  }
+  return slot;
+}
+
+/* First occupied slot index >= from in a 64-bit map, or 64 */
+static unsigned first_slot_from(uint64_t map, unsigned from) {
+  map &= ~0ull << from;
+  return map ? (unsigned)__builtin_ctzll(map) : WHEEL_SIZE;
+}
+
+/* Earliest tick at which the wheel has work (an expiry or a cascade) */
+static uint64_t wheel_next_tick(void) {
+  uint64_t best = UINT64_MAX;
+
+  unsigned idx = wheel_clk & WHEEL_MASK;
+  unsigned s = first_slot_from(occupied[0], idx);
+  if (s < WHEEL_SIZE)
+    best = wheel_clk - idx + s;
+  else if (occupied[0])
+    best = wheel_clk - idx + WHEEL_SIZE + first_slot_from(occupied[0], 0);
+
+  for (unsigned level = 1; level < WHEEL_LEVELS; level++) {
+    uint64_t map = occupied[level];
+    unsigned shift = WHEEL_BITS * level;
+    uint64_t period = 1ull << (shift + WHEEL_BITS);
+    uint64_t base = wheel_clk & ~(period - 1);
+    while (map) {
+      unsigned slot = (unsigned)__builtin_ctzll(map);
+      map &= map - 1;
+      uint64_t when = base + ((uint64_t)slot << shift);
+      if (when < wheel_clk)
+        when += period;
+      if (when < best)
+        best = when;
+    }
+  }
+  return best;
+}
+
+/* Advance the wheel through now_tick, moving everything due to expired_list */
+static void wheel_collect(uint64_t now_tick) {
+  while (wheel_clk <= now_tick) {
+    unsigned idx = wheel_clk & WHEEL_MASK;
+    if (idx == 0) {
+      for (unsigned level = 1; level < WHEEL_LEVELS; level++)
+        if (wheel_cascade(level) != 0)
+          break;
+    }
+
+    ktimer_t *t = wheel[0][idx];
+    wheel[0][idx] = NULL;
+    occupied[0] &= ~(1ull << idx);
+    while (t) {
+      ktimer_t *next = t->next;
+      wheel_link(t, EXPIRED_LEVEL, 0);
+      t = next;
+    }
+
+    // Skip empty slots: jump to the next busy one or to the next wrap
+    unsigned s = first_slot_from(occupied[0], idx + 1);
+    uint64_t next = (s < WHEEL_SIZE) ? wheel_clk - idx + s
+                                     : (wheel_clk | WHEEL_MASK) + 1;
+    wheel_clk = (next <= now_tick) ? next : now_tick + 1;
+  }
+}
+
+/* ---------- Clockevent programming ---------- */
+static void timer_program_next(void) {
+  // before timer_init the device keeps the tick the PIC setup gave it
+  if (!event_dev || periodic || !timers_running)
+    return;
+  uint64_t next = wheel_next_tick();
+  uint64_t now = ktime_get_ns();
+  uint64_t delta = event_dev->max_delta_ns;
+  if (next != UINT64_MAX) {
+    uint64_t deadline = next << TIMER_TICK_SHIFT;
+    delta = deadline > now ? deadline - now : 0;
+  }
+  if (delta < event_dev->min_delta_ns)
+    delta = event_dev->min_delta_ns;
+  if (delta > event_dev->max_delta_ns)
+    delta = event_dev->max_delta_ns;
+  programmed_tick = (now + delta) >> TIMER_TICK_SHIFT;
+  event_dev->set_next_event(delta);
+}
+
+static void timer_run(void *data) {
+  (void)data;
+  uint32_t flags = i686_irq_save();
+  wheel_collect(ktime_get_ns() >> TIMER_TICK_SHIFT);
+  // Pop one at a time: callbacks may add or delete any timer, this one too
+  while (expired_list) {
+    ktimer_t *t = expired_list;
+    wheel_unlink(t);
+    if (t->expires >= wheel_clk) {
+      wheel_insert(t); // clamped long timer: not due yet
+      continue;
+    }
+    t->pending = false;
+    timer_cb_t cb = t->cb;
+    void *cb_data = t->data;
+    i686_irq_restore(flags);
+    cb(cb_data);
+    flags = i686_irq_save();
+  }
+  timer_program_next();
+  i686_irq_restore(flags);
+}
+
+static tasklet_t timer_tasklet = TASKLET_INIT(timer_run, NULL);
+
+/* ---------- Public API ---------- */
+void timer_add(ktimer_t *t, uint64_t deadline_ns, timer_cb_t cb, void *data) {
+  uint32_t flags = i686_irq_save();
+  if (t->pending)
+    wheel_unlink(t);
+  t->cb = cb;
+  t->data = data;
+  t->expires = ns_to_tick_up(deadline_ns);
+  t->pending = true;
+  wheel_insert(t);
+  if (timers_running && wheel_next_tick() < programmed_tick)
+    timer_program_next(); // new earliest deadline
+  i686_irq_restore(flags);
+}
+
+bool timer_del(ktimer_t *t) {
+  uint32_t flags = i686_irq_save();
+  bool was_pending = t->pending;
+  if (was_pending) {
+    wheel_unlink(t);
+    t->pending = false;
+  }
+  i686_irq_restore(flags);
+  return was_pending;
+}
+
+void clockevent_register(const clockevent *ce) {
+  if (!ce || !ce->set_next_event)
+    return;
+  if (!event_dev || ce->rating > event_dev->rating) {
+    if (event_dev && event_dev->shutdown)
+      event_dev->shutdown();
+    event_dev = ce;
+    if (timers_running)
+      timer_program_next();
+  }
+}
+
+void clockevent_handle_interrupt(void) {
+  if (periodic)
+    jiffies++;
+  tasklet_schedule(&timer_tasklet);
+}
+
+static ktimer_t timekeeping_timer;
+
+static void timekeeping_timer_fn(void *data) {
+  (void)data;
+  timekeeping_tick();
+  timer_add(&timekeeping_timer, ktime_get_ns() + TIMEKEEPING_PERIOD_NS,
+            timekeeping_timer_fn, NULL);
+}
+
+void timer_init(void) {
+  if (!event_dev) {
+    printf("timer: no clockevent device\n");
+    return;
+  }
+
+  // Without a clocksource, time is counted in periodic interrupts
+  if (!clocksource_available() && event_dev->set_periodic) {
+    periodic = true;
+    clocksource_register(&jiffies_clocksource);
+    event_dev->set_periodic(FALLBACK_HZ);
+  }
+
+  uint32_t flags = i686_irq_save();
+  // Anything armed before now was filed against tick 0: catch the wheel up
+  // (due ones wait on expired_list for the first run)
+  wheel_collect(ktime_get_ns() >> TIMER_TICK_SHIFT);
+  timers_running = true;
+  if (expired_list)
+    tasklet_schedule(&timer_tasklet);
+  i686_irq_restore(flags);
+
+  timekeeping_timer_fn(NULL);
+  printf("timer: %s, %s\n", event_dev->name,
+         periodic ? "periodic" : "one-shot");
+}
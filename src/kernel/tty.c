@@ -1,4 +1,7 @@
 #include <arch/i686/io.h>
+#include <kernel/clocksource.h>
+#include <kernel/console.h>
+#include <kernel/timer.h>
 #include <kernel/tty.h>
 #include <kernel/vga.h>
 #include <stdbool.h>
@@ -17,16 +20,58 @@ static size_t screen_x = 0,
               screen_y = 0; // caret (column,row) in the *viewport* end
 
 // ===== Scrollback state =====
-// You can tune this depth. 1024 lines ≈ 1024*80*2
-#define SCROLLBACK_LINES 1024
-
-static uint16_t
-    scrollbuf[SCROLLBACK_LINES * SCREEN_WIDTH]; // ring buffer of lines
-static size_t tail_line = 0; // monotonic logical index of the *current* line
+// The newest screenful lives uncompressed in `live` (it is still being
+// edited). Older lines move to a byte ring `arena` as variable-length
+// records: trimmed text plus (count, attr) runs. Each record starts with its
+// own lengths, so lines are found by walking forward from the oldest record
+// or from a sparse checkpoint kept every SB_CHECKPOINT lines. Both depths can
+// be tuned at build time.
+#ifndef SCROLLBACK_LINES
+#define SCROLLBACK_LINES 32768 // history lines kept (beyond the screen)
+#endif
+#ifndef SCROLLBACK_ARENA_SIZE
+#define SCROLLBACK_ARENA_SIZE (128 * 1024) // bytes of record storage
+#endif
+_Static_assert((SCROLLBACK_ARENA_SIZE & (SCROLLBACK_ARENA_SIZE - 1)) == 0,
+               "SCROLLBACK_ARENA_SIZE must be a power of two");
+#define SB_CHECKPOINT_SHIFT 6
+#define SB_CHECKPOINT (1u << SB_CHECKPOINT_SHIFT) // lines per checkpoint
+#define SB_CHECKPOINTS (SCROLLBACK_LINES / SB_CHECKPOINT)
+_Static_assert(SCROLLBACK_LINES % SB_CHECKPOINT == 0,
+               "SCROLLBACK_LINES must be a multiple of SB_CHECKPOINT");
+
+static uint16_t live[SCREEN_HEIGHT][SCREEN_WIDTH]; // row = line % HEIGHT
+static uint8_t arena[SCROLLBACK_ARENA_SIZE];
+// Arena offset of every line that is a multiple of SB_CHECKPOINT
+static uint32_t checkpoints[SB_CHECKPOINTS];
+static uint32_t arena_head = 0; // monotonic write offset (wraps mod size)
+static uint32_t arena_tail = 0; // offset of the oldest record
+static size_t hist_count = 0;   // lines held in the arena
+// The first screenful is treated as existing (blank) lines so that viewport
+// row y always maps to line (tail_line - (SCREEN_HEIGHT-1) + y).
+static size_t tail_line =
+    SCREEN_HEIGHT - 1; // monotonic logical index of the *current* line
 static size_t sb_count =
-    0; // number of valid lines stored (<= SCROLLBACK_LINES)
+    SCREEN_HEIGHT; // valid lines: hist_count + one live screenful
 static size_t view_offset = 0; // 0=bottom; N lines above bottom when scrolled
 
+// ===== Deferred repaint state =====
+// live + arena are the source of truth; the display is only refreshed by
+// terminal_flush(), which repaints the rows flagged here.
+#define ALL_ROWS_DIRTY ((1u << SCREEN_HEIGHT) - 1u)
+static uint32_t dirty_rows = ALL_ROWS_DIRTY; // bit N = viewport row N is stale
+static bool cursor_dirty = true;
+static size_t pending_scroll = 0; // rows the display must shift up at flush
+// Nesting depth of mainline tty calls; IRQ-context flushes back off while
+// it is non-zero so they never observe a half-updated scrollback.
+static volatile int tty_busy = 0;
+// Viewport moves requested while the tty was busy; applied by the next flush
+static int pending_view_delta = 0;
+// Output is repainted by a timer shortly after it is written, coalescing
+// bursts into at most ~100 repaints a second
+#define FLUSH_DELAY_NS 10000000ull
+static ktimer_t flush_timer;
+
 /* ---------- Low-level cursor ---------- */
 static void hw_set_cursor_pos(size_t pos) {
   i686_outb(0x3D4, 0x0F);
@@ -47,19 +92,142 @@ void disable_cursor(void) {
   i686_outb(0x3D5, 0x20);
 }
 
+/* ---------- VGA text backend (default console) ---------- */
+static void vga_draw_row(size_t row, const uint16_t *cells, size_t cols) {
+  volatile uint16_t *dst = &screen_buffer[row * SCREEN_WIDTH];
+  for (size_t x = 0; x < cols; ++x)
+    dst[x] = cells[x];
+}
+
+static void vga_set_cursor(size_t x, size_t y, bool visible) {
+  if (visible) {
+    set_cursor(x, y);
+    enable_cursor(0, 15);
+  } else {
+    disable_cursor();
+  }
+}
+
+static const console_driver vga_text_console = {
+    .name = "VGA text",
+    .draw_row = &vga_draw_row,
+    .scroll = NULL, // rewriting 4 KiB of VRAM beats reading it back
+    .set_cursor = &vga_set_cursor,
+    .present = NULL,
+};
+
+static const console_driver *console = &vga_text_console;
+
 /* ---------- Scrollback helpers ---------- */
-static inline uint16_t *sb_line_ptr(size_t line_number) {
-  // map monotonic line number to circular buffer row
-  return &scrollbuf[(line_number % SCROLLBACK_LINES) * SCREEN_WIDTH];
+static inline uint16_t *sb_live_ptr(size_t line_number) {
+  return live[line_number % SCREEN_HEIGHT];
 }
 
 static void sb_clear_line(size_t line_number) {
   uint16_t blank = vga_entry(' ', terminal_color);
-  uint16_t *row = sb_line_ptr(line_number);
+  uint16_t *row = sb_live_ptr(line_number);
   for (size_t x = 0; x < SCREEN_WIDTH; ++x)
     row[x] = blank;
 }
 
+static void arena_write(uint32_t off, const uint8_t *src, size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    arena[(off + i) & (SCROLLBACK_ARENA_SIZE - 1)] = src[i];
+}
+
+static inline uint8_t arena_byte(uint32_t off) {
+  return arena[off & (SCROLLBACK_ARENA_SIZE - 1)];
+}
+
+/* Record layout: len, fill attr, nruns, text[len], {count, attr}[nruns].
+ * Cells past len are blanks in the fill attribute. */
+#define SB_RECORD_MAX (3 + SCREEN_WIDTH * 3)
+
+static inline uint32_t sb_record_size(uint32_t off) {
+  return 3 + arena_byte(off) + 2u * arena_byte(off + 2);
+}
+
+/* Move a line that scrolled out of the live screenful into the arena */
+static void sb_store_line(size_t line_number, const uint16_t *cells) {
+  uint8_t rec[SB_RECORD_MAX];
+  uint8_t fill = (uint8_t)(cells[SCREEN_WIDTH - 1] >> 8);
+  size_t len = SCREEN_WIDTH;
+  while (len && cells[len - 1] == vga_entry(' ', fill))
+    len--;
+
+  size_t n = 3;
+  for (size_t x = 0; x < len; ++x)
+    rec[n++] = (uint8_t)(cells[x] & 0xFF);
+  size_t nruns = 0;
+  for (size_t x = 0; x < len;) {
+    uint8_t attr = (uint8_t)(cells[x] >> 8);
+    size_t run = 1;
+    while (x + run < len && (uint8_t)(cells[x + run] >> 8) == attr)
+      run++;
+    rec[n++] = (uint8_t)run;
+    rec[n++] = attr;
+    nruns++;
+    x += run;
+  }
+  rec[0] = (uint8_t)len;
+  rec[1] = fill;
+  rec[2] = (uint8_t)nruns;
+
+  // Drop the oldest lines until the depth limit and the arena have room
+  while (hist_count && (hist_count == SCROLLBACK_LINES ||
+                        arena_head + n - arena_tail > SCROLLBACK_ARENA_SIZE)) {
+    arena_tail += sb_record_size(arena_tail);
+    hist_count--;
+  }
+
+  if ((line_number & (SB_CHECKPOINT - 1)) == 0)
+    checkpoints[(line_number >> SB_CHECKPOINT_SHIFT) % SB_CHECKPOINTS] =
+        arena_head;
+  arena_write(arena_head, rec, n);
+  arena_head += n;
+  hist_count++;
+}
+
+/* Arena offset of an archived line: start at the nearest checkpoint at or
+ * below it (or the oldest record if that checkpoint was dropped) and skip
+ * forward at most SB_CHECKPOINT - 1 records. */
+static uint32_t sb_find_line(size_t line_number) {
+  size_t oldest = tail_line + 1 - SCREEN_HEIGHT - hist_count;
+  size_t line = line_number & ~(size_t)(SB_CHECKPOINT - 1);
+  uint32_t off;
+  if (line >= oldest) {
+    off = checkpoints[(line >> SB_CHECKPOINT_SHIFT) % SB_CHECKPOINTS];
+  } else {
+    line = oldest;
+    off = arena_tail;
+  }
+  for (; line < line_number; ++line)
+    off += sb_record_size(off);
+  return off;
+}
+
+/* Expand an archived line into out[SCREEN_WIDTH] */
+static void sb_load_line(size_t line_number, uint16_t *out) {
+  uint32_t off = sb_find_line(line_number);
+  size_t len = arena_byte(off);
+  uint8_t fill = arena_byte(off + 1);
+  size_t nruns = arena_byte(off + 2);
+  uint32_t text = off + 3;
+  uint32_t runs = text + len;
+
+  size_t x = 0;
+  for (size_t r = 0; r < nruns; ++r) {
+    size_t count = arena_byte(runs + 2 * r);
+    uint16_t attr = (uint16_t)arena_byte(runs + 2 * r + 1) << 8;
+    while (count-- && x < len) {
+      out[x] = attr | arena_byte(text + x);
+      x++;
+    }
+  }
+  for (; x < SCREEN_WIDTH; ++x)
+    out[x] = vga_entry(' ', fill);
+}
+
 /* Compute how many lines we can scroll up at most */
 static size_t max_view_offset(void) {
   if (sb_count <= SCREEN_HEIGHT)
@@ -67,48 +235,48 @@ static size_t max_view_offset(void) {
   return sb_count - SCREEN_HEIGHT;
 }
 
-/* Redraw current viewport from scrollback into VGA memory */
+/* First logical line shown at the top of the viewport */
+static size_t view_start_line(void) {
+  size_t end_line = tail_line - view_offset;
+  return (end_line >= (SCREEN_HEIGHT - 1)) ? (end_line - (SCREEN_HEIGHT - 1))
+                                           : 0;
+}
+
+/* Is this logical line still held in the scrollback ring? */
+static bool sb_has_line(size_t line_number) {
+  size_t oldest = tail_line + 1 - sb_count;
+  return line_number >= oldest && line_number <= tail_line;
+}
+
+/* Cells of a stored line: live rows in place, archived ones expanded into
+ * tmp. Returns NULL when the line is gone. */
+static const uint16_t *sb_line_cells(size_t line_number, uint16_t *tmp) {
+  if (!sb_has_line(line_number))
+    return NULL;
+  if (line_number + SCREEN_HEIGHT > tail_line)
+    return sb_live_ptr(line_number);
+  sb_load_line(line_number, tmp);
+  return tmp;
+}
+
+/* Invalidate the whole viewport; the next flush repaints every row */
 static void blit_view(void) {
-  // End line shown: tail_line - view_offset
-  // Start line shown: end - (SCREEN_HEIGHT-1)
-  size_t end_line =
-      (view_offset <= (size_t)INT32_MAX) ? (tail_line - view_offset) : 0;
-  size_t start_line =
-      (end_line >= (SCREEN_HEIGHT - 1)) ? (end_line - (SCREEN_HEIGHT - 1)) : 0;
-
-  // Oldest stored line number (monotonic)
-  size_t oldest = (sb_count > 0) ? (tail_line + 1 - sb_count) : 0;
-
-  // For each row of the screen, copy from scrollback if available; otherwise
-  // blanks
-  uint16_t blank = vga_entry(' ', terminal_color);
-  for (size_t row = 0; row < SCREEN_HEIGHT; ++row) {
-    size_t src_line = start_line + row;
-    volatile uint16_t *dst = &screen_buffer[row * SCREEN_WIDTH];
+  dirty_rows = ALL_ROWS_DIRTY;
+  cursor_dirty = true;
+  pending_scroll = 0;
+}
 
-    if (sb_count == 0 || src_line < oldest || src_line > tail_line) {
-      for (size_t x = 0; x < SCREEN_WIDTH; ++x)
-        dst[x] = blank;
-    } else {
-      uint16_t *src = sb_line_ptr(src_line);
-      // copy whole line
-      for (size_t x = 0; x < SCREEN_WIDTH; ++x)
-        dst[x] = src[x];
-    }
-  }
+/* Hand one viewport row from scrollback to the console backend */
+static void repaint_row(size_t row, size_t start_line) {
+  uint16_t tmp[SCREEN_WIDTH];
+  const uint16_t *cells = sb_line_cells(start_line + row, tmp);
 
-  // Cursor: show only when following the bottom
-  if (view_offset == 0) {
-    // caret is on the end line (tail_line)
-    size_t cursor_row =
-        (tail_line >= start_line) ? (tail_line - start_line) : 0;
-    if (cursor_row >= SCREEN_HEIGHT)
-      cursor_row = SCREEN_HEIGHT - 1;
-    set_cursor(screen_x, cursor_row);
-    enable_cursor(0, 15);
-  } else {
-    disable_cursor();
+  if (!cells) {
+    for (size_t x = 0; x < SCREEN_WIDTH; ++x)
+      tmp[x] = vga_entry(' ', terminal_color);
+    cells = tmp;
   }
+  console->draw_row(row, cells, SCREEN_WIDTH);
 }
 
 /* Jump back to bottom if user had scrolled up and new output comes */
@@ -123,13 +291,27 @@ static void follow_bottom_if_scrolled(void) {
 static void advance_lines(size_t lines) {
   while (lines--) {
     tail_line++;
-    if (sb_count < SCROLLBACK_LINES)
-      sb_count++;
-    // clear the new tail line before writing into it
+    // the oldest live line shares the new line's slot: archive it first
+    size_t leaving = tail_line - SCREEN_HEIGHT;
+    sb_store_line(leaving, sb_live_ptr(leaving));
+    sb_count = hist_count + SCREEN_HEIGHT;
     sb_clear_line(tail_line);
   }
 }
 
+/* New line at the bottom while following output: queue a one-row shift so
+ * backends that can move pixels only redraw the freshly exposed row */
+static void scroll_forward(void) {
+  advance_lines(1);
+  if (view_offset != 0 || pending_scroll + 1 >= SCREEN_HEIGHT) {
+    blit_view();
+    return;
+  }
+  pending_scroll++;
+  dirty_rows = (dirty_rows >> 1) | (1u << (SCREEN_HEIGHT - 1));
+  cursor_dirty = true;
+}
+
 /* Current logical line number corresponding to a viewport y (when
  * view_offset==0) */
 static size_t line_for_view_y(size_t y) {
@@ -146,22 +328,22 @@ static size_t line_for_view_y(size_t y) {
 void putcell(size_t x, size_t y, uint16_t cell) {
   // write to scrollback line that backs this screen row
   size_t line = line_for_view_y(y);
-  if (sb_count == 0) {
-    sb_count = 1;
-    sb_clear_line(tail_line);
-  }
-  uint16_t *row = sb_line_ptr(line);
+  uint16_t *row = sb_live_ptr(line);
   row[x] = cell;
 
-  // write to visible VGA memory too
-  screen_buffer[y * SCREEN_WIDTH + x] = cell;
+  // VRAM is refreshed lazily by terminal_flush()
+  dirty_rows |= 1u << y;
 }
 uint16_t getcell(size_t x, size_t y) {
-  return screen_buffer[y * SCREEN_WIDTH + x];
+  // read back what the viewport shows (VRAM may lag behind scrollback)
+  uint16_t tmp[SCREEN_WIDTH];
+  const uint16_t *cells = sb_line_cells(view_start_line() + y, tmp);
+  if (!cells)
+    return vga_entry(' ', terminal_color);
+  return cells[x];
 }
 
 void putchr(size_t x, size_t y, char c) {
-  i686_outb(0xe9, c);
   putcell(x, y, vga_entry((unsigned char)c, terminal_color));
 }
 char getchr(size_t x, size_t y) { return (char)(getcell(x, y) & 0xFF); }
@@ -172,31 +354,28 @@ void terminal_set_color(enum vga_color fg, enum vga_color bg) {
 }
 
 void terminal_clear_screen(void) {
-  // reset scrollback
-  tail_line = 0;
-  sb_count = 1;
+  tty_busy++;
+  // reset scrollback: one blank screenful, caret at the top-left
+  tail_line = SCREEN_HEIGHT - 1;
+  sb_count = SCREEN_HEIGHT;
+  hist_count = 0;
+  arena_head = 0;
+  arena_tail = 0;
   view_offset = 0;
-  sb_clear_line(0);
+  for (size_t line = 0; line < SCREEN_HEIGHT; ++line)
+    sb_clear_line(line);
 
-  // fill visible VRAM
-  uint16_t blank = vga_entry(' ', terminal_color);
-  for (size_t i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; ++i) {
-    screen_buffer[i] = blank;
-  }
   screen_x = 0;
   screen_y = 0;
-  enable_cursor(0, 15);
-  set_cursor(screen_x, screen_y);
+  blit_view();
+  tty_busy--;
+  terminal_flush();
 }
 
 /* ---------- Output ---------- */
-void _putc(const char c) {
-  // If user scrolled up, snap back to bottom on new output
-  follow_bottom_if_scrolled();
-
+static void putc_locked(const char c) {
   switch (c) {
   case '\n':
-    i686_outb(0xe9, '\n');
     screen_x = 0;
     // move caret to next logical line
     if (screen_y < SCREEN_HEIGHT - 1) {
@@ -206,26 +385,22 @@ void _putc(const char c) {
       // is bottom
     } else {
       // we need to scroll forward by 1 line (produce a new line at the bottom)
-      advance_lines(1);
-      blit_view();
+      scroll_forward();
     }
     break;
 
   case '\r':
-    i686_outb(0xe9, '\r');
     screen_x = 0;
     break;
 
   case '\t': {
-    i686_outb(0xe9, '\t');
     int spaces = 4 - (int)(screen_x % 4);
     while (spaces-- > 0)
-      _putc(' ');
+      putc_locked(' ');
     break;
   }
 
   case '\b':
-    i686_outb(0xe9, '\b');
     if (screen_x > 0) {
       screen_x--;
       putchr(screen_x, screen_y, ' ');
@@ -234,7 +409,6 @@ void _putc(const char c) {
       screen_x = SCREEN_WIDTH - 1;
       putchr(screen_x, screen_y, ' ');
     }
-    set_cursor(screen_x, screen_y);
     break;
 
   default:
@@ -244,8 +418,7 @@ void _putc(const char c) {
       if (screen_y < SCREEN_HEIGHT - 1) {
         screen_y++;
       } else {
-        advance_lines(1);
-        blit_view();
+        scroll_forward();
       }
     }
     // Ensure the backing line exists (it does by construction)
@@ -260,20 +433,43 @@ void _putc(const char c) {
     if (screen_y < SCREEN_HEIGHT - 1) {
       screen_y++;
     } else {
-      advance_lines(1);
-      blit_view();
+      scroll_forward();
     }
   }
-  set_cursor(screen_x, screen_y);
+  cursor_dirty = true;
+}
+
+static void flush_timer_fn(void *data) {
+  (void)data;
+  terminal_flush();
+}
+
+static void schedule_flush(void) {
+  if (!timer_pending(&flush_timer))
+    timer_add(&flush_timer, ktime_get_ns() + FLUSH_DELAY_NS, flush_timer_fn,
+              NULL);
+}
+
+void _putc(const char c) {
+  tty_busy++;
+  // If user scrolled up, snap back to bottom on new output
+  follow_bottom_if_scrolled();
+  putc_locked(c);
+  tty_busy--;
+  schedule_flush();
 }
 
 void _puts(const char *s) {
+  tty_busy++;
+  follow_bottom_if_scrolled();
   while (*s)
-    _putc(*s++);
+    putc_locked(*s++);
+  tty_busy--;
+  schedule_flush();
 }
 
-/* ---------- User scroll control (call from your keyboard handler) ----------
- */
+/* ---------- Deferred repaint ---------- */
+// Move the viewport; only called with the tty held
 static void scroll_apply_delta(int delta) {
   if (delta == 0)
     return;
@@ -291,21 +487,85 @@ static void scroll_apply_delta(int delta) {
   }
 }
 
+void terminal_flush(void) {
+  // Called from mainline flush points and from tasklets; one that lands in
+  // the middle of an update retries a little later.
+  if (tty_busy) {
+    schedule_flush();
+    return;
+  }
+  tty_busy++;
+
+  uint32_t flags = i686_irq_save();
+  int view_delta = pending_view_delta;
+  pending_view_delta = 0;
+  i686_irq_restore(flags);
+  scroll_apply_delta(view_delta);
+
+  if (pending_scroll) {
+    if (console->scroll)
+      console->scroll(pending_scroll);
+    else
+      dirty_rows = ALL_ROWS_DIRTY;
+    pending_scroll = 0;
+  }
+
+  if (dirty_rows) {
+    size_t start_line = view_start_line();
+    uint32_t rows = dirty_rows;
+    dirty_rows = 0;
+    for (size_t row = 0; row < SCREEN_HEIGHT; ++row)
+      if (rows & (1u << row))
+        repaint_row(row, start_line);
+  }
+
+  if (cursor_dirty) {
+    cursor_dirty = false;
+    // Cursor: show only when following the bottom
+    console->set_cursor(screen_x, screen_y, view_offset == 0);
+  }
+
+  if (console->present)
+    console->present();
+
+  tty_busy--;
+}
+
+void terminal_set_console(const console_driver *drv) {
+  tty_busy++;
+  console = drv ? drv : &vga_text_console;
+  blit_view();
+  tty_busy--;
+  terminal_flush();
+}
+
+/* ---------- User scroll control (called from the keyboard tasklet) ----------
+ */
+static void scroll_request(int delta) {
+  uint32_t flags = i686_irq_save();
+  // Saturate: home/end requests are "as far as it goes"
+  int limit = (int)(SCROLLBACK_LINES + SCREEN_HEIGHT);
+  pending_view_delta += delta;
+  if (pending_view_delta > limit)
+    pending_view_delta = limit;
+  if (pending_view_delta < -limit)
+    pending_view_delta = -limit;
+  i686_irq_restore(flags);
+  // Applies it now unless we interrupted an update in progress
+  terminal_flush();
+}
+
 // Scroll by lines (positive = up, negative = down)
-void terminal_scroll_lines(int delta) { scroll_apply_delta(delta); }
+void terminal_scroll_lines(int delta) { scroll_request(delta); }
 
 // Page up/down by a screenful
-void terminal_scroll_page_up(void) { scroll_apply_delta((int)SCREEN_HEIGHT); }
-void terminal_scroll_page_down(void) {
-  scroll_apply_delta(-(int)SCREEN_HEIGHT);
-}
+void terminal_scroll_page_up(void) { scroll_request((int)SCREEN_HEIGHT); }
+void terminal_scroll_page_down(void) { scroll_request(-(int)SCREEN_HEIGHT); }
 
 // Jump to very top/bottom
 void terminal_scroll_home(void) {
-  view_offset = max_view_offset();
-  blit_view();
+  scroll_request((int)(SCROLLBACK_LINES + SCREEN_HEIGHT));
 }
 void terminal_scroll_end(void) {
-  view_offset = 0;
-  blit_view();
+  scroll_request(-(int)(SCROLLBACK_LINES + SCREEN_HEIGHT));
 }
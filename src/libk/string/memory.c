@@ -1,18 +1,39 @@
 #include "libk/string.h"
 
+#include <stdint.h>
+
+// Bulk copies use rep movsl/stosl; the byte loops only handle the tails.
+
 void memmove(void *dest, const void *src, size_t n) {
-  for (size_t i = 0; i < n; i++)
-    ((char *)dest)[i] = ((char *)src)[i];
+  if ((uintptr_t)dest <= (uintptr_t)src ||
+      (uintptr_t)dest >= (uintptr_t)src + n) {
+    memcpy(dest, src, n); // no harmful overlap: copy forwards
+    return;
+  }
+  // dest overlaps the tail of src: copy backwards
+  for (size_t i = n; i > 0; i--)
+    ((char *)dest)[i - 1] = ((const char *)src)[i - 1];
 }
 
 void memset(void *s, int c, size_t n) {
-  for (size_t i = 0; i < n; i++)
-    ((char *)s)[i] = c;
+  uint32_t fill = (uint8_t)c * 0x01010101u;
+  size_t dwords = n >> 2;
+  void *d = s;
+  asm volatile("cld; rep stosl" : "+D"(d), "+c"(dwords) : "a"(fill) : "memory");
+  for (size_t i = n & ~(size_t)3; i < n; i++)
+    ((char *)s)[i] = (char)c;
 }
 
 void memcpy(void *dest, const void *src, size_t n) {
-  for (size_t i = 0; i < n; i++)
-    ((char *)dest)[i] = ((char *)src)[i];
+  size_t dwords = n >> 2;
+  void *d = dest;
+  const void *s = src;
+  asm volatile("cld; rep movsl"
+               : "+D"(d), "+S"(s), "+c"(dwords)
+               :
+               : "memory");
+  for (size_t i = n & ~(size_t)3; i < n; i++)
+    ((char *)dest)[i] = ((const char *)src)[i];
 }
 
 int memcmp(const void *s1, const void *s2, size_t n) {
@@ -21,4 +42,4 @@ int memcmp(const void *s1, const void *s2, size_t n) {
       return ((char *)s1)[i] - ((char *)s2)[i];
   }
   return 0;
-}
\ No newline at end of file
+}
@@ -37,6 +37,14 @@ char *strchr(const char *str, int ch) {
   return *str == ch ? (char *)str : NULL;
 }
 
+char *strstr(const char *haystack, const char *needle) {
+  size_t n = strlen(needle);
+  for (; *haystack; haystack++)
+    if (memcmp(haystack, needle, n) == 0)
+      return (char *)haystack;
+  return n == 0 ? (char *)haystack : NULL;
+}
+
 static char *s_strtok_save;
 
 static int in_set(char c, const char *set) {